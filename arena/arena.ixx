@@ -0,0 +1,71 @@
+export module arena;
+
+import <algorithm>;
+import <cstddef>;
+import <memory>;
+import <new>;
+import <span>;
+import <type_traits>;
+import <utility>;
+import <vector>;
+
+//Bump allocator: objects are placed one after another in large blocks and are never
+//freed one by one, the whole arena is released at once when it is destroyed.
+//Destructors are not run, so only trivially destructible types can be allocated.
+export class Arena
+{
+	//Blocks double from the first size up to the largest, so a small program
+	//(a REPL line, a declaration of a streamed script) does not take a large block.
+	static constexpr std::size_t FIRST_BLOCK_SIZE = 512;
+	static constexpr std::size_t BLOCK_SIZE = 64 * 1024;
+
+	std::vector<std::unique_ptr<std::byte[]>> m_blocks;
+	std::byte* m_current = nullptr;
+	std::size_t m_left = 0;
+	std::size_t m_allocated = 0;
+
+	void* Allocate(std::size_t size, std::size_t alignment)
+	{
+		auto* ptr = static_cast<void*>(m_current);
+		if (!std::align(alignment, size, ptr, m_left))
+		{
+			//Oversized requests get a block of their own.
+			const auto next_size = std::min(BLOCK_SIZE, FIRST_BLOCK_SIZE << std::min<std::size_t>(m_blocks.size(), 16));
+			const auto block_size = std::max(next_size, size + alignment);
+			m_blocks.push_back(std::make_unique_for_overwrite<std::byte[]>(block_size));
+			ptr = m_blocks.back().get();
+			m_left = block_size;
+			std::align(alignment, size, ptr, m_left);
+		}
+		m_current = static_cast<std::byte*>(ptr) + size;
+		m_left -= size;
+		m_allocated += size;
+		return ptr;
+	}
+public:
+	Arena() = default;
+	Arena(Arena&&) noexcept = default;
+	Arena& operator=(Arena&&) noexcept = default;
+
+	template<class T, class ...Args>
+	T* New(Args&&... args)
+	{
+		static_assert(std::is_trivially_destructible_v<T>, "Arena never runs destructors.");
+		return ::new (Allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+	}
+	//Copies a temporary list into the arena.
+	template<class T>
+	std::span<const T> Copy(const std::vector<T>& values)
+	{
+		static_assert(std::is_trivially_destructible_v<T>, "Arena never runs destructors.");
+		if (values.empty())
+			return {};
+		auto* res = static_cast<T*>(Allocate(sizeof(T) * values.size(), alignof(T)));
+		std::uninitialized_copy(values.begin(), values.end(), res);
+		return { res, values.size() };
+	}
+	std::size_t BytesAllocated() const
+	{
+		return m_allocated;
+	}
+};
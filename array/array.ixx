@@ -0,0 +1,278 @@
+export module array;
+
+import log;
+import value;
+
+import <algorithm>;
+import <cmath>;
+import <cstddef>;
+import <functional>;
+import <new>;
+import <span>;
+import <stdexcept>;
+import <string>;
+import <string_view>;
+import <vector>;
+
+//Contiguous array of numbers. It only holds doubles, so it is never part of a cycle.
+export class ObjArray : public Object
+{
+public:
+	std::vector<double> m_values;
+	explicit ObjArray(std::vector<double> values)
+		: Object(ObjType::ARRAY)
+		, m_values(std::move(values))
+	{}
+	std::string ToString() const override;
+};
+
+//A builtin both backends register as a global.
+//It throws NativeError, the backend reports it at the call.
+export struct NativeFunction
+{
+	std::string_view m_name;
+	int m_arity;
+	Value(*m_function)(int arg_count, const Value* args);
+};
+
+//array(size), len(a), get(a, i), set(a, i, value), push(a, value),
+//and the bulk operations sum(a), dot(a, b), scale(a, k), add(a, b), min(a), max(a), sort(a).
+export std::span<const NativeFunction> ArrayNatives();
+
+module :private;
+
+std::string ObjArray::ToString() const
+{
+	std::string res = "[";
+	for (std::size_t i = 0; i < m_values.size(); ++i)
+	{
+		if (i)
+			res += ", ";
+		AppendValue(res, m_values[i]);
+	}
+	return res + "]";
+}
+
+//The kernels keep LANES independent partial results. A single accumulator is one long dependency
+//chain the compiler may not reorder (that would change the rounding), with lanes the loop
+//is vectorized (SSE2/AVX/NEON, depending on the target), and the lanes are combined at the end.
+//So sum and dot can differ from a Lox loop in the last bits.
+constexpr std::size_t LANES = 4;
+
+static double Sum(std::span<const double> values)
+{
+	double lanes[LANES]{};
+	const auto size = values.size();
+	std::size_t i = 0;
+	for (; i + LANES <= size; i += LANES)
+	{
+		for (std::size_t lane = 0; lane < LANES; ++lane)
+			lanes[lane] += values[i + lane];
+	}
+	auto res = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+	for (; i < size; ++i)
+		res += values[i];
+	return res;
+}
+
+static double Dot(std::span<const double> lhs, std::span<const double> rhs)
+{
+	double lanes[LANES]{};
+	const auto size = lhs.size();
+	std::size_t i = 0;
+	for (; i + LANES <= size; i += LANES)
+	{
+		for (std::size_t lane = 0; lane < LANES; ++lane)
+			lanes[lane] += lhs[i + lane] * rhs[i + lane];
+	}
+	auto res = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+	for (; i < size; ++i)
+		res += lhs[i] * rhs[i];
+	return res;
+}
+
+//Less is std::less for min and std::greater for max, values is not empty.
+template<class Less>
+static double Extreme(std::span<const double> values, Less less)
+{
+	double lanes[LANES];
+	std::fill(std::begin(lanes), std::end(lanes), values[0]);
+	const auto size = values.size();
+	std::size_t i = 0;
+	for (; i + LANES <= size; i += LANES)
+	{
+		for (std::size_t lane = 0; lane < LANES; ++lane)
+			lanes[lane] = less(values[i + lane], lanes[lane]) ? values[i + lane] : lanes[lane];
+	}
+	auto res = lanes[0];
+	for (std::size_t lane = 1; lane < LANES; ++lane)
+		res = less(lanes[lane], res) ? lanes[lane] : res;
+	for (; i < size; ++i)
+		res = less(values[i], res) ? values[i] : res;
+	return res;
+}
+
+static ObjArray& ArrayArg(const Value* args, int index)
+{
+	if (!args[index].IsObjType(ObjType::ARRAY))
+		throw NativeError("Argument " + std::to_string(index + 1) + " must be an array.");
+	return *args[index].As<ObjArray>();
+}
+
+static double NumberArg(const Value* args, int index)
+{
+	if (!args[index].IsNumber())
+		throw NativeError("Argument " + std::to_string(index + 1) + " must be a number.");
+	return args[index].AsNumber();
+}
+
+static std::size_t IndexArg(const ObjArray& array, const Value* args, int index)
+{
+	const auto number = NumberArg(args, index);
+	if (std::floor(number) != number)
+		throw NativeError("Array index must be an integer.");
+	if (number < 0 || number >= static_cast<double>(array.m_values.size()))
+		throw NativeError("Array index " + Stringify(number) + " out of bounds.");
+	return static_cast<std::size_t>(number);
+}
+
+static void CheckSameSize(const ObjArray& lhs, const ObjArray& rhs)
+{
+	if (lhs.m_values.size() != rhs.m_values.size())
+		throw NativeError("Arrays must have the same length.");
+}
+
+static void CheckNotEmpty(const ObjArray& array)
+{
+	if (array.m_values.empty())
+		throw NativeError("Array is empty.");
+}
+
+//2^32 elements (32 GB), anything larger is a mistake rather than a size.
+constexpr double MAX_SIZE = 4294967296.0;
+
+static Value ArrayNative(int, const Value* args)
+{
+	const auto size = NumberArg(args, 0);
+	if (!std::isfinite(size) || size < 0 || std::floor(size) != size)
+		throw NativeError("Array size must be a non-negative integer.");
+	if (size > MAX_SIZE)
+		throw NativeError("Array size " + Stringify(size) + " is too large.");
+	try
+	{
+		return MakeRef<ObjArray>(std::vector<double>(static_cast<std::size_t>(size)));
+	}
+	catch (const std::bad_alloc&)
+	{
+		throw NativeError("Not enough memory for an array of size " + Stringify(size) + ".");
+	}
+	catch (const std::length_error&)
+	{
+		throw NativeError("Not enough memory for an array of size " + Stringify(size) + ".");
+	}
+}
+
+static Value LenNative(int, const Value* args)
+{
+	return static_cast<double>(ArrayArg(args, 0).m_values.size());
+}
+
+static Value GetNative(int, const Value* args)
+{
+	const auto& array = ArrayArg(args, 0);
+	return array.m_values[IndexArg(array, args, 1)];
+}
+
+static Value SetNative(int, const Value* args)
+{
+	auto& array = ArrayArg(args, 0);
+	const auto index = IndexArg(array, args, 1);
+	array.m_values[index] = NumberArg(args, 2);
+	return args[2];
+}
+
+static Value PushNative(int, const Value* args)
+{
+	auto& array = ArrayArg(args, 0);
+	array.m_values.push_back(NumberArg(args, 1));
+	return {};
+}
+
+static Value SumNative(int, const Value* args)
+{
+	return Sum(ArrayArg(args, 0).m_values);
+}
+
+static Value DotNative(int, const Value* args)
+{
+	const auto& lhs = ArrayArg(args, 0);
+	const auto& rhs = ArrayArg(args, 1);
+	CheckSameSize(lhs, rhs);
+	return Dot(lhs.m_values, rhs.m_values);
+}
+
+static Value ScaleNative(int, const Value* args)
+{
+	const auto& values = ArrayArg(args, 0).m_values;
+	const auto factor = NumberArg(args, 1);
+	std::vector<double> res(values.size());
+	for (std::size_t i = 0; i < res.size(); ++i)
+		res[i] = values[i] * factor;
+	return MakeRef<ObjArray>(std::move(res));
+}
+
+static Value AddNative(int, const Value* args)
+{
+	const auto& lhs = ArrayArg(args, 0);
+	const auto& rhs = ArrayArg(args, 1);
+	CheckSameSize(lhs, rhs);
+	std::vector<double> res(lhs.m_values.size());
+	for (std::size_t i = 0; i < res.size(); ++i)
+		res[i] = lhs.m_values[i] + rhs.m_values[i];
+	return MakeRef<ObjArray>(std::move(res));
+}
+
+static Value MinNative(int, const Value* args)
+{
+	const auto& array = ArrayArg(args, 0);
+	CheckNotEmpty(array);
+	return Extreme(array.m_values, std::less<>{});
+}
+
+static Value MaxNative(int, const Value* args)
+{
+	const auto& array = ArrayArg(args, 0);
+	CheckNotEmpty(array);
+	return Extreme(array.m_values, std::greater<>{});
+}
+
+//In place. NaN is unordered, which std::sort must not be given, so NaNs go last.
+static Value SortNative(int, const Value* args)
+{
+	auto& values = ArrayArg(args, 0).m_values;
+	const auto numbers_end = std::partition(std::begin(values), std::end(values), [](double value)
+	{
+		return !std::isnan(value);
+	});
+	std::sort(std::begin(values), numbers_end);
+	return {};
+}
+
+std::span<const NativeFunction> ArrayNatives()
+{
+	static const NativeFunction natives[] = {
+		{ "array", 1, ArrayNative },
+		{ "len", 1, LenNative },
+		{ "get", 2, GetNative },
+		{ "set", 3, SetNative },
+		{ "push", 2, PushNative },
+		{ "sum", 1, SumNative },
+		{ "dot", 2, DotNative },
+		{ "scale", 2, ScaleNative },
+		{ "add", 2, AddNative },
+		{ "min", 1, MinNative },
+		{ "max", 1, MaxNative },
+		{ "sort", 1, SortNative },
+	};
+	return natives;
+}
@@ -1,15 +1,65 @@
 //This file was generated by ast_builder.exe v1.0.0
 export module ast;
 
-import <any>;
-import <memory>;
+import <list>;
+import <span>;
+import <utility>;
 import <vector>;
 
+import arena;
 import core;
+import value;
 
 export namespace ast
 {
 
+//Where the Resolver found a variable: how many scopes up and which slot in that scope.
+struct LocalSlot
+{
+	int m_depth = -1; //-1 until resolved, unresolved variables are globals
+	int m_slot = 0;
+	bool IsGlobal() const { return m_depth < 0; }
+};
+
+//How a statement finished. A return leaves its value with the Interpreter
+//and unwinds the enclosing blocks and loops up to the function call.
+enum class Completion
+{
+	NORMAL,
+	RETURN,
+};
+
+//Polymorphic inline cache of a property access: the instance shapes seen at this site
+//and what looking the name up in each of them gave. Shapes are opaque to the AST.
+struct PropertyCache
+{
+	struct Entry
+	{
+		const void* m_shape = nullptr;
+		const void* m_next_shape = nullptr; //Set only: the shape after adding the field
+		int m_slot = -1; //-1 if the shape has no such field
+	};
+	static constexpr int SIZE = 4;
+	Entry m_entries[SIZE]{};
+	int m_next = 0; //Entry replaced on the next miss
+	const Entry* Find(const void* shape) const
+	{
+		for (const auto& entry : m_entries)
+		{
+			if (entry.m_shape == shape)
+				return &entry;
+		}
+		return nullptr;
+	}
+	const Entry& Add(const Entry& entry)
+	{
+		auto& res = m_entries[m_next];
+		res = entry;
+		m_next = (m_next + 1) % SIZE;
+		return res;
+	}
+};
+
 namespace expr 
 {
 
@@ -29,179 +79,188 @@ struct Variable ;
 struct VisitorExpr
 {
 	virtual ~VisitorExpr() = default;
-	virtual std::any Visit(const Assign   & val) = 0;
-	virtual std::any Visit(const Binary   & val) = 0;
-	virtual std::any Visit(const Call     & val) = 0;
-	virtual std::any Visit(const Get      & val) = 0;
-	virtual std::any Visit(const Grouping & val) = 0;
-	virtual std::any Visit(const Logical  & val) = 0;
-	virtual std::any Visit(const Set      & val) = 0;
-	virtual std::any Visit(const Literal  & val) = 0;
-	virtual std::any Visit(const Super    & val) = 0;
-	virtual std::any Visit(const This     & val) = 0;
-	virtual std::any Visit(const Unary    & val) = 0;
-	virtual std::any Visit(const Variable & val) = 0;
+	virtual Value Visit(const Assign   & val) = 0;
+	virtual Value Visit(const Binary   & val) = 0;
+	virtual Value Visit(const Call     & val) = 0;
+	virtual Value Visit(const Get      & val) = 0;
+	virtual Value Visit(const Grouping & val) = 0;
+	virtual Value Visit(const Logical  & val) = 0;
+	virtual Value Visit(const Set      & val) = 0;
+	virtual Value Visit(const Literal  & val) = 0;
+	virtual Value Visit(const Super    & val) = 0;
+	virtual Value Visit(const This     & val) = 0;
+	virtual Value Visit(const Unary    & val) = 0;
+	virtual Value Visit(const Variable & val) = 0;
 };
 struct Expr
 {
-	virtual ~Expr() = default;
-	virtual std::any Accept(VisitorExpr& visitor) const = 0;
+	virtual Value Accept(VisitorExpr& visitor) const = 0;
+protected:
+	~Expr() = default;
 };
 
-using ExprPtr = std::unique_ptr<Expr>; 
+using ExprPtr = const Expr*; 
 
 struct Assign    : Expr
 {
-	Token name;
-	std::unique_ptr<Expr> value;
-	explicit Assign   (Token name_, std::unique_ptr<Expr> value_)
-		: name(std::move(name_))
-		, value(std::move(value_))
+	const Token& name;
+	const Expr* value;
+	mutable LocalSlot slot{};
+	explicit Assign   (const Token& name_, const Expr* value_)
+		: name(name_)
+		, value(value_)
 		{}
-	std::any Accept(VisitorExpr& visitor) const override
+	Value Accept(VisitorExpr& visitor) const override
 	{
 		return visitor.Visit(*this);
 	}
 };
 struct Binary    : Expr
 {
-	std::unique_ptr<Expr> left;
-	Token op;
-	std::unique_ptr<Expr> right;
-	explicit Binary   (std::unique_ptr<Expr> left_, Token op_, std::unique_ptr<Expr> right_)
-		: left(std::move(left_))
-		, op(std::move(op_))
-		, right(std::move(right_))
+	const Expr* left;
+	const Token& op;
+	const Expr* right;
+	explicit Binary   (const Expr* left_, const Token& op_, const Expr* right_)
+		: left(left_)
+		, op(op_)
+		, right(right_)
 		{}
-	std::any Accept(VisitorExpr& visitor) const override
+	Value Accept(VisitorExpr& visitor) const override
 	{
 		return visitor.Visit(*this);
 	}
 };
 struct Call      : Expr
 {
-	std::unique_ptr<Expr> callee;
-	Token paren;
-	std::vector<ExprPtr> arguments;
-	explicit Call     (std::unique_ptr<Expr> callee_, Token paren_, std::vector<ExprPtr> arguments_)
-		: callee(std::move(callee_))
-		, paren(std::move(paren_))
-		, arguments(std::move(arguments_))
+	const Expr* callee;
+	const Token& paren;
+	std::span<const Expr* const> arguments;
+	const Get* invoke;
+	explicit Call     (const Expr* callee_, const Token& paren_, std::span<const Expr* const> arguments_, const Get* invoke_)
+		: callee(callee_)
+		, paren(paren_)
+		, arguments(arguments_)
+		, invoke(invoke_)
 		{}
-	std::any Accept(VisitorExpr& visitor) const override
+	Value Accept(VisitorExpr& visitor) const override
 	{
 		return visitor.Visit(*this);
 	}
 };
 struct Get       : Expr
 {
-	std::unique_ptr<Expr> object;
-	Token name;
-	explicit Get      (std::unique_ptr<Expr> object_, Token name_)
-		: object(std::move(object_))
-		, name(std::move(name_))
+	const Expr* object;
+	const Token& name;
+	mutable PropertyCache cache{};
+	explicit Get      (const Expr* object_, const Token& name_)
+		: object(object_)
+		, name(name_)
 		{}
-	std::any Accept(VisitorExpr& visitor) const override
+	Value Accept(VisitorExpr& visitor) const override
 	{
 		return visitor.Visit(*this);
 	}
 };
 struct Grouping  : Expr
 {
-	std::unique_ptr<Expr> expression;
-	explicit Grouping (std::unique_ptr<Expr> expression_)
-		: expression(std::move(expression_))
+	const Expr* expression;
+	explicit Grouping (const Expr* expression_)
+		: expression(expression_)
 		{}
-	std::any Accept(VisitorExpr& visitor) const override
+	Value Accept(VisitorExpr& visitor) const override
 	{
 		return visitor.Visit(*this);
 	}
 };
 struct Logical   : Expr
 {
-	std::unique_ptr<Expr> left;
-	Token op;
-	std::unique_ptr<Expr> right;
-	explicit Logical  (std::unique_ptr<Expr> left_, Token op_, std::unique_ptr<Expr> right_)
-		: left(std::move(left_))
-		, op(std::move(op_))
-		, right(std::move(right_))
+	const Expr* left;
+	const Token& op;
+	const Expr* right;
+	explicit Logical  (const Expr* left_, const Token& op_, const Expr* right_)
+		: left(left_)
+		, op(op_)
+		, right(right_)
 		{}
-	std::any Accept(VisitorExpr& visitor) const override
+	Value Accept(VisitorExpr& visitor) const override
 	{
 		return visitor.Visit(*this);
 	}
 };
 struct Set       : Expr
 {
-	std::unique_ptr<Expr> object;
-	Token name;
-	std::unique_ptr<Expr> value;
-	explicit Set      (std::unique_ptr<Expr> object_, Token name_, std::unique_ptr<Expr> value_)
-		: object(std::move(object_))
-		, name(std::move(name_))
-		, value(std::move(value_))
+	const Expr* object;
+	const Token& name;
+	const Expr* value;
+	mutable PropertyCache cache{};
+	explicit Set      (const Expr* object_, const Token& name_, const Expr* value_)
+		: object(object_)
+		, name(name_)
+		, value(value_)
 		{}
-	std::any Accept(VisitorExpr& visitor) const override
+	Value Accept(VisitorExpr& visitor) const override
 	{
 		return visitor.Visit(*this);
 	}
 };
 struct Literal   : Expr
 {
-	LiteralT value;
-	explicit Literal  (LiteralT value_)
-		: value(std::move(value_))
+	const Value& value;
+	explicit Literal  (const Value& value_)
+		: value(value_)
 		{}
-	std::any Accept(VisitorExpr& visitor) const override
+	Value Accept(VisitorExpr& visitor) const override
 	{
 		return visitor.Visit(*this);
 	}
 };
 struct Super     : Expr
 {
-	Token keyword;
-	Token method;
-	explicit Super    (Token keyword_, Token method_)
-		: keyword(std::move(keyword_))
-		, method(std::move(method_))
+	const Token& keyword;
+	const Token& method;
+	mutable LocalSlot slot{};
+	explicit Super    (const Token& keyword_, const Token& method_)
+		: keyword(keyword_)
+		, method(method_)
 		{}
-	std::any Accept(VisitorExpr& visitor) const override
+	Value Accept(VisitorExpr& visitor) const override
 	{
 		return visitor.Visit(*this);
 	}
 };
 struct This      : Expr
 {
-	Token keyword;
-	explicit This     (Token keyword_)
-		: keyword(std::move(keyword_))
+	const Token& keyword;
+	mutable LocalSlot slot{};
+	explicit This     (const Token& keyword_)
+		: keyword(keyword_)
 		{}
-	std::any Accept(VisitorExpr& visitor) const override
+	Value Accept(VisitorExpr& visitor) const override
 	{
 		return visitor.Visit(*this);
 	}
 };
 struct Unary     : Expr
 {
-	Token op;
-	std::unique_ptr<Expr> right;
-	explicit Unary    (Token op_, std::unique_ptr<Expr> right_)
-		: op(std::move(op_))
-		, right(std::move(right_))
+	const Token& op;
+	const Expr* right;
+	explicit Unary    (const Token& op_, const Expr* right_)
+		: op(op_)
+		, right(right_)
 		{}
-	std::any Accept(VisitorExpr& visitor) const override
+	Value Accept(VisitorExpr& visitor) const override
 	{
 		return visitor.Visit(*this);
 	}
 };
 struct Variable  : Expr
 {
-	Token name;
-	explicit Variable (Token name_)
-		: name(std::move(name_))
+	const Token& name;
+	mutable LocalSlot slot{};
+	explicit Variable (const Token& name_)
+		: name(name_)
 		{}
-	std::any Accept(VisitorExpr& visitor) const override
+	Value Accept(VisitorExpr& visitor) const override
 	{
 		return visitor.Visit(*this);
 	}
@@ -225,141 +284,194 @@ struct While      ;
 struct VisitorStmt
 {
 	virtual ~VisitorStmt() = default;
-	virtual std::any Visit(const Block      & val) = 0;
-	virtual std::any Visit(const Class      & val) = 0;
-	virtual std::any Visit(const Expression & val) = 0;
-	virtual std::any Visit(const Function   & val) = 0;
-	virtual std::any Visit(const If         & val) = 0;
-	virtual std::any Visit(const Print      & val) = 0;
-	virtual std::any Visit(const Return     & val) = 0;
-	virtual std::any Visit(const Var        & val) = 0;
-	virtual std::any Visit(const While      & val) = 0;
+	virtual Completion Visit(const Block      & val) = 0;
+	virtual Completion Visit(const Class      & val) = 0;
+	virtual Completion Visit(const Expression & val) = 0;
+	virtual Completion Visit(const Function   & val) = 0;
+	virtual Completion Visit(const If         & val) = 0;
+	virtual Completion Visit(const Print      & val) = 0;
+	virtual Completion Visit(const Return     & val) = 0;
+	virtual Completion Visit(const Var        & val) = 0;
+	virtual Completion Visit(const While      & val) = 0;
 };
 struct Stmt
 {
-	virtual ~Stmt() = default;
-	virtual std::any Accept(VisitorStmt& visitor) const = 0;
+	virtual Completion Accept(VisitorStmt& visitor) const = 0;
+	//First line of the statement, set by the Parser for runtime reports.
+	mutable int line = 0;
+protected:
+	~Stmt() = default;
 };
 
-using StmtPtr = std::unique_ptr<Stmt>; 
+using StmtPtr = const Stmt*; 
 
 struct Block       : Stmt
 {
-	std::vector<StmtPtr> statements;
-	explicit Block      (std::vector<StmtPtr> statements_)
-		: statements(std::move(statements_))
+	std::span<const Stmt* const> statements;
+	explicit Block      (std::span<const Stmt* const> statements_)
+		: statements(statements_)
 		{}
-	std::any Accept(VisitorStmt& visitor) const override
+	Completion Accept(VisitorStmt& visitor) const override
 	{
 		return visitor.Visit(*this);
 	}
 };
 struct Class       : Stmt
 {
-	Token name;
-	std::unique_ptr<expr::Variable> superclass;
-	std::vector<std::unique_ptr<Function>> methods;
-	explicit Class      (Token name_, std::unique_ptr<expr::Variable> superclass_, std::vector<std::unique_ptr<Function>> methods_)
-		: name(std::move(name_))
-		, superclass(std::move(superclass_))
-		, methods(std::move(methods_))
+	const Token& name;
+	const expr::Variable* superclass;
+	std::span<const Function* const> methods;
+	explicit Class      (const Token& name_, const expr::Variable* superclass_, std::span<const Function* const> methods_)
+		: name(name_)
+		, superclass(superclass_)
+		, methods(methods_)
 		{}
-	std::any Accept(VisitorStmt& visitor) const override
+	Completion Accept(VisitorStmt& visitor) const override
 	{
 		return visitor.Visit(*this);
 	}
 };
 struct Expression  : Stmt
 {
-	std::unique_ptr<expr::Expr> expression;
-	explicit Expression (std::unique_ptr<expr::Expr> expression_)
-		: expression(std::move(expression_))
+	const expr::Expr* expression;
+	explicit Expression (const expr::Expr* expression_)
+		: expression(expression_)
 		{}
-	std::any Accept(VisitorStmt& visitor) const override
+	Completion Accept(VisitorStmt& visitor) const override
 	{
 		return visitor.Visit(*this);
 	}
 };
 struct Function    : Stmt
 {
-	Token name;
-	std::vector<Token> params;
-	std::vector<StmtPtr> body;
-	explicit Function   (Token name_, std::vector<Token> params_, std::vector<StmtPtr> body_)
-		: name(std::move(name_))
-		, params(std::move(params_))
-		, body(std::move(body_))
+	const Token& name;
+	std::span<const Token* const> params;
+	std::span<const Stmt* const> body;
+	explicit Function   (const Token& name_, std::span<const Token* const> params_, std::span<const Stmt* const> body_)
+		: name(name_)
+		, params(params_)
+		, body(body_)
 		{}
-	std::any Accept(VisitorStmt& visitor) const override
+	Completion Accept(VisitorStmt& visitor) const override
 	{
 		return visitor.Visit(*this);
 	}
 };
 struct If          : Stmt
 {
-	std::unique_ptr<expr::Expr> condition;
-	StmtPtr then_branch;
-	StmtPtr else_branch;
-	explicit If         (std::unique_ptr<expr::Expr> condition_, StmtPtr then_branch_, StmtPtr else_branch_)
-		: condition(std::move(condition_))
-		, then_branch(std::move(then_branch_))
-		, else_branch(std::move(else_branch_))
+	const expr::Expr* condition;
+	const Stmt* then_branch;
+	const Stmt* else_branch;
+	explicit If         (const expr::Expr* condition_, const Stmt* then_branch_, const Stmt* else_branch_)
+		: condition(condition_)
+		, then_branch(then_branch_)
+		, else_branch(else_branch_)
 		{}
-	std::any Accept(VisitorStmt& visitor) const override
+	Completion Accept(VisitorStmt& visitor) const override
 	{
 		return visitor.Visit(*this);
 	}
 };
 struct Print       : Stmt
 {
-	std::unique_ptr<expr::Expr> expression;
-	explicit Print      (std::unique_ptr<expr::Expr> expression_)
-		: expression(std::move(expression_))
+	const expr::Expr* expression;
+	explicit Print      (const expr::Expr* expression_)
+		: expression(expression_)
 		{}
-	std::any Accept(VisitorStmt& visitor) const override
+	Completion Accept(VisitorStmt& visitor) const override
 	{
 		return visitor.Visit(*this);
 	}
 };
 struct Return      : Stmt
 {
-	Token keyword;
-	std::unique_ptr<expr::Expr> value;
-	explicit Return     (Token keyword_, std::unique_ptr<expr::Expr> value_)
-		: keyword(std::move(keyword_))
-		, value(std::move(value_))
+	const Token& keyword;
+	const expr::Expr* value;
+	explicit Return     (const Token& keyword_, const expr::Expr* value_)
+		: keyword(keyword_)
+		, value(value_)
 		{}
-	std::any Accept(VisitorStmt& visitor) const override
+	Completion Accept(VisitorStmt& visitor) const override
 	{
 		return visitor.Visit(*this);
 	}
 };
 struct Var         : Stmt
 {
-	Token name;
-	std::unique_ptr<expr::Expr> initializer;
-	explicit Var        (Token name_, std::unique_ptr<expr::Expr> initializer_)
-		: name(std::move(name_))
-		, initializer(std::move(initializer_))
+	const Token& name;
+	const expr::Expr* initializer;
+	explicit Var        (const Token& name_, const expr::Expr* initializer_)
+		: name(name_)
+		, initializer(initializer_)
 		{}
-	std::any Accept(VisitorStmt& visitor) const override
+	Completion Accept(VisitorStmt& visitor) const override
 	{
 		return visitor.Visit(*this);
 	}
 };
 struct While       : Stmt
 {
-	std::unique_ptr<expr::Expr> condition;
-	StmtPtr body;
-	explicit While      (std::unique_ptr<expr::Expr> condition_, StmtPtr body_)
-		: condition(std::move(condition_))
-		, body(std::move(body_))
+	const expr::Expr* condition;
+	const Stmt* body;
+	explicit While      (const expr::Expr* condition_, const Stmt* body_)
+		: condition(condition_)
+		, body(body_)
 		{}
-	std::any Accept(VisitorStmt& visitor) const override
+	Completion Accept(VisitorStmt& visitor) const override
 	{
 		return visitor.Visit(*this);
 	}
 };
 
 } //namespace stmt
+
+//Owns a parsed script: its tokens and the arena every node is allocated from.
+//Nodes only hold non-owning pointers to each other and references to the tokens,
+//so the whole tree is freed at once and must not outlive the Program.
+class Program
+{
+	std::vector<Token> m_tokens;
+	Arena m_arena;
+	//Values computed after parsing (e.g. folded constants), a list so Literals can reference them
+	//and a program without any (most declarations of a streamed script) allocates nothing for it.
+	std::list<Value> m_constants;
+	std::span<const stmt::StmtPtr> m_statements;
+public:
+	explicit Program(std::vector<Token> tokens)
+		: m_tokens(std::move(tokens))
+		{}
+	Program(Program&&) noexcept = default;
+	Program& operator=(Program&&) noexcept = default;
+	const std::vector<Token>& Tokens() const
+	{
+		return m_tokens;
+	}
+	template<class T, class ...Args>
+	const T* New(Args&&... args)
+	{
+		return m_arena.New<T>(std::forward<Args>(args)...);
+	}
+	template<class T>
+	std::span<const T> List(const std::vector<T>& values)
+	{
+		return m_arena.Copy(values);
+	}
+	const Value& Constant(Value value)
+	{
+		return m_constants.emplace_back(std::move(value));
+	}
+	void SetStatements(std::span<const stmt::StmtPtr> statements)
+	{
+		m_statements = statements;
+	}
+	std::span<const stmt::StmtPtr> Statements() const
+	{
+		return m_statements;
+	}
+	std::size_t BytesAllocated() const
+	{
+		return m_arena.BytesAllocated();
+	}
+};
+
 }//namespace ast
@@ -0,0 +1,770 @@
+export module compiler;
+
+import ast;
+import core;
+import log;
+import value;
+
+import <cstdint>;
+import <span>;
+import <string>;
+import <string_view>;
+import <unordered_map>;
+import <vector>;
+
+export enum class OpCode : std::uint8_t
+{
+	CONSTANT,
+	NIL,
+	TRUE,
+	FALSE,
+	POP,
+	GET_LOCAL,
+	SET_LOCAL,
+	GET_GLOBAL,
+	DEFINE_GLOBAL,
+	SET_GLOBAL,
+	GET_UPVALUE,
+	SET_UPVALUE,
+	GET_PROPERTY,
+	SET_PROPERTY,
+	GET_SUPER,
+	EQUAL,
+	NOT_EQUAL,
+	GREATER,
+	GREATER_EQUAL,
+	LESS,
+	LESS_EQUAL,
+	ADD,
+	SUBTRACT,
+	MULTIPLY,
+	DIVIDE,
+	NOT,
+	NEGATE,
+	PRINT,
+	JUMP,
+	JUMP_IF_FALSE,
+	LOOP,
+	CALL,
+	INVOKE,
+	SUPER_INVOKE,
+	CLOSURE,
+	CLOSE_UPVALUE,
+	RETURN,
+	CLASS,
+	INHERIT,
+	METHOD,
+};
+
+//Constant pool indices and jump offsets are 16 bit wide, local and upvalue slots are 8 bit wide.
+export struct Chunk
+{
+	std::vector<std::uint8_t> m_code;
+	std::vector<int> m_lines;
+	std::vector<Value> m_constants;
+
+	void Write(std::uint8_t byte, int line)
+	{
+		m_code.push_back(byte);
+		m_lines.push_back(line);
+	}
+	int AddConstant(Value value)
+	{
+		m_constants.push_back(std::move(value));
+		return static_cast<int>(m_constants.size()) - 1;
+	}
+};
+
+export class ObjFunction : public Object
+{
+public:
+	int m_arity = 0;
+	int m_upvalue_count = 0;
+	Chunk m_chunk;
+	std::string m_name;
+
+	ObjFunction()
+		: Object(ObjType::PROTO)
+	{}
+	std::string ToString() const override
+	{
+		if (m_name.empty())
+			return "<script>";
+		return "<fn " + m_name + ">";
+	}
+};
+
+enum class FunctionKind
+{
+	SCRIPT,
+	FUNCTION,
+	INITIALIZER,
+	METHOD,
+};
+
+//Lowers a resolved AST to bytecode. Static errors (shadowing, top-level return, etc.)
+//are already reported by the Resolver, so the Compiler only assigns stack slots and upvalues.
+export class Compiler : ast::expr::VisitorExpr, ast::stmt::VisitorStmt
+{
+	struct Local
+	{
+		std::string_view m_name;
+		int m_depth = -1;
+		bool m_is_captured = false;
+	};
+	struct Upvalue
+	{
+		std::uint8_t m_index = 0;
+		bool m_is_local = false;
+	};
+	struct FunctionState
+	{
+		FunctionState* m_enclosing = nullptr;
+		Ref<ObjFunction> m_function;
+		FunctionKind m_type = FunctionKind::SCRIPT;
+		std::vector<Local> m_locals;
+		std::vector<Upvalue> m_upvalues;
+		std::unordered_map<std::string, int> m_string_constants;
+		int m_scope_depth = 0;
+	};
+	struct ClassState
+	{
+		ClassState* m_enclosing = nullptr;
+		bool m_has_superclass = false;
+	};
+
+	FunctionState* m_current = nullptr;
+	ClassState* m_current_class = nullptr;
+	int m_line = 1;
+public:
+	Ref<ObjFunction> Compile(std::span<const ast::stmt::StmtPtr> statements);
+private:
+	ast::Completion Visit(const ast::stmt::Expression& val) override;
+	ast::Completion Visit(const ast::stmt::Function& val) override;
+	ast::Completion Visit(const ast::stmt::If& val) override;
+	ast::Completion Visit(const ast::stmt::Print& val) override;
+	ast::Completion Visit(const ast::stmt::Return& val) override;
+	ast::Completion Visit(const ast::stmt::Var& val) override;
+	ast::Completion Visit(const ast::stmt::While& val) override;
+	ast::Completion Visit(const ast::stmt::Block& val) override;
+	ast::Completion Visit(const ast::stmt::Class& val) override;
+
+	Value Visit(const ast::expr::Assign& val) override;
+	Value Visit(const ast::expr::Variable& val) override;
+	Value Visit(const ast::expr::Binary& val) override;
+	Value Visit(const ast::expr::Call& val) override;
+	Value Visit(const ast::expr::Get& val) override;
+	Value Visit(const ast::expr::Grouping& val) override;
+	Value Visit(const ast::expr::Literal& val) override;
+	Value Visit(const ast::expr::Logical& val) override;
+	Value Visit(const ast::expr::Set& val) override;
+	Value Visit(const ast::expr::Super& val) override;
+	Value Visit(const ast::expr::This& val) override;
+	Value Visit(const ast::expr::Unary& val) override;
+
+	void Compile(const ast::stmt::Stmt& stmt);
+	void Compile(const ast::expr::Expr& expr);
+	void CompileFunction(const ast::stmt::Function& function, FunctionKind type);
+
+	Chunk& CurrentChunk();
+	void EmitByte(std::uint8_t byte);
+	void EmitOp(OpCode op);
+	void EmitOp(OpCode op, std::uint8_t operand);
+	void EmitShort(int value);
+	void EmitConstant(Value value);
+	void EmitReturn();
+	int EmitJump(OpCode op);
+	void PatchJump(int offset);
+	void EmitLoop(int loop_start);
+	int MakeConstant(Value value);
+	int StringConstant(std::string_view str);
+
+	void BeginScope();
+	void EndScope();
+	void DeclareLocal(const Token& name);
+	void MarkInitialized();
+	void DefineVariable(const Token& name);
+	void NamedVariable(const Token& name, bool is_assignment);
+	static int ResolveLocal(FunctionState& state, std::string_view name);
+	int ResolveUpvalue(FunctionState& state, std::string_view name);
+	int AddUpvalue(FunctionState& state, std::uint8_t index, bool is_local);
+	void CompileError(std::string_view message);
+};
+
+module :private;
+
+Ref<ObjFunction> Compiler::Compile(std::span<const ast::stmt::StmtPtr> statements)
+{
+	FunctionState script;
+	script.m_function = MakeRef<ObjFunction>();
+	//Slot zero is reserved for the callee.
+	script.m_locals.push_back(Local{ "", 0 });
+	m_current = &script;
+	for (const auto& statement : statements)
+		Compile(*statement);
+	EmitReturn();
+	m_current = nullptr;
+	if (HasError())
+		return nullptr;
+	return std::move(script.m_function);
+}
+
+ast::Completion Compiler::Visit(const ast::stmt::Expression& val)
+{
+	Compile(*val.expression);
+	EmitOp(OpCode::POP);
+	return {};
+}
+
+ast::Completion Compiler::Visit(const ast::stmt::Function& val)
+{
+	m_line = val.name.m_line;
+	if (m_current->m_scope_depth > 0)
+	{
+		DeclareLocal(val.name);
+		//Allows the function to refer to itself.
+		MarkInitialized();
+	}
+	CompileFunction(val, FunctionKind::FUNCTION);
+	DefineVariable(val.name);
+	return {};
+}
+
+ast::Completion Compiler::Visit(const ast::stmt::If& val)
+{
+	Compile(*val.condition);
+	const auto then_jump = EmitJump(OpCode::JUMP_IF_FALSE);
+	EmitOp(OpCode::POP);
+	Compile(*val.then_branch);
+	const auto else_jump = EmitJump(OpCode::JUMP);
+	PatchJump(then_jump);
+	EmitOp(OpCode::POP);
+	if (val.else_branch)
+		Compile(*val.else_branch);
+	PatchJump(else_jump);
+	return {};
+}
+
+ast::Completion Compiler::Visit(const ast::stmt::Print& val)
+{
+	Compile(*val.expression);
+	EmitOp(OpCode::PRINT);
+	return {};
+}
+
+ast::Completion Compiler::Visit(const ast::stmt::Return& val)
+{
+	m_line = val.keyword.m_line;
+	if (m_current->m_type == FunctionKind::INITIALIZER)
+	{
+		EmitReturn();
+		return {};
+	}
+	if (val.value)
+		Compile(*val.value);
+	else
+		EmitOp(OpCode::NIL);
+	EmitOp(OpCode::RETURN);
+	return {};
+}
+
+ast::Completion Compiler::Visit(const ast::stmt::Var& val)
+{
+	m_line = val.name.m_line;
+	if (m_current->m_scope_depth > 0)
+		DeclareLocal(val.name);
+	if (val.initializer)
+		Compile(*val.initializer);
+	else
+		EmitOp(OpCode::NIL);
+	DefineVariable(val.name);
+	return {};
+}
+
+ast::Completion Compiler::Visit(const ast::stmt::While& val)
+{
+	const auto loop_start = static_cast<int>(CurrentChunk().m_code.size());
+	Compile(*val.condition);
+	const auto exit_jump = EmitJump(OpCode::JUMP_IF_FALSE);
+	EmitOp(OpCode::POP);
+	Compile(*val.body);
+	EmitLoop(loop_start);
+	PatchJump(exit_jump);
+	EmitOp(OpCode::POP);
+	return {};
+}
+
+ast::Completion Compiler::Visit(const ast::stmt::Block& val)
+{
+	BeginScope();
+	for (const auto& statement : val.statements)
+		Compile(*statement);
+	EndScope();
+	return {};
+}
+
+ast::Completion Compiler::Visit(const ast::stmt::Class& val)
+{
+	m_line = val.name.m_line;
+	const auto name_constant = StringConstant(val.name.m_lexeme);
+	if (m_current->m_scope_depth > 0)
+		DeclareLocal(val.name);
+	EmitOp(OpCode::CLASS);
+	EmitShort(name_constant);
+	DefineVariable(val.name);
+
+	ClassState class_state{ m_current_class };
+	m_current_class = &class_state;
+
+	if (val.superclass)
+	{
+		Compile(*val.superclass);
+		BeginScope();
+		m_current->m_locals.push_back(Local{ "super", m_current->m_scope_depth });
+		NamedVariable(val.name, false);
+		EmitOp(OpCode::INHERIT);
+		class_state.m_has_superclass = true;
+	}
+
+	NamedVariable(val.name, false);
+	for (const auto& method : val.methods)
+	{
+		m_line = method->name.m_line;
+		const auto method_constant = StringConstant(method->name.m_lexeme);
+		CompileFunction(*method, method->name.m_lexeme == "init" ?
+			FunctionKind::INITIALIZER : FunctionKind::METHOD);
+		EmitOp(OpCode::METHOD);
+		EmitShort(method_constant);
+	}
+	EmitOp(OpCode::POP);
+
+	if (class_state.m_has_superclass)
+		EndScope();
+	m_current_class = class_state.m_enclosing;
+	return {};
+}
+
+Value Compiler::Visit(const ast::expr::Assign& val)
+{
+	Compile(*val.value);
+	m_line = val.name.m_line;
+	NamedVariable(val.name, true);
+	return {};
+}
+
+Value Compiler::Visit(const ast::expr::Variable& val)
+{
+	m_line = val.name.m_line;
+	NamedVariable(val.name, false);
+	return {};
+}
+
+Value Compiler::Visit(const ast::expr::Binary& val)
+{
+	Compile(*val.left);
+	Compile(*val.right);
+	m_line = val.op.m_line;
+	switch (val.op.m_type)
+	{
+	case TokenType::MINUS: EmitOp(OpCode::SUBTRACT); break;
+	case TokenType::SLASH: EmitOp(OpCode::DIVIDE); break;
+	case TokenType::STAR: EmitOp(OpCode::MULTIPLY); break;
+	case TokenType::PLUS: EmitOp(OpCode::ADD); break;
+	case TokenType::GREATER: EmitOp(OpCode::GREATER); break;
+	case TokenType::GREATER_EQUAL: EmitOp(OpCode::GREATER_EQUAL); break;
+	case TokenType::LESS: EmitOp(OpCode::LESS); break;
+	case TokenType::LESS_EQUAL: EmitOp(OpCode::LESS_EQUAL); break;
+	case TokenType::BANG_EQUAL: EmitOp(OpCode::NOT_EQUAL); break;
+	case TokenType::EQUAL_EQUAL: EmitOp(OpCode::EQUAL); break;
+	}
+	return {};
+}
+
+Value Compiler::Visit(const ast::expr::Call& val)
+{
+	if (val.arguments.size() > 255)
+	{
+		m_line = val.paren.m_line;
+		CompileError("Can't have more than 255 arguments.");
+		return {};
+	}
+	const auto arg_count = static_cast<std::uint8_t>(val.arguments.size());
+	//obj.method(args) and super.method(args) skip the bound method allocation.
+	if (const auto* get = val.invoke)
+	{
+		Compile(*get->object);
+		const auto name = StringConstant(get->name.m_lexeme);
+		for (const auto& argument : val.arguments)
+			Compile(*argument);
+		m_line = val.paren.m_line;
+		EmitOp(OpCode::INVOKE);
+		EmitShort(name);
+		EmitByte(arg_count);
+		return {};
+	}
+	if (const auto* super = dynamic_cast<const ast::expr::Super*>(val.callee))
+	{
+		m_line = super->keyword.m_line;
+		const auto name = StringConstant(super->method.m_lexeme);
+		NamedVariable(Token(TokenType::THIS, "this", {}, m_line), false);
+		for (const auto& argument : val.arguments)
+			Compile(*argument);
+		NamedVariable(Token(TokenType::SUPER, "super", {}, m_line), false);
+		m_line = val.paren.m_line;
+		EmitOp(OpCode::SUPER_INVOKE);
+		EmitShort(name);
+		EmitByte(arg_count);
+		return {};
+	}
+	Compile(*val.callee);
+	for (const auto& argument : val.arguments)
+		Compile(*argument);
+	m_line = val.paren.m_line;
+	EmitOp(OpCode::CALL, arg_count);
+	return {};
+}
+
+Value Compiler::Visit(const ast::expr::Get& val)
+{
+	Compile(*val.object);
+	m_line = val.name.m_line;
+	EmitOp(OpCode::GET_PROPERTY);
+	EmitShort(StringConstant(val.name.m_lexeme));
+	return {};
+}
+
+Value Compiler::Visit(const ast::expr::Grouping& val)
+{
+	Compile(*val.expression);
+	return {};
+}
+
+Value Compiler::Visit(const ast::expr::Literal& val)
+{
+	if (val.value.IsNil())
+		EmitOp(OpCode::NIL);
+	else if (val.value.IsBool())
+		EmitOp(val.value.AsBool() ? OpCode::TRUE : OpCode::FALSE);
+	else if (val.value.IsNumber())
+		EmitConstant(val.value);
+	else
+	{
+		EmitOp(OpCode::CONSTANT);
+		EmitShort(StringConstant(val.value.AsString()));
+	}
+	return {};
+}
+
+Value Compiler::Visit(const ast::expr::Logical& val)
+{
+	Compile(*val.left);
+	if (val.op.m_type == TokenType::OR)
+	{
+		const auto else_jump = EmitJump(OpCode::JUMP_IF_FALSE);
+		const auto end_jump = EmitJump(OpCode::JUMP);
+		PatchJump(else_jump);
+		EmitOp(OpCode::POP);
+		Compile(*val.right);
+		PatchJump(end_jump);
+	}
+	else
+	{
+		const auto end_jump = EmitJump(OpCode::JUMP_IF_FALSE);
+		EmitOp(OpCode::POP);
+		Compile(*val.right);
+		PatchJump(end_jump);
+	}
+	return {};
+}
+
+Value Compiler::Visit(const ast::expr::Set& val)
+{
+	Compile(*val.object);
+	Compile(*val.value);
+	m_line = val.name.m_line;
+	EmitOp(OpCode::SET_PROPERTY);
+	EmitShort(StringConstant(val.name.m_lexeme));
+	return {};
+}
+
+Value Compiler::Visit(const ast::expr::Super& val)
+{
+	m_line = val.keyword.m_line;
+	const auto name = StringConstant(val.method.m_lexeme);
+	NamedVariable(Token(TokenType::THIS, "this", {}, m_line), false);
+	NamedVariable(Token(TokenType::SUPER, "super", {}, m_line), false);
+	EmitOp(OpCode::GET_SUPER);
+	EmitShort(name);
+	return {};
+}
+
+Value Compiler::Visit(const ast::expr::This& val)
+{
+	m_line = val.keyword.m_line;
+	NamedVariable(val.keyword, false);
+	return {};
+}
+
+Value Compiler::Visit(const ast::expr::Unary& val)
+{
+	Compile(*val.right);
+	m_line = val.op.m_line;
+	if (val.op.m_type == TokenType::BANG)
+		EmitOp(OpCode::NOT);
+	else
+		EmitOp(OpCode::NEGATE);
+	return {};
+}
+
+void Compiler::Compile(const ast::stmt::Stmt& stmt)
+{
+	stmt.Accept(*this);
+}
+
+void Compiler::Compile(const ast::expr::Expr& expr)
+{
+	expr.Accept(*this);
+}
+
+void Compiler::CompileFunction(const ast::stmt::Function& function, FunctionKind type)
+{
+	FunctionState state;
+	state.m_enclosing = m_current;
+	state.m_function = MakeRef<ObjFunction>();
+	state.m_function->m_name = function.name.m_lexeme;
+	state.m_function->m_arity = static_cast<int>(function.params.size());
+	state.m_type = type;
+	//Slot zero holds the receiver for methods and the closure itself for functions.
+	state.m_locals.push_back(Local{ type == FunctionKind::FUNCTION ? "" : "this", 0 });
+	m_current = &state;
+
+	BeginScope();
+	for (const auto& param : function.params)
+	{
+		DeclareLocal(*param);
+		MarkInitialized();
+	}
+	for (const auto& statement : function.body)
+		Compile(*statement);
+	EmitReturn();
+
+	m_current = state.m_enclosing;
+	state.m_function->m_upvalue_count = static_cast<int>(state.m_upvalues.size());
+	EmitOp(OpCode::CLOSURE);
+	EmitShort(MakeConstant(std::move(state.m_function)));
+	for (const auto& upvalue : state.m_upvalues)
+	{
+		EmitByte(upvalue.m_is_local ? 1 : 0);
+		EmitByte(upvalue.m_index);
+	}
+}
+
+Chunk& Compiler::CurrentChunk()
+{
+	return m_current->m_function->m_chunk;
+}
+
+void Compiler::EmitByte(std::uint8_t byte)
+{
+	CurrentChunk().Write(byte, m_line);
+}
+
+void Compiler::EmitOp(OpCode op)
+{
+	EmitByte(static_cast<std::uint8_t>(op));
+}
+
+void Compiler::EmitOp(OpCode op, std::uint8_t operand)
+{
+	EmitOp(op);
+	EmitByte(operand);
+}
+
+void Compiler::EmitShort(int value)
+{
+	EmitByte(static_cast<std::uint8_t>((value >> 8) & 0xff));
+	EmitByte(static_cast<std::uint8_t>(value & 0xff));
+}
+
+void Compiler::EmitConstant(Value value)
+{
+	EmitOp(OpCode::CONSTANT);
+	EmitShort(MakeConstant(std::move(value)));
+}
+
+void Compiler::EmitReturn()
+{
+	if (m_current->m_type == FunctionKind::INITIALIZER)
+		EmitOp(OpCode::GET_LOCAL, 0);
+	else
+		EmitOp(OpCode::NIL);
+	EmitOp(OpCode::RETURN);
+}
+
+int Compiler::EmitJump(OpCode op)
+{
+	EmitOp(op);
+	EmitByte(0xff);
+	EmitByte(0xff);
+	return static_cast<int>(CurrentChunk().m_code.size()) - 2;
+}
+
+void Compiler::PatchJump(int offset)
+{
+	auto& code = CurrentChunk().m_code;
+	const auto jump = static_cast<int>(code.size()) - offset - 2;
+	if (jump > UINT16_MAX)
+		CompileError("Too much code to jump over.");
+	code[offset] = static_cast<std::uint8_t>((jump >> 8) & 0xff);
+	code[offset + 1] = static_cast<std::uint8_t>(jump & 0xff);
+}
+
+void Compiler::EmitLoop(int loop_start)
+{
+	EmitOp(OpCode::LOOP);
+	const auto offset = static_cast<int>(CurrentChunk().m_code.size()) - loop_start + 2;
+	if (offset > UINT16_MAX)
+		CompileError("Loop body too large.");
+	EmitShort(offset);
+}
+
+int Compiler::MakeConstant(Value value)
+{
+	const auto index = CurrentChunk().AddConstant(std::move(value));
+	if (index > UINT16_MAX)
+	{
+		//Only the first constant that does not fit is reported, not every one after it.
+		if (index == UINT16_MAX + 1)
+			CompileError("Too many constants in one chunk.");
+		return 0;
+	}
+	return index;
+}
+
+int Compiler::StringConstant(std::string_view str)
+{
+	auto& constants = m_current->m_string_constants;
+	const auto it = constants.find(std::string(str));
+	if (it != std::end(constants))
+		return it->second;
+	const auto index = MakeConstant(MakeString(std::string(str)));
+	constants.emplace(std::string(str), index);
+	return index;
+}
+
+void Compiler::BeginScope()
+{
+	++m_current->m_scope_depth;
+}
+
+void Compiler::EndScope()
+{
+	auto& locals = m_current->m_locals;
+	--m_current->m_scope_depth;
+	while (!locals.empty() && locals.back().m_depth > m_current->m_scope_depth)
+	{
+		EmitOp(locals.back().m_is_captured ? OpCode::CLOSE_UPVALUE : OpCode::POP);
+		locals.pop_back();
+	}
+}
+
+void Compiler::DeclareLocal(const Token& name)
+{
+	if (m_current->m_locals.size() > UINT8_MAX)
+	{
+		m_line = name.m_line;
+		CompileError("Too many local variables in function.");
+		return;
+	}
+	m_current->m_locals.push_back(Local{ name.m_lexeme, -1 });
+}
+
+void Compiler::MarkInitialized()
+{
+	if (m_current->m_scope_depth == 0)
+		return;
+	m_current->m_locals.back().m_depth = m_current->m_scope_depth;
+}
+
+void Compiler::DefineVariable(const Token& name)
+{
+	if (m_current->m_scope_depth > 0)
+	{
+		MarkInitialized();
+		return;
+	}
+	EmitOp(OpCode::DEFINE_GLOBAL);
+	EmitShort(StringConstant(name.m_lexeme));
+}
+
+void Compiler::NamedVariable(const Token& name, bool is_assignment)
+{
+	OpCode get_op;
+	OpCode set_op;
+	auto arg = ResolveLocal(*m_current, name.m_lexeme);
+	if (arg != -1)
+	{
+		get_op = OpCode::GET_LOCAL;
+		set_op = OpCode::SET_LOCAL;
+	}
+	else if ((arg = ResolveUpvalue(*m_current, name.m_lexeme)) != -1)
+	{
+		get_op = OpCode::GET_UPVALUE;
+		set_op = OpCode::SET_UPVALUE;
+	}
+	else
+	{
+		EmitOp(is_assignment ? OpCode::SET_GLOBAL : OpCode::GET_GLOBAL);
+		EmitShort(StringConstant(name.m_lexeme));
+		return;
+	}
+	EmitOp(is_assignment ? set_op : get_op, static_cast<std::uint8_t>(arg));
+}
+
+int Compiler::ResolveLocal(FunctionState& state, std::string_view name)
+{
+	for (int i = static_cast<int>(state.m_locals.size()) - 1; i >= 0; --i)
+	{
+		if (state.m_locals[i].m_name == name)
+			return i;
+	}
+	return -1;
+}
+
+int Compiler::ResolveUpvalue(FunctionState& state, std::string_view name)
+{
+	if (!state.m_enclosing)
+		return -1;
+	const auto local = ResolveLocal(*state.m_enclosing, name);
+	if (local != -1)
+	{
+		state.m_enclosing->m_locals[local].m_is_captured = true;
+		return AddUpvalue(state, static_cast<std::uint8_t>(local), true);
+	}
+	const auto upvalue = ResolveUpvalue(*state.m_enclosing, name);
+	if (upvalue != -1)
+		return AddUpvalue(state, static_cast<std::uint8_t>(upvalue), false);
+	return -1;
+}
+
+int Compiler::AddUpvalue(FunctionState& state, std::uint8_t index, bool is_local)
+{
+	auto& upvalues = state.m_upvalues;
+	for (int i = 0; i < static_cast<int>(upvalues.size()); ++i)
+	{
+		if (upvalues[i].m_index == index && upvalues[i].m_is_local == is_local)
+			return i;
+	}
+	if (upvalues.size() > UINT8_MAX)
+	{
+		CompileError("Too many closure variables in function.");
+		return 0;
+	}
+	upvalues.push_back(Upvalue{ index, is_local });
+	return static_cast<int>(upvalues.size()) - 1;
+}
+
+void Compiler::CompileError(std::string_view message)
+{
+	Report(m_line, "", message);
+}
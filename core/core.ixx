@@ -1,12 +1,13 @@
 export module core;
 
+import value;
+
+import <chrono>;
 import <ostream>;
-import <variant>;
 import <string>;
+import <string_view>;
 import <cassert>;
 
-export using LiteralT = std::variant<std::monostate, std::string, double, bool>;
-
 export enum class TokenType
 {
 	UNDEF,
@@ -32,25 +33,18 @@ export enum class TokenType
 
 std::string ToString(const TokenType type);
 
-export struct AnyGet {
-	std::string operator()(bool value) { return value ? "true" : "false"; }
-	std::string operator()(char value) { return std::string(1, value); }
-	std::string operator()(int value) { return std::to_string(value); }
-	std::string operator()(double value) { return std::to_string(value); }
-	std::string operator()(const std::string& value) { return value; }
-	std::string operator()(const std::monostate& value) { return "NIL"; }
-};
-
 export struct Token
 {
 	TokenType m_type = TokenType::UNDEF;
-	std::string m_lexeme;
-	LiteralT m_literal;
+	//Points into the source text, which outlives the tokens and the AST built from them.
+	std::string_view m_lexeme;
+	//Value of NUMBER and STRING tokens. Identifiers and keywords hold their interned name.
+	Value m_literal;
 	int m_line = -1;
 
-	Token(TokenType type, std::string lexeme, LiteralT literal, int line)
+	Token(TokenType type, std::string_view lexeme, Value literal, int line)
 		: m_type(type)
-		, m_lexeme(std::move(lexeme))
+		, m_lexeme(lexeme)
 		, m_literal(std::move(literal))
 		, m_line(line)
 	{}
@@ -62,9 +56,14 @@ export struct Token
 		res += " ";
 		res += m_lexeme;
 		res += " ";
-		res += std::visit(AnyGet{}, m_literal);
+		res += Stringify(m_literal);
 		return res;
 	}
+	//Interned name of an identifier, tables keyed by it compare pointers only.
+	ObjString* Name() const
+	{
+		return m_literal.As<ObjString>();
+	}
 };
 
 
@@ -116,3 +115,9 @@ std::string ToString(const TokenType type)
 		return std::to_string(static_cast<int>(type));
 	}
 }
+
+//Value of the clock() native: seconds since an arbitrary point, with the steady clock's full resolution.
+export double ClockSeconds()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
@@ -0,0 +1,200 @@
+export module embed;
+
+import ast;
+import interpreter;
+import log;
+import optimizer;
+import resolver;
+import value;
+
+import <deque>;
+import <iostream>;
+import <optional>;
+import <sstream>;
+import <stdexcept>;
+import <string>;
+import <string_view>;
+import <vector>;
+
+//Embedding API: a host (e.g. a service handling requests) compiles a script once,
+//then calls its functions as many times as it needs, so a call costs no lexing, parsing or resolving.
+//
+//	Engine engine;
+//	engine.Define("log", 1, [](const std::vector<Value>& arguments) { ...; return Value{}; });
+//	auto& script = engine.Load(source);
+//	const auto handler = engine.Global(script, "handle");
+//	auto res = engine.Call(script, handler, { MakeString("GET /"), 42.0 });
+
+//The script did not compile or its top level failed, what() is everything that was reported.
+export struct LoadError : public std::runtime_error
+{
+	using std::runtime_error::runtime_error;
+};
+
+//A call from the host failed: the script raised a runtime error at m_line,
+//or the function could not be called with these arguments (m_line is -1).
+//Unlike RuntimeError it holds no Value, so it can outlive the engine.
+export struct InvokeError : public std::runtime_error
+{
+	int m_line;
+	InvokeError(const std::string& message, int line)
+		: std::runtime_error(message)
+		, m_line(line)
+	{}
+};
+
+//A loaded script: its tree and the interpreter holding its globals, functions and classes.
+export class Script
+{
+	friend class Engine;
+	//The tokens and the tree point into it.
+	const std::string m_source;
+	std::optional<ast::Program> m_program;
+	Interpreter m_interpreter;
+public:
+	explicit Script(std::string source)
+		: m_source(std::move(source))
+	{}
+	Script(const Script&) = delete;
+	Script& operator=(const Script&) = delete;
+};
+
+//An isolate and the scripts loaded in it. The engine is current on the thread that created it
+//until it is destroyed, so the host can make and release the Values it passes and gets back
+//(they must not outlive the engine). A thread's engines are destroyed in the reverse order of their creation,
+//engines on different threads run in parallel.
+export class Engine
+{
+	std::ostringstream m_errors;
+	Isolate m_isolate;
+	const Isolate::Scope m_scope;
+	const bool m_use_closures;
+	struct Host
+	{
+		std::string m_name;
+		int m_arity;
+		HostFunction m_function;
+	};
+	std::vector<Host> m_host_functions;
+	std::deque<Script> m_scripts;
+public:
+	//print writes to out. Scripts run compiled to closures (Interpreter::InterpretCompiled), unless use_closures is false.
+	explicit Engine(std::ostream& out = std::cout, bool use_closures = true);
+	~Engine();
+	Engine(const Engine&) = delete;
+	Engine& operator=(const Engine&) = delete;
+
+	//Defines a global function of every script, loaded or not.
+	void Define(std::string_view name, int arity, HostFunction function);
+	//Compiles the script and runs its top level once. The Script lives as long as the engine.
+	Script& Load(std::string source);
+	//Calls a global function of the script.
+	Value Invoke(Script& script, std::string_view function, const std::vector<Value>& arguments);
+	//Global variable of the script, e.g. a function to Call many times without looking it up.
+	Value Global(Script& script, std::string_view name);
+	//Returns once the tasks the call started (sleep, read...) have finished too.
+	Value Call(Script& script, const Value& function, const std::vector<Value>& arguments);
+private:
+	//Throws LoadError with the reported errors, if there were any.
+	void CheckErrors();
+};
+
+module :private;
+
+Engine::Engine(std::ostream& out, bool use_closures)
+	: m_isolate(out, m_errors)
+	, m_scope(m_isolate)
+	, m_use_closures(use_closures)
+{}
+
+Engine::~Engine()
+{
+	//Calls from another engine of the thread may have entered theirs since.
+	const Isolate::Scope scope{ m_isolate };
+	m_scripts.clear();
+}
+
+void Engine::Define(std::string_view name, int arity, HostFunction function)
+{
+	const Isolate::Scope scope{ m_isolate };
+	for (auto& script : m_scripts)
+		script.m_interpreter.DefineHostFunction(name, arity, function);
+	m_host_functions.push_back({ std::string(name), arity, std::move(function) });
+}
+
+Script& Engine::Load(std::string source)
+{
+	const Isolate::Scope scope{ m_isolate };
+	auto& script = m_scripts.emplace_back(std::move(source));
+	try
+	{
+		for (const auto& host : m_host_functions)
+			script.m_interpreter.DefineHostFunction(host.m_name, host.m_arity, host.m_function);
+		auto& program = script.m_program.emplace(Compile(script.m_source));
+		CheckErrors();
+		Optimizer{ program }.Optimize();
+		if (m_use_closures)
+			script.m_interpreter.InterpretCompiled(program.Statements());
+		else
+			script.m_interpreter.Interpret(program.Statements());
+		script.m_interpreter.InterpretTasks();
+		CheckErrors();
+	}
+	catch (...)
+	{
+		m_scripts.pop_back();
+		throw;
+	}
+	return script;
+}
+
+//Errors are converted in the engine's isolate, where the RuntimeError's Token is released.
+Value Engine::Global(Script& script, std::string_view name)
+{
+	const Isolate::Scope scope{ m_isolate };
+	try
+	{
+		return script.m_interpreter.GetGlobal(name);
+	}
+	catch (const NativeError& error)
+	{
+		throw InvokeError(error.what(), -1);
+	}
+}
+
+Value Engine::Call(Script& script, const Value& function, const std::vector<Value>& arguments)
+{
+	const Isolate::Scope scope{ m_isolate };
+	try
+	{
+		auto res = script.m_interpreter.Call(function, arguments);
+		script.m_interpreter.RunTasks();
+		return res;
+	}
+	catch (const RuntimeError& error)
+	{
+		//The call stops, so do the tasks it started: they must not run in the next one.
+		script.m_interpreter.Loop().Clear();
+		throw InvokeError(error.what(), error.m_token.m_line);
+	}
+	catch (const NativeError& error)
+	{
+		script.m_interpreter.Loop().Clear();
+		throw InvokeError(error.what(), -1);
+	}
+}
+
+Value Engine::Invoke(Script& script, std::string_view function, const std::vector<Value>& arguments)
+{
+	return Call(script, Global(script, function), arguments);
+}
+
+void Engine::CheckErrors()
+{
+	if (!HasError() && !HasRuntimeError())
+		return;
+	const auto errors = m_errors.str();
+	m_errors.str({});
+	ClearErrors();
+	throw LoadError(errors);
+}
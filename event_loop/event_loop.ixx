@@ -0,0 +1,592 @@
+module;
+
+#ifdef __linux__
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#endif
+
+export module event_loop;
+
+import log;
+import value;
+
+import <algorithm>;
+import <chrono>;
+import <coroutine>;
+import <cstdint>;
+import <deque>;
+import <exception>;
+import <fstream>;
+import <functional>;
+import <iterator>;
+import <queue>;
+import <span>;
+import <string>;
+import <string_view>;
+import <system_error>;
+import <thread>;
+import <unordered_set>;
+import <utility>;
+import <vector>;
+
+class EventLoop;
+
+//Operation of an async native, a coroutine that produces a Value.
+//It starts when it is called, so arguments are checked and files opened before the call returns,
+//and runs until it waits for the loop. Awaiting it gives the value or rethrows its error.
+export class Async
+{
+public:
+	struct promise_type
+	{
+		Value m_value;
+		std::exception_ptr m_error;
+		std::coroutine_handle<> m_continuation = std::noop_coroutine();
+
+		Async get_return_object()
+		{
+			return Async{ std::coroutine_handle<promise_type>::from_promise(*this) };
+		}
+		std::suspend_never initial_suspend() noexcept
+		{
+			return {};
+		}
+		//Kept suspended for the result, then resumes whoever awaits it (if anyone does yet).
+		auto final_suspend() noexcept
+		{
+			struct Final
+			{
+				bool await_ready() noexcept
+				{
+					return false;
+				}
+				std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept
+				{
+					return handle.promise().m_continuation;
+				}
+				void await_resume() noexcept
+				{}
+			};
+			return Final{};
+		}
+		void return_value(Value value)
+		{
+			m_value = std::move(value);
+		}
+		void unhandled_exception()
+		{
+			m_error = std::current_exception();
+		}
+	};
+
+	Async(Async&& other) noexcept
+		: m_handle(std::exchange(other.m_handle, nullptr))
+	{}
+	Async& operator=(Async other) noexcept
+	{
+		std::swap(m_handle, other.m_handle);
+		return *this;
+	}
+	~Async()
+	{
+		if (m_handle)
+			m_handle.destroy();
+	}
+
+	//An error thrown before the operation first waited, e.g. a bad argument.
+	void ThrowIfFailed() const
+	{
+		if (m_handle.done() && m_handle.promise().m_error)
+			std::rethrow_exception(m_handle.promise().m_error);
+	}
+
+	bool await_ready() const noexcept
+	{
+		return m_handle.done();
+	}
+	void await_suspend(std::coroutine_handle<> continuation) noexcept
+	{
+		m_handle.promise().m_continuation = continuation;
+	}
+	Value await_resume()
+	{
+		auto& promise = m_handle.promise();
+		if (promise.m_error)
+			std::rethrow_exception(promise.m_error);
+		return std::move(promise.m_value);
+	}
+private:
+	std::coroutine_handle<promise_type> m_handle;
+	explicit Async(std::coroutine_handle<promise_type> handle)
+		: m_handle(handle)
+	{}
+};
+
+//Coroutine the loop runs from start to end, see EventLoop::Spawn.
+//Its frame is destroyed when it returns, an exception that escapes it stops the loop.
+export class Task
+{
+	friend class EventLoop;
+public:
+	struct promise_type
+	{
+		EventLoop* m_loop = nullptr;
+
+		Task get_return_object()
+		{
+			return Task{ std::coroutine_handle<promise_type>::from_promise(*this) };
+		}
+		//Started by the loop, never inside the call that spawned it.
+		std::suspend_always initial_suspend() noexcept
+		{
+			return {};
+		}
+		struct Final
+		{
+			bool await_ready() noexcept
+			{
+				return false;
+			}
+			void await_suspend(std::coroutine_handle<promise_type> handle) noexcept;
+			void await_resume() noexcept
+			{}
+		};
+		Final final_suspend() noexcept
+		{
+			return {};
+		}
+		void return_void()
+		{}
+		void unhandled_exception();
+	};
+
+	Task(Task&& other) noexcept
+		: m_handle(std::exchange(other.m_handle, nullptr))
+	{}
+	Task& operator=(Task) = delete;
+	~Task()
+	{
+		if (m_handle)
+			m_handle.destroy();
+	}
+private:
+	std::coroutine_handle<promise_type> m_handle;
+	explicit Task(std::coroutine_handle<promise_type> handle)
+		: m_handle(handle)
+	{}
+};
+
+//Runs the tasks of one interpreter (so of one isolate) on its thread: a task runs until it waits
+//for a timer or a file descriptor, then the next ready one does, so many of them are in flight at once
+//and waiting costs no thread. On Linux the waits are one epoll set, timers share one timerfd armed
+//for the earliest deadline. Elsewhere timers sleep until the earliest deadline and reads block.
+export class EventLoop
+{
+	using Clock = std::chrono::steady_clock;
+	struct Timer
+	{
+		Clock::time_point m_deadline;
+		//Timers with the same deadline fire in the order they were set.
+		std::uint64_t m_order;
+		std::coroutine_handle<> m_handle;
+		bool operator>(const Timer& other) const
+		{
+			return std::pair(m_deadline, m_order) > std::pair(other.m_deadline, other.m_order);
+		}
+	};
+	//Frames of the tasks spawned and not finished, destroyed by Clear.
+	std::unordered_set<void*> m_tasks;
+	std::deque<std::coroutine_handle<>> m_ready;
+	std::priority_queue<Timer, std::vector<Timer>, std::greater<>> m_timers;
+	std::uint64_t m_timer_order = 0;
+	//Coroutine waiting for a file descriptor, the epoll event points to it.
+	struct Watcher
+	{
+		int m_fd;
+		std::coroutine_handle<> m_handle;
+	};
+	std::size_t m_waiting = 0;
+	std::exception_ptr m_error;
+	bool m_running = false;
+#ifdef __linux__
+	//Created by the first wait that needs them.
+	int m_epoll = -1;
+	int m_timer = -1;
+#endif
+public:
+	EventLoop() = default;
+	~EventLoop()
+	{
+		Clear();
+	}
+	EventLoop(const EventLoop&) = delete;
+	EventLoop& operator=(const EventLoop&) = delete;
+
+	void Spawn(Task task)
+	{
+		const auto handle = std::exchange(task.m_handle, nullptr);
+		handle.promise().m_loop = this;
+		m_tasks.insert(handle.address());
+		m_ready.push_back(handle);
+	}
+	bool HasTasks() const
+	{
+		return !m_tasks.empty();
+	}
+
+	//Runs until every task finished. The first exception that escapes a task stops it:
+	//the remaining tasks are dropped and the exception is rethrown.
+	//Does nothing when called from a task, the loop that runs it goes on.
+	void Run();
+	//Drops every task that has not finished.
+	void Clear();
+
+	//co_await loop.Sleep(duration) resumes after duration, or on the next turn if it is not positive.
+	auto Sleep(Clock::duration duration)
+	{
+		struct Awaiter
+		{
+			EventLoop& m_loop;
+			Clock::time_point m_deadline;
+			bool await_ready() const noexcept
+			{
+				return false;
+			}
+			void await_suspend(std::coroutine_handle<> handle)
+			{
+				m_loop.m_timers.push({ m_deadline, m_loop.m_timer_order++, handle });
+			}
+			void await_resume() const noexcept
+			{}
+		};
+		return Awaiter{ *this, Clock::now() + duration };
+	}
+	//co_await loop.Readable(fd) resumes when a read from fd will not block: data or end of file.
+	//Regular files can't be waited for, they are always readable.
+	auto Readable(int fd)
+	{
+		struct Awaiter
+		{
+			EventLoop& m_loop;
+			Watcher m_watcher;
+			bool await_ready() const noexcept
+			{
+				return false;
+			}
+			bool await_suspend(std::coroutine_handle<> handle)
+			{
+				m_watcher.m_handle = handle;
+				return m_loop.Watch(m_watcher);
+			}
+			void await_resume() const noexcept
+			{}
+		};
+		return Awaiter{ *this, { fd, nullptr } };
+	}
+private:
+	friend struct Task::promise_type;
+	void Finish(std::coroutine_handle<> task)
+	{
+		m_tasks.erase(task.address());
+		task.destroy();
+	}
+	void Fail(std::exception_ptr error)
+	{
+		if (!m_error)
+			m_error = std::move(error);
+	}
+	//Resumes the timers that expired, returns whether there were any.
+	bool FireTimers();
+	//Blocks until a timer expires or a watched file descriptor is ready.
+	void Wait();
+	//False if the fd can't be waited for, the caller goes on at once.
+	//The watcher is in the suspended coroutine's frame until it is resumed.
+	bool Watch(Watcher& watcher);
+#ifdef __linux__
+	void Open();
+#endif
+};
+
+void Task::promise_type::unhandled_exception()
+{
+	m_loop->Fail(std::current_exception());
+}
+
+//The frame can be destroyed here, the coroutine is suspended.
+void Task::promise_type::Final::await_suspend(std::coroutine_handle<promise_type> handle) noexcept
+{
+	handle.promise().m_loop->Finish(handle);
+}
+
+//An async builtin of the tree-walking backends. Lox calls it with one more argument, the function
+//called with the result on a later turn of the loop (without it, if it takes no parameters).
+//It throws NativeError, the backend reports it at the call.
+export struct AsyncNative
+{
+	std::string_view m_name;
+	int m_arity;
+	Async(*m_function)(EventLoop& loop, std::vector<Value> arguments);
+};
+
+//spawn(callback): calls callback on the next turn of the loop,
+//sleep(ms, callback): after ms milliseconds,
+//read(path, callback): with the content of a file, or of a pipe (FIFO) once its writer closed it.
+export std::span<const AsyncNative> AsyncNatives();
+
+module :private;
+
+void EventLoop::Run()
+{
+	if (m_running)
+		return;
+	m_running = true;
+	struct Stop
+	{
+		EventLoop& m_loop;
+		~Stop()
+		{
+			m_loop.m_running = false;
+		}
+	} stop{ *this };
+	while (!m_tasks.empty() && !m_error)
+	{
+		if (!m_ready.empty())
+		{
+			const auto handle = m_ready.front();
+			m_ready.pop_front();
+			handle.resume();
+			continue;
+		}
+		if (FireTimers())
+			continue;
+		//Every task waits for something that will never happen (can't happen with the builtins).
+		if (m_timers.empty() && m_waiting == 0)
+			break;
+		Wait();
+	}
+	if (m_error)
+	{
+		Clear();
+		std::rethrow_exception(std::exchange(m_error, nullptr));
+	}
+}
+
+void EventLoop::Clear()
+{
+	m_ready.clear();
+	m_timers = {};
+	m_waiting = 0;
+#ifdef __linux__
+	//Closing the set drops what it watches. The descriptors themselves are closed by their coroutines' frames.
+	if (m_epoll != -1)
+	{
+		close(m_epoll);
+		close(m_timer);
+		m_epoll = m_timer = -1;
+	}
+#endif
+	//Destroying a task destroys the operation it awaits and the Values it holds.
+	const auto tasks = std::exchange(m_tasks, {});
+	for (auto* task : tasks)
+		std::coroutine_handle<>::from_address(task).destroy();
+}
+
+bool EventLoop::FireTimers()
+{
+	const auto now = Clock::now();
+	bool fired = false;
+	while (!m_timers.empty() && m_timers.top().m_deadline <= now)
+	{
+		const auto handle = m_timers.top().m_handle;
+		m_timers.pop();
+		//Resumed after every expired timer is taken, a timer it sets for now fires on the next turn.
+		m_ready.push_back(handle);
+		fired = true;
+	}
+	return fired;
+}
+
+#ifdef __linux__
+
+static void ThrowLastError(const char* what)
+{
+	throw std::system_error(errno, std::generic_category(), what);
+}
+
+void EventLoop::Open()
+{
+	if (m_epoll != -1)
+		return;
+	m_epoll = epoll_create1(EPOLL_CLOEXEC);
+	if (m_epoll == -1)
+		ThrowLastError("epoll_create1");
+	m_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (m_timer == -1)
+		ThrowLastError("timerfd_create");
+	//The only event without a watcher.
+	epoll_event event{};
+	event.events = EPOLLIN;
+	event.data.ptr = nullptr;
+	if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_timer, &event) == -1)
+		ThrowLastError("epoll_ctl");
+}
+
+bool EventLoop::Watch(Watcher& watcher)
+{
+	Open();
+	epoll_event event{};
+	event.events = EPOLLIN;
+	event.data.ptr = &watcher;
+	if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, watcher.m_fd, &event) == -1)
+	{
+		//Regular files
+		if (errno == EPERM)
+			return false;
+		ThrowLastError("epoll_ctl");
+	}
+	++m_waiting;
+	return true;
+}
+
+void EventLoop::Wait()
+{
+	Open();
+	//Armed for the earliest deadline, disarmed (zero) when no timer is set.
+	itimerspec spec{};
+	if (!m_timers.empty())
+	{
+		const auto delay = std::max(m_timers.top().m_deadline - Clock::now(), Clock::duration{ 1 });
+		const auto seconds = std::chrono::duration_cast<std::chrono::seconds>(delay);
+		spec.it_value.tv_sec = seconds.count();
+		spec.it_value.tv_nsec = std::chrono::duration_cast<std::chrono::nanoseconds>(delay - seconds).count();
+	}
+	if (timerfd_settime(m_timer, 0, &spec, nullptr) == -1)
+		ThrowLastError("timerfd_settime");
+
+	constexpr int max_events = 64;
+	epoll_event events[max_events];
+	const auto count = epoll_wait(m_epoll, events, max_events, -1);
+	if (count == -1)
+	{
+		if (errno == EINTR)
+			return;
+		ThrowLastError("epoll_wait");
+	}
+	//Resumed after every event is taken, a coroutine may close a descriptor another event refers to.
+	std::vector<std::coroutine_handle<>> ready;
+	for (int i = 0; i < count; ++i)
+	{
+		const auto* watcher = static_cast<const Watcher*>(events[i].data.ptr);
+		if (!watcher)
+		{
+			std::uint64_t expirations;
+			(void)read(m_timer, &expirations, sizeof(expirations));
+			continue;
+		}
+		//A descriptor is watched for one wait.
+		epoll_ctl(m_epoll, EPOLL_CTL_DEL, watcher->m_fd, nullptr);
+		--m_waiting;
+		ready.push_back(watcher->m_handle);
+	}
+	m_ready.insert(std::end(m_ready), std::begin(ready), std::end(ready));
+}
+
+#else
+
+bool EventLoop::Watch(Watcher&)
+{
+	return false;
+}
+
+void EventLoop::Wait()
+{
+	std::this_thread::sleep_until(m_timers.top().m_deadline);
+}
+
+#endif
+
+//The task that calls the callback already starts on a later turn.
+static Async SpawnNative(EventLoop&, std::vector<Value>)
+{
+	co_return Value{};
+}
+
+static Async SleepNative(EventLoop& loop, std::vector<Value> arguments)
+{
+	if (!arguments[0].IsNumber() || !(arguments[0].AsNumber() >= 0))
+		throw NativeError("Argument 1 must be a non-negative number.");
+	//Longer than any script runs, and still a valid time_point.
+	constexpr double max_ms = 1e15;
+	const std::chrono::duration<double, std::milli> duration{ std::min(arguments[0].AsNumber(), max_ms) };
+	co_await loop.Sleep(std::chrono::duration_cast<std::chrono::steady_clock::duration>(duration));
+	co_return Value{};
+}
+
+#ifdef __linux__
+//Closes the descriptor the coroutine reads, whichever way it ends.
+struct FileDescriptor
+{
+	const int m_fd;
+	~FileDescriptor()
+	{
+		if (m_fd != -1)
+			close(m_fd);
+	}
+};
+#endif
+
+static Async ReadNative(EventLoop& loop, std::vector<Value> arguments)
+{
+	if (!arguments[0].IsString())
+		throw NativeError("Argument 1 must be a string.");
+	const auto& path = arguments[0].AsString();
+#ifdef __linux__
+	const FileDescriptor file{ open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC) };
+	if (file.m_fd == -1)
+		throw NativeError("Can't open file '" + path + "'.");
+	struct stat info;
+	if (fstat(file.m_fd, &info) == -1)
+		throw NativeError("Can't read file '" + path + "'.");
+	//A pipe with no writer yet reads as empty, so its first read waits until there is data or the writer is gone.
+	if (!S_ISREG(info.st_mode))
+		co_await loop.Readable(file.m_fd);
+	std::string text;
+	constexpr std::size_t chunk = 64 * 1024;
+	while (true)
+	{
+		const auto size = text.size();
+		text.resize(size + chunk);
+		const auto count = read(file.m_fd, text.data() + size, chunk);
+		text.resize(size + std::max<ssize_t>(count, 0));
+		if (count > 0)
+			continue;
+		if (count == 0)
+			break;
+		if (errno == EAGAIN)
+			co_await loop.Readable(file.m_fd);
+		else if (errno != EINTR)
+			throw NativeError("Can't read file '" + path + "'.");
+	}
+	co_return MakeString(std::move(text));
+#else
+	std::ifstream file{ path, std::ios::binary };
+	if (!file.is_open())
+		throw NativeError("Can't open file '" + path + "'.");
+	std::string text{ std::istreambuf_iterator<char>(file), {} };
+	co_return MakeString(std::move(text));
+#endif
+}
+
+std::span<const AsyncNative> AsyncNatives()
+{
+	static const AsyncNative natives[] = {
+		{ "spawn", 0, SpawnNative },
+		{ "sleep", 1, SleepNative },
+		{ "read", 1, ReadNative },
+	};
+	return natives;
+}
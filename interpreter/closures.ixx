@@ -0,0 +1,561 @@
+export module interpreter:closures;
+
+import ast;
+import core;
+import log;
+import value;
+import interpreter;
+import :environment;
+import :loxcallable;
+import :loxclass;
+
+import <iostream>;
+import <span>;
+import <string>;
+import <utility>;
+import <vector>;
+
+//Closure compilation backend (lox --closures): every node is visited once and turned into a
+//std::function with its children, resolved slot and operator already bound, so running the
+//program skips the Accept/Visit double dispatch and the switch on the operator.
+//It uses the Interpreter's environments, functions and classes and must behave exactly like it.
+class ClosureCompiler : ast::expr::VisitorExpr, ast::stmt::VisitorStmt
+{
+	Interpreter& m_interpreter;
+	//Result of the last visited node, every Visit sets it.
+	ExprCode m_expr;
+	StmtCode m_stmt;
+public:
+	explicit ClosureCompiler(Interpreter& interpreter)
+		: m_interpreter(interpreter)
+	{}
+	//The code is owned by the Interpreter, as long as the functions defined by it.
+	const BlockCode& Compile(std::span<const ast::stmt::StmtPtr> statements);
+private:
+	ast::Completion Visit(const ast::stmt::Block& val) override;
+	ast::Completion Visit(const ast::stmt::Class& val) override;
+	ast::Completion Visit(const ast::stmt::Expression& val) override;
+	ast::Completion Visit(const ast::stmt::Function& val) override;
+	ast::Completion Visit(const ast::stmt::If& val) override;
+	ast::Completion Visit(const ast::stmt::Print& val) override;
+	ast::Completion Visit(const ast::stmt::Return& val) override;
+	ast::Completion Visit(const ast::stmt::Var& val) override;
+	ast::Completion Visit(const ast::stmt::While& val) override;
+
+	Value Visit(const ast::expr::Assign& val) override;
+	Value Visit(const ast::expr::Binary& val) override;
+	Value Visit(const ast::expr::Call& val) override;
+	Value Visit(const ast::expr::Get& val) override;
+	Value Visit(const ast::expr::Grouping& val) override;
+	Value Visit(const ast::expr::Logical& val) override;
+	Value Visit(const ast::expr::Set& val) override;
+	Value Visit(const ast::expr::Literal& val) override;
+	Value Visit(const ast::expr::Super& val) override;
+	Value Visit(const ast::expr::This& val) override;
+	Value Visit(const ast::expr::Unary& val) override;
+	Value Visit(const ast::expr::Variable& val) override;
+
+	ExprCode CompileExpr(const ast::expr::Expr& expr);
+	StmtCode CompileStmt(const ast::stmt::Stmt& stmt);
+	BlockCode CompileBlock(std::span<const ast::stmt::StmtPtr> statements);
+	//Function bodies are kept by the unit being compiled, LoxFunctions point to them.
+	const BlockCode* CompileBody(const ast::stmt::Function& function);
+	std::vector<ExprCode> CompileArguments(const ast::expr::Call& val);
+	ExprCode CompileLoad(const Token& name, const ast::LocalSlot& slot);
+	template<class Operation>
+	ExprCode CompileArithmetic(const ast::expr::Binary& val, ExprCode left, Operation operation);
+	static std::vector<Value> Evaluate(const std::vector<ExprCode>& arguments);
+};
+
+const BlockCode& ClosureCompiler::Compile(std::span<const ast::stmt::StmtPtr> statements)
+{
+	return m_interpreter.m_unit->m_code.emplace_back(CompileBlock(statements));
+}
+
+ExprCode ClosureCompiler::CompileExpr(const ast::expr::Expr& expr)
+{
+	expr.Accept(*this);
+	return std::move(m_expr);
+}
+
+StmtCode ClosureCompiler::CompileStmt(const ast::stmt::Stmt& stmt)
+{
+	stmt.Accept(*this);
+	//Only a profiled program pays for counting lines.
+	if (auto* profiler = m_interpreter.m_profiler)
+	{
+		return [profiler, line = stmt.line, code = std::move(m_stmt)]
+		{
+			profiler->CountLine(line);
+			return code();
+		};
+	}
+	return std::move(m_stmt);
+}
+
+BlockCode ClosureCompiler::CompileBlock(std::span<const ast::stmt::StmtPtr> statements)
+{
+	BlockCode res;
+	res.reserve(statements.size());
+	for (const auto& statement : statements)
+		res.push_back(CompileStmt(*statement));
+	return res;
+}
+
+const BlockCode* ClosureCompiler::CompileBody(const ast::stmt::Function& function)
+{
+	auto body = CompileBlock(function.body);
+	return &m_interpreter.m_unit->m_code.emplace_back(std::move(body));
+}
+
+std::vector<ExprCode> ClosureCompiler::CompileArguments(const ast::expr::Call& val)
+{
+	std::vector<ExprCode> res;
+	res.reserve(val.arguments.size());
+	for (const auto& argument : val.arguments)
+		res.push_back(CompileExpr(*argument));
+	return res;
+}
+
+std::vector<Value> ClosureCompiler::Evaluate(const std::vector<ExprCode>& arguments)
+{
+	std::vector<Value> res;
+	res.reserve(arguments.size());
+	for (const auto& argument : arguments)
+		res.push_back(argument());
+	return res;
+}
+
+ast::Completion ClosureCompiler::Visit(const ast::stmt::Block& val)
+{
+	m_stmt = [&interpreter = m_interpreter, block = CompileBlock(val.statements)]
+	{
+		return interpreter.ExecuteBlock(block, MakeRef<Environment>(interpreter.m_environment));
+	};
+	return {};
+}
+
+ast::Completion ClosureCompiler::Visit(const ast::stmt::Class& val)
+{
+	ExprCode superclass;
+	if (val.superclass)
+		superclass = CompileExpr(*val.superclass);
+	std::vector<std::pair<const ast::stmt::Function*, const BlockCode*>> methods;
+	for (const auto& method : val.methods)
+		methods.emplace_back(method, CompileBody(*method));
+	m_stmt = [&interpreter = m_interpreter, &val, superclass = std::move(superclass), methods = std::move(methods)]
+	{
+		auto& environment = interpreter.m_environment;
+		Ref<LoxClass> sup;
+		if (superclass)
+		{
+			auto value = superclass();
+			if (!value.IsObjType(ObjType::CLASS))
+				throw RuntimeError(val.superclass->name, "Superclass must be a class.");
+			sup = value.AsRef<LoxClass>();
+			environment = MakeRef<Environment>(std::move(environment));
+			environment->Define("super", sup);
+		}
+		StringMap<Ref<LoxFunction>> table;
+		for (const auto& [method, body] : methods)
+		{
+			auto function = MakeRef<LoxFunction>(
+				*method, interpreter.CurrentUnit(), environment, method->name.m_lexeme == "init", true, Value{}, body);
+			table.insert_or_assign(Ref<ObjString>(method->name.Name()), std::move(function));
+		}
+		auto klass = MakeRef<LoxClass>(val, interpreter.CurrentUnit(), std::move(sup), std::move(table));
+		if (superclass)
+			environment = environment->GetEnclosing();
+		environment->Define(val.name, std::move(klass));
+		return ast::Completion::NORMAL;
+	};
+	return {};
+}
+
+ast::Completion ClosureCompiler::Visit(const ast::stmt::Expression& val)
+{
+	m_stmt = [expression = CompileExpr(*val.expression)]
+	{
+		expression();
+		return ast::Completion::NORMAL;
+	};
+	return {};
+}
+
+ast::Completion ClosureCompiler::Visit(const ast::stmt::Function& val)
+{
+	m_stmt = [&interpreter = m_interpreter, &val, body = CompileBody(val)]
+	{
+		auto& environment = interpreter.m_environment;
+		environment->Define(val.name, MakeRef<LoxFunction>(val, interpreter.CurrentUnit(), environment, false, false, Value{}, body));
+		return ast::Completion::NORMAL;
+	};
+	return {};
+}
+
+ast::Completion ClosureCompiler::Visit(const ast::stmt::If& val)
+{
+	auto condition = CompileExpr(*val.condition);
+	auto then_branch = CompileStmt(*val.then_branch);
+	if (!val.else_branch)
+	{
+		m_stmt = [condition = std::move(condition), then_branch = std::move(then_branch)]
+		{
+			if (IsTruthy(condition()))
+				return then_branch();
+			return ast::Completion::NORMAL;
+		};
+		return {};
+	}
+	m_stmt = [condition = std::move(condition), then_branch = std::move(then_branch),
+		else_branch = CompileStmt(*val.else_branch)]
+	{
+		if (IsTruthy(condition()))
+			return then_branch();
+		return else_branch();
+	};
+	return {};
+}
+
+ast::Completion ClosureCompiler::Visit(const ast::stmt::Print& val)
+{
+	m_stmt = [expression = CompileExpr(*val.expression)]
+	{
+		Isolate::Current().Out().Print(expression());
+		return ast::Completion::NORMAL;
+	};
+	return {};
+}
+
+ast::Completion ClosureCompiler::Visit(const ast::stmt::Return& val)
+{
+	ExprCode value;
+	if (val.value)
+		value = CompileExpr(*val.value);
+	m_stmt = [&interpreter = m_interpreter, value = std::move(value)]
+	{
+		interpreter.m_return_value = value ? value() : Value{};
+		return ast::Completion::RETURN;
+	};
+	return {};
+}
+
+ast::Completion ClosureCompiler::Visit(const ast::stmt::Var& val)
+{
+	ExprCode initializer;
+	if (val.initializer)
+		initializer = CompileExpr(*val.initializer);
+	m_stmt = [&interpreter = m_interpreter, &name = val.name, initializer = std::move(initializer)]
+	{
+		interpreter.m_environment->Define(name, initializer ? initializer() : Value{});
+		return ast::Completion::NORMAL;
+	};
+	return {};
+}
+
+ast::Completion ClosureCompiler::Visit(const ast::stmt::While& val)
+{
+	m_stmt = [condition = CompileExpr(*val.condition), body = CompileStmt(*val.body)]
+	{
+		while (IsTruthy(condition()))
+		{
+			if (body() == ast::Completion::RETURN)
+				return ast::Completion::RETURN;
+		}
+		return ast::Completion::NORMAL;
+	};
+	return {};
+}
+
+Value ClosureCompiler::Visit(const ast::expr::Assign& val)
+{
+	auto value = CompileExpr(*val.value);
+	if (val.slot.IsGlobal())
+	{
+		m_expr = [&interpreter = m_interpreter, &name = val.name, value = std::move(value)]
+		{
+			auto res = value();
+			interpreter.m_globals->Assign(name, res);
+			return res;
+		};
+		return {};
+	}
+	m_expr = [&interpreter = m_interpreter, slot = val.slot, value = std::move(value)]
+	{
+		auto res = value();
+		interpreter.m_environment->AssignAt(slot.m_depth, slot.m_slot, res);
+		return res;
+	};
+	return {};
+}
+
+Value ClosureCompiler::Visit(const ast::expr::Variable& val)
+{
+	m_expr = CompileLoad(val.name, val.slot);
+	return {};
+}
+
+Value ClosureCompiler::Visit(const ast::expr::This& val)
+{
+	m_expr = CompileLoad(val.keyword, val.slot);
+	return {};
+}
+
+ExprCode ClosureCompiler::CompileLoad(const Token& name, const ast::LocalSlot& slot)
+{
+	if (slot.IsGlobal())
+	{
+		return [&interpreter = m_interpreter, &name]
+		{
+			return interpreter.m_globals->Get(name);
+		};
+	}
+	if (slot.m_depth == 0)
+	{
+		return [&interpreter = m_interpreter, index = slot.m_slot]
+		{
+			return interpreter.m_environment->GetAt(0, index);
+		};
+	}
+	return [&interpreter = m_interpreter, slot]
+	{
+		return interpreter.m_environment->GetAt(slot.m_depth, slot.m_slot);
+	};
+}
+
+//A number literal on the right, as in n - 1 or i < 10, is bound as a double.
+template<class Operation>
+ExprCode ClosureCompiler::CompileArithmetic(const ast::expr::Binary& val, ExprCode left, Operation operation)
+{
+	const auto* literal = dynamic_cast<const ast::expr::Literal*>(val.right);
+	if (literal && literal->value.IsNumber())
+	{
+		return [&op = val.op, left = std::move(left), right = literal->value, operation]() -> Value
+		{
+			const auto lhs = left();
+			Interpreter::CheckNumberOperands(op, lhs, right);
+			return operation(lhs.AsNumber(), right.AsNumber());
+		};
+	}
+	return [&op = val.op, left = std::move(left), right = CompileExpr(*val.right), operation]() -> Value
+	{
+		const auto lhs = left();
+		const auto rhs = right();
+		Interpreter::CheckNumberOperands(op, lhs, rhs);
+		return operation(lhs.AsNumber(), rhs.AsNumber());
+	};
+}
+
+Value ClosureCompiler::Visit(const ast::expr::Binary& val)
+{
+	auto left = CompileExpr(*val.left);
+	switch (val.op.m_type)
+	{
+	case TokenType::MINUS:
+		m_expr = CompileArithmetic(val, std::move(left), [](double lhs, double rhs) { return lhs - rhs; });
+		return {};
+	case TokenType::SLASH:
+		m_expr = CompileArithmetic(val, std::move(left), [](double lhs, double rhs) { return lhs / rhs; });
+		return {};
+	case TokenType::STAR:
+		m_expr = CompileArithmetic(val, std::move(left), [](double lhs, double rhs) { return lhs * rhs; });
+		return {};
+	case TokenType::GREATER:
+		m_expr = CompileArithmetic(val, std::move(left), [](double lhs, double rhs) { return lhs > rhs; });
+		return {};
+	case TokenType::GREATER_EQUAL:
+		m_expr = CompileArithmetic(val, std::move(left), [](double lhs, double rhs) { return lhs >= rhs; });
+		return {};
+	case TokenType::LESS:
+		m_expr = CompileArithmetic(val, std::move(left), [](double lhs, double rhs) { return lhs < rhs; });
+		return {};
+	case TokenType::LESS_EQUAL:
+		m_expr = CompileArithmetic(val, std::move(left), [](double lhs, double rhs) { return lhs <= rhs; });
+		return {};
+	case TokenType::PLUS:
+		m_expr = [&op = val.op, left = std::move(left), right = CompileExpr(*val.right)]() -> Value
+		{
+			const auto lhs = left();
+			const auto rhs = right();
+			if (lhs.IsNumber() && rhs.IsNumber())
+				return lhs.AsNumber() + rhs.AsNumber();
+			return Interpreter::Add(op, lhs, rhs);
+		};
+		return {};
+	case TokenType::BANG_EQUAL:
+		m_expr = [left = std::move(left), right = CompileExpr(*val.right)]() -> Value
+		{
+			const auto lhs = left();
+			return !IsEqual(lhs, right());
+		};
+		return {};
+	case TokenType::EQUAL_EQUAL:
+		m_expr = [left = std::move(left), right = CompileExpr(*val.right)]() -> Value
+		{
+			const auto lhs = left();
+			return IsEqual(lhs, right());
+		};
+		return {};
+	}
+	m_expr = [left = std::move(left), right = CompileExpr(*val.right)]
+	{
+		left();
+		right();
+		return Value{};
+	};
+	return {};
+}
+
+Value ClosureCompiler::Visit(const ast::expr::Call& val)
+{
+	auto arguments = CompileArguments(val);
+	if (const auto* get = val.invoke)
+	{
+		//Same as Interpreter::Invoke: obj.method(args) calls the method with obj as this.
+		m_expr = [&interpreter = m_interpreter, &val, get, object = CompileExpr(*get->object),
+			arguments = std::move(arguments)]
+		{
+			auto receiver = object();
+			if (!receiver.IsObjType(ObjType::INSTANCE))
+				throw RuntimeError(get->name, "Only instances have properties.");
+			const auto* instance = receiver.As<LoxInstance>();
+			if (const auto* field = instance->FindField(get->name, get->cache))
+			{
+				auto callee = *field;
+				return interpreter.CallValue(val, callee, Evaluate(arguments));
+			}
+			auto* method = instance->FindMethod(get->name);
+			if (!method)
+				throw LoxInstance::UndefinedProperty(get->name);
+			const auto values = Evaluate(arguments);
+			Interpreter::CheckArity(val, *method, values);
+			return method->Invoke(interpreter, receiver, values);
+		};
+		return {};
+	}
+	m_expr = [&interpreter = m_interpreter, &val, callee = CompileExpr(*val.callee),
+		arguments = std::move(arguments)]
+	{
+		const auto function = callee();
+		return interpreter.CallValue(val, function, Evaluate(arguments));
+	};
+	return {};
+}
+
+Value ClosureCompiler::Visit(const ast::expr::Get& val)
+{
+	m_expr = [&val, object = CompileExpr(*val.object)]
+	{
+		const auto value = object();
+		if (value.IsObjType(ObjType::INSTANCE))
+			return value.As<LoxInstance>()->Get(val.name, val.cache);
+		throw RuntimeError(val.name, "Only instances have properties.");
+	};
+	return {};
+}
+
+Value ClosureCompiler::Visit(const ast::expr::Grouping& val)
+{
+	//Nothing to do at runtime, the inner expression is used directly.
+	m_expr = CompileExpr(*val.expression);
+	return {};
+}
+
+Value ClosureCompiler::Visit(const ast::expr::Literal& val)
+{
+	m_expr = [value = val.value]
+	{
+		return value;
+	};
+	return {};
+}
+
+Value ClosureCompiler::Visit(const ast::expr::Logical& val)
+{
+	auto left = CompileExpr(*val.left);
+	auto right = CompileExpr(*val.right);
+	if (val.op.m_type == TokenType::OR)
+	{
+		m_expr = [left = std::move(left), right = std::move(right)]
+		{
+			auto lhs = left();
+			if (IsTruthy(lhs))
+				return lhs;
+			return right();
+		};
+		return {};
+	}
+	m_expr = [left = std::move(left), right = std::move(right)]
+	{
+		auto lhs = left();
+		if (!IsTruthy(lhs))
+			return lhs;
+		return right();
+	};
+	return {};
+}
+
+Value ClosureCompiler::Visit(const ast::expr::Set& val)
+{
+	m_expr = [&val, object = CompileExpr(*val.object), value = CompileExpr(*val.value)]
+	{
+		auto target = object();
+		if (!target.IsObjType(ObjType::INSTANCE))
+			throw RuntimeError(val.name, "Only instances have fields.");
+		auto res = value();
+		target.As<LoxInstance>()->Set(val.name, res, val.cache);
+		return res;
+	};
+	return {};
+}
+
+Value ClosureCompiler::Visit(const ast::expr::Super& val)
+{
+	if (val.slot.IsGlobal())
+	{
+		m_expr = []
+		{
+			return Value{};
+		};
+		return {};
+	}
+	m_expr = [&interpreter = m_interpreter, &val]() -> Value
+	{
+		auto& environment = interpreter.m_environment;
+		const auto distance = val.slot.m_depth;
+		const auto& sup = environment->GetAt(distance, 0);
+		if (!sup.IsObjType(ObjType::CLASS))
+			return {};
+		auto obj = environment->GetAt(distance - 1, 0);
+		if (!obj.IsObjType(ObjType::INSTANCE))
+			return {};
+		auto method = sup.As<LoxClass>()->FindMethod(val.method.Name());
+		if (!method)
+		{
+			throw RuntimeError(val.method,
+				"Undefined property' " + std::string(val.method.m_lexeme) + "'.");
+		}
+		return method->Bind(std::move(obj));
+	};
+	return {};
+}
+
+Value ClosureCompiler::Visit(const ast::expr::Unary& val)
+{
+	auto right = CompileExpr(*val.right);
+	if (val.op.m_type == TokenType::BANG)
+	{
+		m_expr = [right = std::move(right)]() -> Value
+		{
+			return !IsTruthy(right());
+		};
+		return {};
+	}
+	m_expr = [&op = val.op, right = std::move(right)]() -> Value
+	{
+		const auto operand = right();
+		Interpreter::CheckNumberOperand(op, operand);
+		return -operand.AsNumber();
+	};
+	return {};
+}
@@ -2,35 +2,58 @@ export module interpreter:environment;
 
 import core;
 import log;
+import value;
 
-import <any>;
 import <string>;
-import <memory>;
-import <unordered_map>;
+import <string_view>;
+import <vector>;
 
-template<class T>
-bool CheckAnyType(const std::any& val);
-
-export class Environment
+//Local scopes are flat arrays indexed by the slot the Resolver assigned to each variable,
+//only the global scope (the one without an enclosing environment) is looked up by its interned name.
+//A closure and the environment holding it reference each other, so environments are garbage collected.
+export class Environment : public Container
 {
-	std::unordered_map<std::string, std::any> m_values;
-	std::shared_ptr<Environment> m_enclosing;
-	std::unordered_map<std::string, std::string> m_strings_cache;
+	std::vector<Value> m_slots;
+	StringMap<Value> m_values;
+	Ref<Environment> m_enclosing;
 public:
-	Environment() = default;
-	explicit Environment(std::shared_ptr<Environment> enclosing)
-		: m_enclosing(std::move(enclosing))
+	Environment()
+		: Container(ObjType::ENVIRONMENT)
+	{}
+	explicit Environment(Ref<Environment> enclosing)
+		: Container(ObjType::ENVIRONMENT)
+		, m_enclosing(std::move(enclosing))
 	{}
-	void Define(std::string_view name, std::any value)
+	void Trace(Tracer& tracer) const override
+	{
+		tracer.Visit(m_slots);
+		tracer.Visit(m_values);
+		tracer.Visit(m_enclosing);
+	}
+	void Clear() override
+	{
+		m_slots.clear();
+		m_values.clear();
+		m_enclosing = nullptr;
+	}
+	std::string ToString() const override
 	{
-		if (CheckAnyType<std::string>(value))
-			Define(name, std::move(std::any_cast<std::string&>(value)));
+		return "<environment>";
+	}
+	//Locals are defined in the same order the Resolver assigned their slots.
+	void Define(const Token& name, Value value)
+	{
+		if (m_enclosing)
+			m_slots.push_back(std::move(value));
 		else
-			m_values.insert(std::make_pair(std::string(name), std::move(value)));
+			m_values.insert_or_assign(Ref<ObjString>(name.Name()), std::move(value));
 	}
-	void Define(std::string_view name, std::string str)
+	void Define(std::string_view name, Value value)
 	{
-		m_strings_cache.insert(std::make_pair(std::string(name), std::move(str)));
+		if (m_enclosing)
+			m_slots.push_back(std::move(value));
+		else
+			m_values.insert_or_assign(Intern(name), std::move(value));
 	}
 	Environment& Ancestor(int distance)
 	{
@@ -39,53 +62,40 @@ public:
 			res = res->m_enclosing.get();
 		return *res;
 	}
-	std::any GetAt(int distance, std::string_view name)
+	const Value& GetAt(int distance, int slot)
 	{
-		const auto& ancestor = Ancestor(distance);
-		const auto it = ancestor.m_values.find(std::string(name));
-		if (it != std::end(ancestor.m_values))
-			return it->second;
-		return {};
+		return Ancestor(distance).m_slots[slot];
 	}
-	void AssignAt(int distance, const Token& name, std::any val)
+	void AssignAt(int distance, int slot, Value val)
 	{
-		Ancestor(distance).m_values[name.m_lexeme] = std::move(val);
+		Ancestor(distance).m_slots[slot] = std::move(val);
 	}
-	std::any Get(const Token& name)
+	//Global by name, null if it is not defined.
+	const Value* Find(const ObjString* name) const
 	{
-		const auto str_it = m_strings_cache.find(name.m_lexeme);
-		if (str_it != std::end(m_strings_cache))
-		{
-			return std::reference_wrapper<const std::string>(str_it->second);
-		}
-
-		const auto it = m_values.find(name.m_lexeme);
+		const auto it = m_values.find(name);
 		if (it != std::end(m_values))
-			return it->second;
-		if (m_enclosing)
-			return m_enclosing->Get(name);
-		throw RuntimeError(name, "Undefined variable '" + name.m_lexeme + "'.");
+			return &it->second;
+		return nullptr;
 	}
-	void Assign(const Token& name, std::any val)
+	Value Get(const Token& name)
 	{
-		auto it = m_values.find(name.m_lexeme);
+		if (const auto* value = Find(name.Name()))
+			return *value;
+		throw RuntimeError(name, "Undefined variable '" + std::string(name.m_lexeme) + "'.");
+	}
+	void Assign(const Token& name, Value val)
+	{
+		auto it = m_values.find(name.Name());
 		if (it != std::end(m_values))
 		{
 			it->second = std::move(val);
 			return;
 		}
-		if (m_enclosing)
-		{
-			m_enclosing->Assign(name, std::move(val));
-			return;
-		}
-		throw RuntimeError(name, "Undefined variable'" + name.m_lexeme + "'.");
+		throw RuntimeError(name, "Undefined variable'" + std::string(name.m_lexeme) + "'.");
 	}
-	const std::shared_ptr<Environment>& GetEnclosing() const
+	const Ref<Environment>& GetEnclosing() const
 	{
 		return m_enclosing;
 	}
 };
-
-
-
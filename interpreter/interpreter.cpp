@@ -4,170 +4,147 @@ module;
 
 module interpreter;
 
+import array;
 import ast;
 import core;
+import event_loop;
 import log;
+import value;
 //import utils;
 import :loxclass;
 import :loxcallable;
+import :closures;
 
-import <any>;
 import <stdexcept>;
 import <string>;
 import <sstream>;
-import <typeinfo>;
 import <memory>;
-import <variant>;
 import <vector>;
 import <iostream>;
 
-template<class T>
-bool CheckAnyType(const std::any& val)
+static bool IsCallable(const Value& val)
 {
-	return typeid(T) == val.type();
+	return val.IsObjType(ObjType::FUNCTION) || val.IsObjType(ObjType::NATIVE)
+		|| val.IsObjType(ObjType::CLASS);
 }
 
-template<>
-bool CheckAnyType<std::string>(const std::any& val)
-{
-	return CheckAnyType<std::reference_wrapper<const std::string>>(val) || typeid(std::string) == val.type()
-		|| CheckAnyType<std::reference_wrapper<std::string>>(val);
-}
-
-const std::string& GetStringRef(const std::any& str)
-{
-	if (typeid(std::reference_wrapper<const std::string>) == str.type())
-		return std::any_cast<std::reference_wrapper<const std::string>>(str);
-	if (typeid(std::string) == str.type())
-		return std::any_cast<const std::string&>(str);
-	return std::any_cast<std::reference_wrapper<std::string>>(str);
-}
-
-std::any Interpreter::Visit(const ast::stmt::Expression& val)
+ast::Completion Interpreter::Visit(const ast::stmt::Expression& val)
 {
 	Evaluate(*val.expression);
 	return {};
 }
 
-std::any Interpreter::Visit(const ast::stmt::Function& val)
+ast::Completion Interpreter::Visit(const ast::stmt::Function& val)
 {
-	auto function = std::static_pointer_cast<LoxCallable>(std::make_shared<LoxFunction>(val, m_environment));
-	m_environment->Define(val.name.m_lexeme, function);
+	m_environment->Define(val.name, MakeRef<LoxFunction>(val, CurrentUnit(), m_environment));
 	return {};
 }
 
-std::any Interpreter::Visit(const ast::stmt::If& val)
+ast::Completion Interpreter::Visit(const ast::stmt::If& val)
 {
 	if (IsTruthy(Evaluate(*val.condition)))
-		Execute(*val.then_branch);
-	else if (val.else_branch)
-		Execute(*val.else_branch);
-	return {};
+		return Execute(*val.then_branch);
+	if (val.else_branch)
+		return Execute(*val.else_branch);
+	return ast::Completion::NORMAL;
 }
 
-std::any Interpreter::Visit(const ast::stmt::Print& val)
+ast::Completion Interpreter::Visit(const ast::stmt::Print& val)
 {
 	auto res = Evaluate(*val.expression);
-	std::cout << Stringify(res) << std::endl;
+	Isolate::Current().Out().Print(res);
 	return {};
 }
 
-std::any Interpreter::Visit(const ast::stmt::Return& val)
+ast::Completion Interpreter::Visit(const ast::stmt::Return& val)
 {
-	std::any ret_val;
-	if (val.value)
-		ret_val = Evaluate(*val.value);
-	throw Return(std::move(ret_val));
+	m_return_value = val.value ? Evaluate(*val.value) : Value{};
+	return ast::Completion::RETURN;
 }
 
-std::any Interpreter::Visit(const ast::stmt::Var& val)
+ast::Completion Interpreter::Visit(const ast::stmt::Var& val)
 {
-	std::any value;
+	Value value;
 	if (val.initializer)
 		value = Evaluate(*val.initializer);
-	m_environment->Define(val.name.m_lexeme, std::move(value));
+	m_environment->Define(val.name, std::move(value));
 	return {};
 }
 
-std::any Interpreter::Visit(const ast::stmt::While& val)
+ast::Completion Interpreter::Visit(const ast::stmt::While& val)
 {
 	while (IsTruthy(Evaluate(*val.condition)))
-		Execute(*val.body);
-	return {};
+	{
+		if (Execute(*val.body) == ast::Completion::RETURN)
+			return ast::Completion::RETURN;
+	}
+	return ast::Completion::NORMAL;
 }
 
-std::any Interpreter::Visit(const ast::stmt::Block& val)
+ast::Completion Interpreter::Visit(const ast::stmt::Block& val)
 {
-	ExecuteBlock(val.statements, std::make_shared<Environment>(m_environment));
-	return {};
+	return ExecuteBlock(val.statements, MakeRef<Environment>(m_environment));
 }
 
-std::any Interpreter::Visit(const ast::stmt::Class& val)
+ast::Completion Interpreter::Visit(const ast::stmt::Class& val)
 {
-	std::shared_ptr<LoxClass> superclass;
+	Ref<LoxClass> superclass;
 	if (val.superclass)
 	{
 		auto sup = Evaluate(*val.superclass);
-		if (!CheckAnyType<std::shared_ptr<LoxCallable>>(sup))
-		{
-			throw RuntimeError(val.superclass->name, "Superclass must be a class.");
-		}
-		superclass = std::dynamic_pointer_cast<LoxClass>(std::any_cast<std::shared_ptr<LoxCallable>>(sup));
-		if (!superclass)
+		if (!sup.IsObjType(ObjType::CLASS))
 			throw RuntimeError(val.superclass->name, "Superclass must be a class.");
+		superclass = sup.AsRef<LoxClass>();
 	}
 
-	m_environment->Define(val.name.m_lexeme, std::any{});
-
 	if (val.superclass)
 	{
-		m_environment = std::make_shared<Environment>(std::move(m_environment));
+		m_environment = MakeRef<Environment>(std::move(m_environment));
 		m_environment->Define("super", superclass);
 	}
 
-	std::unordered_map<std::string, std::shared_ptr<LoxFunction>> methods;
+	StringMap<Ref<LoxFunction>> methods;
 	for (const auto& method : val.methods)
 	{
-		auto function = std::make_shared<LoxFunction>(
-			*method, m_environment, method->name.m_lexeme == "init");
-		methods[method->name.m_lexeme] = std::move(function);
+		auto function = MakeRef<LoxFunction>(
+			*method, CurrentUnit(), m_environment, method->name.m_lexeme == "init", true);
+		methods.insert_or_assign(Ref<ObjString>(method->name.Name()), std::move(function));
 	}
 
-	auto klass = static_pointer_cast<LoxCallable>(
-		std::make_shared<LoxClass>(val.name.m_lexeme,
-			std::move(superclass),
-			std::move(methods)));
+	auto klass = MakeRef<LoxClass>(val,
+		CurrentUnit(),
+		std::move(superclass),
+		std::move(methods));
 	if (val.superclass)
 		m_environment = m_environment->GetEnclosing();
-	m_environment->Assign(val.name, std::move(klass));
+	//Methods only look the class up when called, so it can be defined after they are created.
+	m_environment->Define(val.name, std::move(klass));
 	return {};
 }
 
-std::any Interpreter::Visit(const ast::expr::Assign& val)
+Value Interpreter::Visit(const ast::expr::Assign& val)
 {
 	auto value = Evaluate(*val.value);
-	const auto distance_it = m_locals.find(val);
-	if (distance_it != std::end(m_locals))
-		m_environment->AssignAt(distance_it->second, val.name, std::move(value));
+	if (val.slot.IsGlobal())
+		m_globals->Assign(val.name, value);
 	else
-		m_globals->Assign(val.name, std::move(value));
+		m_environment->AssignAt(val.slot.m_depth, val.slot.m_slot, value);
 	return value;
 }
 
-std::any Interpreter::Visit(const ast::expr::Variable& val)
+Value Interpreter::Visit(const ast::expr::Variable& val)
 {
-	return LookUpVariable(val.name, val);
+	return LookUpVariable(val.name, val.slot);
 }
 
-std::any Interpreter::LookUpVariable(const Token& name, const ast::expr::Expr& expr)
+Value Interpreter::LookUpVariable(const Token& name, const ast::LocalSlot& slot)
 {
-	const auto distance_it = m_locals.find(expr);
-	if (distance_it != std::end(m_locals))
-		return m_environment->GetAt(distance_it->second, name.m_lexeme);
-	return m_globals->Get(name);
+	if (slot.IsGlobal())
+		return m_globals->Get(name);
+	return m_environment->GetAt(slot.m_depth, slot.m_slot);
 }
 
-std::any Interpreter::Visit(const ast::expr::Binary& val)
+Value Interpreter::Visit(const ast::expr::Binary& val)
 {
 	auto left = Evaluate(*val.left);
 	auto right = Evaluate(*val.right);
@@ -175,48 +152,27 @@ std::any Interpreter::Visit(const ast::expr::Binary& val)
 	{
 	case TokenType::MINUS:
 		CheckNumberOperands(val.op, left, right);
-		return std::any_cast<double>(left) - std::any_cast<double>(right);
+		return left.AsNumber() - right.AsNumber();
 	case TokenType::SLASH:
 		CheckNumberOperands(val.op, left, right);
-		return std::any_cast<double>(left) / std::any_cast<double>(right);
+		return left.AsNumber() / right.AsNumber();
 	case TokenType::STAR:
 		CheckNumberOperands(val.op, left, right);
-		return std::any_cast<double>(left) * std::any_cast<double>(right);
+		return left.AsNumber() * right.AsNumber();
 	case TokenType::PLUS:
-		if (CheckAnyType<double>(left) &&
-			CheckAnyType<double>(right))
-		{
-			return std::any_cast<double>(left) + std::any_cast<double>(right);
-		}
-		if (CheckAnyType<std::string>(left) &&
-			CheckAnyType<std::string>(right))
-		{
-			return GetStringRef(left) + GetStringRef(right);
-		}
-		if (CheckAnyType<std::string>(left) &&
-			CheckAnyType<double>(right))
-		{
-			return GetStringRef(left) + std::to_string(std::any_cast<double>(right));
-		}
-		if (CheckAnyType<double>(left) &&
-			CheckAnyType<std::string>(right))
-		{
-			return std::to_string(std::any_cast<double>(left)) + GetStringRef(right);
-		}
-		throw RuntimeError(val.op, "Operands must be two numbers or two strings.");
-		break;
+		return Add(val.op, left, right);
 	case TokenType::GREATER:
 		CheckNumberOperands(val.op, left, right);
-		return std::any_cast<double>(left) > std::any_cast<double>(right);
+		return left.AsNumber() > right.AsNumber();
 	case TokenType::GREATER_EQUAL:
 		CheckNumberOperands(val.op, left, right);
-		return std::any_cast<double>(left) >= std::any_cast<double>(right);
+		return left.AsNumber() >= right.AsNumber();
 	case TokenType::LESS:
 		CheckNumberOperands(val.op, left, right);
-		return std::any_cast<double>(left) < std::any_cast<double>(right);
+		return left.AsNumber() < right.AsNumber();
 	case TokenType::LESS_EQUAL:
 		CheckNumberOperands(val.op, left, right);
-		return std::any_cast<double>(left) <= std::any_cast<double>(right);
+		return left.AsNumber() <= right.AsNumber();
 	case TokenType::BANG_EQUAL:
 		return !IsEqual(left, right);
 	case TokenType::EQUAL_EQUAL:
@@ -225,55 +181,101 @@ std::any Interpreter::Visit(const ast::expr::Binary& val)
 	return {};
 }
 
-std::any Interpreter::Visit(const ast::expr::Call& val)
+Value Interpreter::Add(const Token& op, const Value& left, const Value& right)
+{
+	if (left.IsNumber() && right.IsNumber())
+		return left.AsNumber() + right.AsNumber();
+	if ((left.IsString() || left.IsNumber()) && (right.IsString() || right.IsNumber()))
+		return Concatenate(left, right);
+	throw RuntimeError(op, "Operands must be two numbers or two strings.");
+}
+
+Value Interpreter::Visit(const ast::expr::Call& val)
 {
+	if (val.invoke)
+		return Invoke(val, *val.invoke);
 	auto callee = Evaluate(*val.callee);
-	std::vector<std::any> arguments;
+	return CallValue(val, callee, EvaluateArguments(val));
+}
+
+std::vector<Value> Interpreter::EvaluateArguments(const ast::expr::Call& val)
+{
+	std::vector<Value> arguments;
 	arguments.reserve(val.arguments.size());
 	for (const auto& argument : val.arguments)
 		arguments.push_back(Evaluate(*argument));
-	if (!CheckAnyType<std::shared_ptr<LoxCallable>>(callee))
-		throw RuntimeError(val.paren, "Can only call functions and classes.");
-	const auto& function = std::any_cast<std::shared_ptr<LoxCallable>&>(callee);
-	if (arguments.size() != function->Arity())
+	return arguments;
+}
+
+//obj.method(args): the method is called with obj as this, no bound method is created.
+//A field holding a callable is called like any other value.
+Value Interpreter::Invoke(const ast::expr::Call& val, const ast::expr::Get& get)
+{
+	auto object = Evaluate(*get.object);
+	if (!object.IsObjType(ObjType::INSTANCE))
+		throw RuntimeError(get.name, "Only instances have properties.");
+	const auto* instance = object.As<LoxInstance>();
+	if (const auto* field = instance->FindField(get.name, get.cache))
 	{
-		throw RuntimeError(val.paren, "Expected " + std::to_string(function->Arity()) +
+		auto callee = *field;
+		return CallValue(val, callee, EvaluateArguments(val));
+	}
+	auto* method = instance->FindMethod(get.name);
+	if (!method)
+		throw LoxInstance::UndefinedProperty(get.name);
+	const auto arguments = EvaluateArguments(val);
+	CheckArity(val, *method, arguments);
+	return method->Invoke(*this, object, arguments);
+}
+
+void Interpreter::CheckArity(const ast::expr::Call& val, const LoxCallable& function,
+	const std::vector<Value>& arguments)
+{
+	if (arguments.size() != function.Arity())
+	{
+		throw RuntimeError(val.paren, "Expected " + std::to_string(function.Arity()) +
 			" arguments but got " + std::to_string(arguments.size()) + ".");
 	}
-	return function->Call(*this, arguments);
 }
 
-std::any Interpreter::Visit(const ast::expr::Get& val)
+Value Interpreter::CallValue(const ast::expr::Call& val, const Value& callee, const std::vector<Value>& arguments)
 {
-	auto object = Evaluate(*val.object);
-	if (CheckAnyType<std::shared_ptr<LoxInstance>>(object))
+	if (!IsCallable(callee))
+		throw RuntimeError(val.paren, "Can only call functions and classes.");
+	auto* function = callee.As<LoxCallable>();
+	CheckArity(val, *function, arguments);
+	//A native's error is raised at its call, errors of nested calls are RuntimeErrors already.
+	try
+	{
+		return function->CallAt(*this, arguments, val.paren);
+	}
+	catch (const NativeError& error)
 	{
-		return std::any_cast<std::shared_ptr<LoxInstance>&>(object)->Get(val.name);
+		throw RuntimeError(val.paren, error.what());
 	}
+}
+
+Value Interpreter::Visit(const ast::expr::Get& val)
+{
+	auto object = Evaluate(*val.object);
+	if (object.IsObjType(ObjType::INSTANCE))
+		return object.As<LoxInstance>()->Get(val.name, val.cache);
 	throw RuntimeError(val.name, "Only instances have properties.");
 }
 
 
-std::any Interpreter::Visit(const ast::expr::Grouping& val)
+Value Interpreter::Visit(const ast::expr::Grouping& val)
 {
 	return Evaluate(*val.expression);
 }
 
-std::any Interpreter::Visit(const ast::expr::Literal& val)
+Value Interpreter::Visit(const ast::expr::Literal& val)
 {
-	if (std::holds_alternative<std::monostate>(val.value))
-		return {};
-	if (std::holds_alternative<std::string>(val.value))
-		return std::get<std::string>(val.value);
-	if (std::holds_alternative<double>(val.value))
-		return std::get<double>(val.value);
-	if (std::holds_alternative<bool>(val.value))
-		return std::get<bool>(val.value);
-	//should be unreacable
-	throw std::runtime_error("Unknown literal type.");
+	//String literals were interned by the Lexer, so this is just a reference count increment.
+	return val.value;
 }
 
-std::any Interpreter::Visit(const ast::expr::Logical& val)
+Value Interpreter::Visit(const ast::expr::Logical& val)
 {
 	auto left = Evaluate(*val.left);
 	if (val.op.m_type == TokenType::OR)
@@ -286,167 +288,201 @@ std::any Interpreter::Visit(const ast::expr::Logical& val)
 	return Evaluate(*val.right);
 }
 
-std::any Interpreter::Visit(const ast::expr::Set& val)
+Value Interpreter::Visit(const ast::expr::Set& val)
 {
 	auto object = Evaluate(*val.object);
-	if (!CheckAnyType<std::shared_ptr<LoxInstance>>(object))
+	if (!object.IsObjType(ObjType::INSTANCE))
 	{
 		throw RuntimeError(val.name, "Only instances have fields.");
 	}
 	auto value = Evaluate(*val.value);
-	std::any_cast<std::shared_ptr<LoxInstance>>(object)->Set(val.name, std::move(value));
+	object.As<LoxInstance>()->Set(val.name, value, val.cache);
 	return value;
 }
 
-std::any Interpreter::Visit(const ast::expr::Super& val)
+Value Interpreter::Visit(const ast::expr::Super& val)
 {
-	const auto it = m_locals.find(val);
-	if (it == std::end(m_locals))
+	if (val.slot.IsGlobal())
 		return {};
-	auto sup = m_environment->GetAt(it->second, "super");
-	if (CheckAnyType<std::shared_ptr<LoxClass>>(sup))
+	const auto distance = val.slot.m_depth;
+	const auto& sup = m_environment->GetAt(distance, 0);
+	if (sup.IsObjType(ObjType::CLASS))
 	{
-		auto obj = m_environment->GetAt(it->second - 1, "this");
-		if (CheckAnyType<std::shared_ptr<LoxInstance>>(obj))
+		auto obj = m_environment->GetAt(distance - 1, 0);
+		if (obj.IsObjType(ObjType::INSTANCE))
 		{
-			auto method = std::any_cast<std::shared_ptr<LoxClass>>(sup)
-				->FindMethod(val.method.m_lexeme);
+			auto method = sup.As<LoxClass>()->FindMethod(val.method.Name());
 
 			if (!method)
 			{
 				throw RuntimeError(val.method,
-					"Undefined property' " + val.method.m_lexeme + "'.");
+					"Undefined property' " + std::string(val.method.m_lexeme) + "'.");
 			}
-			return static_pointer_cast<LoxCallable>(method->Bind(std::any_cast<std::shared_ptr<LoxInstance>>(obj)));
+			return method->Bind(std::move(obj));
 		}
 	}
 	return {};
 }
 
-std::any Interpreter::Visit(const ast::expr::This& val)
+Value Interpreter::Visit(const ast::expr::This& val)
 {
-	return LookUpVariable(val.keyword, val);
+	return LookUpVariable(val.keyword, val.slot);
 }
 
-std::any Interpreter::Visit(const ast::expr::Unary& val)
+Value Interpreter::Visit(const ast::expr::Unary& val)
 {
 	auto right = Evaluate(*val.right);
 	switch (val.op.m_type)
 	{
 	case TokenType::BANG:
-		return IsTruthy(right);
+		return !IsTruthy(right);
 	case TokenType::MINUS:
 		CheckNumberOperand(val.op, right);
-		return -std::any_cast<double>(right);
+		return -right.AsNumber();
 	}
 	return {};
 }
 
-void Interpreter::Execute(const ast::stmt::Stmt& stmt)
+ast::Completion Interpreter::Execute(const ast::stmt::Stmt& stmt)
 {
-	stmt.Accept(*this);
+	if (m_profiler)
+		m_profiler->CountLine(stmt.line);
+	return stmt.Accept(*this);
 }
 
-void Interpreter::Resolve(const ast::expr::Expr& expr, int depth)
+ast::Completion Interpreter::ExecuteBlock(std::span<const ast::stmt::StmtPtr> statements, Ref<Environment> environment)
 {
-	m_locals.emplace(expr, depth);
+	auto prev = m_environment;
+	m_environment = std::move(environment);
+	SCOPE_EXIT{ m_environment = std::move(prev); };
+	for (const auto& statement : statements)
+	{
+		if (Execute(*statement) == ast::Completion::RETURN)
+			return ast::Completion::RETURN;
+	}
+	return ast::Completion::NORMAL;
 }
 
-void Interpreter::ExecuteBlock(const std::vector<ast::stmt::StmtPtr>& statements, std::shared_ptr<Environment> environment)
+ast::Completion Interpreter::ExecuteBlock(const BlockCode& code, Ref<Environment> environment)
 {
 	auto prev = m_environment;
 	m_environment = std::move(environment);
 	SCOPE_EXIT{ m_environment = std::move(prev); };
-	for (const auto& statement : statements)
-		Execute(*statement);
+	for (const auto& statement : code)
+	{
+		if (statement() == ast::Completion::RETURN)
+			return ast::Completion::RETURN;
+	}
+	return ast::Completion::NORMAL;
 }
 
-std::any Interpreter::Evaluate(const ast::expr::Expr& expr)
+Value Interpreter::Evaluate(const ast::expr::Expr& expr)
 {
 	return expr.Accept(*this);
 }
 
-bool Interpreter::IsTruthy(const std::any& val)
+void Interpreter::CheckNumberOperand(const Token& op, const Value& operand)
 {
-	if (!val.has_value())
-		return false;
-	if (CheckAnyType<bool>(val))
-		return std::any_cast<bool>(val);
-	return true;
+	if (operand.IsNumber())
+		return;
+	throw RuntimeError(op, "Operand must be a number.");
 }
 
-bool Interpreter::IsEqual(const std::any& left, const std::any& right)
+void Interpreter::CheckNumberOperands(const Token& op, const Value& left, const Value& right)
 {
-	if (!left.has_value() && !right.has_value())
-		return true;
-	if (!left.has_value())
-		return false;
-	if (left.type() == right.type())
-	{
-		if (CheckAnyType<bool>(left))
-			return std::any_cast<bool>(left) == std::any_cast<bool>(right);
-		if (CheckAnyType<double>(left))
-			return std::any_cast<double>(left) == std::any_cast<double>(right);
-		if (CheckAnyType<std::string>(left))
-			return GetStringRef(left) == GetStringRef(right);
-		return false;
-	}
-	return false;
+	if (left.IsNumber() && right.IsNumber())
+		return;
+	throw RuntimeError(op, "Operands must be numbers.");
+}
 
+Interpreter::Interpreter(Profiler* profiler)
+	: m_globals(MakeRef<Environment>())
+	, m_environment(m_globals)
+	, m_profiler(profiler)
+{
+	m_globals->Define("clock", MakeRef<Clock>());
+	for (const auto& native : ArrayNatives())
+		m_globals->Define(native.m_name, MakeRef<Native>(native));
+	for (const auto& native : AsyncNatives())
+		m_globals->Define(native.m_name, MakeRef<AsyncCallable>(native));
 }
 
-void Interpreter::CheckNumberOperand(const Token& op, const std::any& operand)
+void Interpreter::DefineHostFunction(std::string_view name, int arity, HostFunction function)
 {
-	if (CheckAnyType<double>(operand))
-		return;
-	throw RuntimeError(op, "Operand must be a number.");
+	m_globals->Define(name, MakeRef<HostCallable>(arity, std::move(function)));
 }
 
-void Interpreter::CheckNumberOperands(const Token& op, const std::any& left, const std::any& right)
+Value Interpreter::GetGlobal(std::string_view name) const
 {
-	if (CheckAnyType<double>(left) && CheckAnyType<double>(right))
-		return;
-	throw RuntimeError(op, "Operands must be numbers.");
+	if (const auto* value = m_globals->Find(Intern(name).get()))
+		return *value;
+	throw NativeError("Undefined variable '" + std::string(name) + "'.");
 }
 
-std::string Interpreter::Stringify(const std::any& val)
+Value Interpreter::Call(const Value& callee, const std::vector<Value>& arguments)
 {
-	if (!val.has_value())
-		return "nil";
-	if (CheckAnyType<double>(val))
-		return std::to_string(std::any_cast<double>(val));
-	if (CheckAnyType<std::string>(val))
-		return GetStringRef(val);
-	if (CheckAnyType<bool>(val))
+	if (!IsCallable(callee))
+		throw NativeError("Can only call functions and classes.");
+	auto* function = callee.As<LoxCallable>();
+	if (arguments.size() != function->Arity())
 	{
-		std::stringstream ss;
-		ss << std::boolalpha << std::any_cast<bool>(val);
-		return ss.str();
+		throw NativeError("Expected " + std::to_string(function->Arity()) +
+			" arguments but got " + std::to_string(arguments.size()) + ".");
 	}
-	if (CheckAnyType<std::shared_ptr<LoxCallable>>(val))
-		return std::any_cast<std::shared_ptr<LoxCallable>>(val)->ToString();
-	if (CheckAnyType<std::shared_ptr<LoxClass>>(val))
-		return std::any_cast<std::shared_ptr<LoxClass>>(val)->ToString();
-	if (CheckAnyType<std::shared_ptr<LoxInstance>>(val))
-		return std::any_cast<std::shared_ptr<LoxInstance>>(val)->ToString();
+	return function->Call(*this, arguments);
+}
 
-	//should be unreacable
-	throw std::runtime_error("Can`t stringify type.");
+void Interpreter::RunTasks()
+{
+	m_loop.Run();
 }
 
-Interpreter::Interpreter()
-	: m_globals(std::make_shared<Environment>())
-	, m_environment(m_globals)
+void Interpreter::InterpretTasks() try
+{
+	m_loop.Run();
+}
+catch (const RuntimeError& err)
+{
+	HandleRuntimeError(err);
+}
+
+void Interpreter::Interpret(std::span<const ast::stmt::StmtPtr> statements)
+{
+	Run(MakeRef<CodeUnit>(), statements, false);
+}
+
+void Interpreter::InterpretCompiled(std::span<const ast::stmt::StmtPtr> statements)
 {
-	m_globals->Define("clock", static_pointer_cast<LoxCallable>(std::make_shared<Clock>()));
+	Run(MakeRef<CodeUnit>(), statements, true);
 }
 
-void Interpreter::Interpret(const std::vector<ast::stmt::StmtPtr>& statements) try
+void Interpreter::Interpret(Ref<CodeUnit> unit)
 {
-	for (const auto& stmt : statements)
-		Execute(*stmt);
+	Run(unit, unit->GetProgram().Statements(), false);
+}
+
+void Interpreter::InterpretCompiled(Ref<CodeUnit> unit)
+{
+	Run(unit, unit->GetProgram().Statements(), true);
+}
+
+void Interpreter::Run(const Ref<CodeUnit>& unit, std::span<const ast::stmt::StmtPtr> statements, bool compiled) try
+{
+	const UnitScope scope{ *this, unit.get() };
+	if (compiled)
+	{
+		for (const auto& statement : ClosureCompiler{ *this }.Compile(statements))
+			statement();
+	}
+	else
+	{
+		for (const auto& stmt : statements)
+			Execute(*stmt);
+	}
 }
 catch (const RuntimeError& err)
 {
+	//The script stops, so do the tasks it started.
+	m_loop.Clear();
 	HandleRuntimeError(err);
-}
\ No newline at end of file
+}
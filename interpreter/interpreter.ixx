@@ -2,81 +2,202 @@ export module interpreter;
 
 import ast;
 import core;
+import event_loop;
 import log;
+import value;
 import :environment;
+export import :profiler;
+import :shape;
 
 import <functional>;
+import <list>;
+import <optional>;
 import <stdexcept>;
+import <span>;
 import <string>;
+import <string_view>;
 import <sstream>;
-import <typeinfo>;
 import <memory>;
-import <map>;
-import <variant>;
+import <utility>;
 import <vector>;
 import <iostream>;
 
+class LoxCallable;
 class LoxFunction;
-class Resolver;
+class ClosureCompiler;
 
-namespace std
+//Nodes compiled by the ClosureCompiler: operators, resolved slots and children are bound once,
+//so running them is one indirect call per node instead of Accept and Visit.
+using ExprCode = std::function<Value()>;
+using StmtCode = std::function<ast::Completion()>;
+using BlockCode = std::vector<StmtCode>;
+
+//C++ function a host defines as a global of its scripts (see the embed module).
+//It reports errors by throwing NativeError, like the builtins.
+export using HostFunction = std::function<Value(const std::vector<Value>& arguments)>;
+
+//A program run by the Interpreter and the code the ClosureCompiler made of it. Functions and classes
+//point into both, so each of them holds the unit it was defined in, and the unit is freed with the last
+//of them: a REPL line lives exactly as long as something it defined can still be called.
+export class CodeUnit : public Object
 {
-	template<>
-	struct less<std::reference_wrapper<const ast::expr::Expr>>
+	//The tokens of the program view it, so it is never moved.
+	const std::string m_source;
+	std::optional<ast::Program> m_program;
+	//Reported to the heap, see AddExternalMemory.
+	std::size_t m_external_bytes = 0;
+public:
+	//Statements and function bodies compiled by InterpretCompiled, a list because the tree-walker
+	//leaves it empty and an empty deque still allocates.
+	//Destroyed before the program, the code references its nodes.
+	std::list<BlockCode> m_code;
+
+	//No source and no program when the caller owns the program, only the compiled code is kept.
+	explicit CodeUnit(std::string source = {})
+		: Object(ObjType::CODE_UNIT)
+		, m_source(std::move(source))
+	{}
+	~CodeUnit() override
 	{
-		bool operator() (const std::reference_wrapper<const ast::expr::Expr>& lhs, const std::reference_wrapper<const ast::expr::Expr>& rhs) const
-		{
-			return std::addressof(lhs.get()) < std::addressof(rhs.get());
-		}
-	};
-}
+		RemoveExternalMemory(m_external_bytes);
+	}
+	std::string_view Source() const
+	{
+		return m_source;
+	}
+	//Called once, with the program compiled from Source().
+	void SetProgram(ast::Program program)
+	{
+		m_program.emplace(std::move(program));
+		const auto bytes = m_source.size() + m_program->BytesAllocated()
+			+ m_program->Tokens().size() * sizeof(Token);
+		m_external_bytes = bytes;
+		AddExternalMemory(bytes);
+	}
+	ast::Program& GetProgram()
+	{
+		return *m_program;
+	}
+	std::string ToString() const override
+	{
+		return "<code>";
+	}
+};
 
 export class Interpreter : public ast::expr::VisitorExpr, ast::stmt::VisitorStmt
 {
 	friend class LoxFunction;
-	friend class Resolver;
-	const std::shared_ptr<Environment> m_globals;
-	std::shared_ptr<Environment> m_environment;
-	std::map<std::reference_wrapper<const ast::expr::Expr>, int> m_locals;
+	friend class ClosureCompiler;
+	const Ref<Environment> m_globals;
+	Ref<Environment> m_environment;
+	//Set by a return statement, taken by the LoxFunction call it returns from.
+	Value m_return_value;
+	//Not owned, null unless --profile.
+	Profiler* const m_profiler;
+	//Unit of the code being run, functions and classes defined now belong to it.
+	CodeUnit* m_unit = nullptr;
+	//Layouts of the instances created by this interpreter. The property caches of the trees it runs
+	//point to them, so a Program must not be run by another Interpreter.
+	const std::unique_ptr<const Shape> m_root_shape = Shape::NewRoot();
+	//Tasks of the async natives. Last, so they are dropped before what they reference.
+	EventLoop m_loop;
 public:
-	Interpreter();
-	void Interpret(const std::vector<ast::stmt::StmtPtr>& statements);
+	explicit Interpreter(Profiler* profiler = nullptr);
+	//The program must outlive every function and class it defines.
+	void Interpret(std::span<const ast::stmt::StmtPtr> statements);
+	//Compiles the statements to closures and runs them instead of walking the tree.
+	void InterpretCompiled(std::span<const ast::stmt::StmtPtr> statements);
+	//Runs the program the unit owns, so what it defines keeps it alive.
+	void Interpret(Ref<CodeUnit> unit);
+	void InterpretCompiled(Ref<CodeUnit> unit);
+	Profiler* GetProfiler() const
+	{
+		return m_profiler;
+	}
+	const Shape* RootShape() const
+	{
+		return m_root_shape.get();
+	}
+
+	//Embedding API, used by the embed module.
+	void DefineHostFunction(std::string_view name, int arity, HostFunction function);
+	//Value of a global variable, NativeError if it is not defined.
+	Value GetGlobal(std::string_view name) const;
+	//Calls a function or class like a call expression in the script, its errors are thrown:
+	//RuntimeError from the script, NativeError if callee can't be called with these arguments.
+	Value Call(const Value& callee, const std::vector<Value>& arguments);
+	//Runs the tasks the async natives started until none is left, see EventLoop::Run.
+	//The drivers run them after the top level of a script (after the last declaration of a stream,
+	//after each REPL line), a host after calling into it. Errors are thrown.
+	void RunTasks();
+	//RunTasks, with a runtime error reported like one of the top level.
+	void InterpretTasks();
+	EventLoop& Loop()
+	{
+		return m_loop;
+	}
 private:
-	std::any Visit(const ast::stmt::Expression& val) override;
-	std::any Visit(const ast::stmt::Function& val) override;
-	std::any Visit(const ast::stmt::If& val) override;
-	std::any Visit(const ast::stmt::Print& val) override;
-	std::any Visit(const ast::stmt::Return& val) override;
-	std::any Visit(const ast::stmt::Var& val) override;
-	std::any Visit(const ast::stmt::While& val) override;
-	std::any Visit(const ast::stmt::Block& val) override;
-	std::any Visit(const ast::stmt::Class& val) override;
+	//Sets the unit of the code run in its lifetime.
+	class UnitScope
+	{
+		Interpreter& m_interpreter;
+		CodeUnit* const m_prev;
+	public:
+		UnitScope(Interpreter& interpreter, CodeUnit* unit)
+			: m_interpreter(interpreter)
+			, m_prev(std::exchange(interpreter.m_unit, unit))
+		{}
+		~UnitScope()
+		{
+			m_interpreter.m_unit = m_prev;
+		}
+		UnitScope(const UnitScope&) = delete;
+		UnitScope& operator=(const UnitScope&) = delete;
+	};
+	Ref<CodeUnit> CurrentUnit() const
+	{
+		return Ref<CodeUnit>(m_unit);
+	}
+	void Run(const Ref<CodeUnit>& unit, std::span<const ast::stmt::StmtPtr> statements, bool compiled);
+
+	ast::Completion Visit(const ast::stmt::Expression& val) override;
+	ast::Completion Visit(const ast::stmt::Function& val) override;
+	ast::Completion Visit(const ast::stmt::If& val) override;
+	ast::Completion Visit(const ast::stmt::Print& val) override;
+	ast::Completion Visit(const ast::stmt::Return& val) override;
+	ast::Completion Visit(const ast::stmt::Var& val) override;
+	ast::Completion Visit(const ast::stmt::While& val) override;
+	ast::Completion Visit(const ast::stmt::Block& val) override;
+	ast::Completion Visit(const ast::stmt::Class& val) override;
 
-	std::any Visit(const ast::expr::Assign& val) override;
-	std::any Visit(const ast::expr::Variable& val) override;
-	std::any LookUpVariable(const Token& name, const ast::expr::Expr& expr);
-	std::any Visit(const ast::expr::Binary& val) override;
-	std::any Visit(const ast::expr::Call& val) override;
-	std::any Visit(const ast::expr::Get& val) override;
-	std::any Visit(const ast::expr::Grouping& val) override;
-	std::any Visit(const ast::expr::Literal& val) override;
-	std::any Visit(const ast::expr::Logical& val) override;
-	std::any Visit(const ast::expr::Set& val) override;
-	std::any Visit(const ast::expr::Super& val) override;
-	std::any Visit(const ast::expr::This& val) override;
-	std::any Visit(const ast::expr::Unary& val) override;
+	Value Visit(const ast::expr::Assign& val) override;
+	Value Visit(const ast::expr::Variable& val) override;
+	Value LookUpVariable(const Token& name, const ast::LocalSlot& slot);
+	Value Visit(const ast::expr::Binary& val) override;
+	static Value Add(const Token& op, const Value& left, const Value& right);
+	Value Visit(const ast::expr::Call& val) override;
+	Value Invoke(const ast::expr::Call& val, const ast::expr::Get& get);
+	Value CallValue(const ast::expr::Call& val, const Value& callee, const std::vector<Value>& arguments);
+	std::vector<Value> EvaluateArguments(const ast::expr::Call& val);
+	static void CheckArity(const ast::expr::Call& val, const LoxCallable& function,
+		const std::vector<Value>& arguments);
+	Value Visit(const ast::expr::Get& val) override;
+	Value Visit(const ast::expr::Grouping& val) override;
+	Value Visit(const ast::expr::Literal& val) override;
+	Value Visit(const ast::expr::Logical& val) override;
+	Value Visit(const ast::expr::Set& val) override;
+	Value Visit(const ast::expr::Super& val) override;
+	Value Visit(const ast::expr::This& val) override;
+	Value Visit(const ast::expr::Unary& val) override;
 
-	void Execute(const ast::stmt::Stmt& stmt);
-	void Resolve(const ast::expr::Expr& expr, int depth);
-	void ExecuteBlock(const std::vector<ast::stmt::StmtPtr>& statements,
-		std::shared_ptr<Environment> environment);
+	ast::Completion Execute(const ast::stmt::Stmt& stmt);
+	ast::Completion ExecuteBlock(std::span<const ast::stmt::StmtPtr> statements,
+		Ref<Environment> environment);
+	ast::Completion ExecuteBlock(const BlockCode& code, Ref<Environment> environment);
 
-	std::any Evaluate(const ast::expr::Expr& expr);
-	static bool IsTruthy(const std::any& val);
-	static bool IsEqual(const std::any& left, const std::any& right);
-	static void CheckNumberOperand(const Token& op, const std::any& operand);
-	static void CheckNumberOperands(const Token& op, const std::any& left, const std::any& right);
-	static std::string Stringify(const std::any& val);
+	Value Evaluate(const ast::expr::Expr& expr);
+	static void CheckNumberOperand(const Token& op, const Value& operand);
+	static void CheckNumberOperands(const Token& op, const Value& left, const Value& right);
 };
 
 //TODO: move all this to interpreter.cpp
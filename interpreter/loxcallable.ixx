@@ -1,97 +1,221 @@
 export module interpreter:loxcallable;
 
+import array;
 import ast;
+import core;
+import event_loop;
 import interpreter;
+import log;
+import value;
 import :environment;
+import :profiler;
 
-import <any>;
-import <chrono>;
-import <memory>;
+import <functional>;
+import <iterator>;
+import <string>;
+import <utility>;
 import <vector>;
 
-export struct Return
+export class LoxCallable : public Container
 {
 public:
-	std::any m_val;
-	explicit Return(std::any val)
-		: m_val(std::move(val))
+	explicit LoxCallable(ObjType type)
+		: Container(type)
 	{}
+	virtual int Arity() const = 0;
+	virtual Value Call(Interpreter& interpreter, const std::vector<Value>& arguments) = 0;
+	//Call from a call expression, paren is where errors raised after the call returned are reported.
+	virtual Value CallAt(Interpreter& interpreter, const std::vector<Value>& arguments, const Token& paren)
+	{
+		return Call(interpreter, arguments);
+	}
 };
 
-export class LoxCallable
+export class Clock : public LoxCallable
 {
 public:
-	virtual ~LoxCallable() = default;
-	virtual int Arity() const = 0;
-	virtual std::any Call(Interpreter& interpreter, const std::vector<std::any>& arguments) = 0;
-	virtual std::string ToString() const = 0;
+	Clock()
+		: LoxCallable(ObjType::NATIVE)
+	{}
+	int Arity() const override { return 0; }
+	Value Call(Interpreter& interpreter, const std::vector<Value>& arguments) override
+	{
+		return ClockSeconds();
+	}
+	std::string ToString() const override { return "<native fn>"; }
+	void Trace(Tracer& tracer) const override {}
+	void Clear() override {}
+
 };
 
-export class Clock : public LoxCallable
+//Builtin shared with the VM (see ArrayNatives).
+export class Native : public LoxCallable
 {
-	int Arity() const override { return 0; }
-	std::any Call(Interpreter& interpreter, const std::vector<std::any>& arguments) override
+	const NativeFunction& m_native;
+public:
+	explicit Native(const NativeFunction& native)
+		: LoxCallable(ObjType::NATIVE)
+		, m_native(native)
+	{}
+	int Arity() const override { return m_native.m_arity; }
+	Value Call(Interpreter& interpreter, const std::vector<Value>& arguments) override
 	{
-		return static_cast<double>(std::chrono::duration_cast<std::chrono::seconds>
-			(std::chrono::steady_clock::now().time_since_epoch()).count());
+		return m_native.m_function(static_cast<int>(arguments.size()), arguments.data());
 	}
 	std::string ToString() const override { return "<native fn>"; }
+	void Trace(Tracer& tracer) const override {}
+	void Clear() override {}
+};
 
+//Async builtin (see AsyncNatives): starts its operation on the interpreter's loop and returns nil,
+//the callback, its last argument, is called with the result on a later turn.
+export class AsyncCallable : public LoxCallable
+{
+	const AsyncNative& m_native;
+public:
+	explicit AsyncCallable(const AsyncNative& native)
+		: LoxCallable(ObjType::NATIVE)
+		, m_native(native)
+	{}
+	int Arity() const override { return m_native.m_arity + 1; }
+	//Called by the host, whose errors have no line.
+	Value Call(Interpreter& interpreter, const std::vector<Value>& arguments) override
+	{
+		return CallAt(interpreter, arguments, Token(TokenType::IDENTIFIER, m_native.m_name, {}, -1));
+	}
+	Value CallAt(Interpreter& interpreter, const std::vector<Value>& arguments, const Token& paren) override
+	{
+		const auto& callback = arguments.back();
+		const auto is_callable = callback.IsObjType(ObjType::FUNCTION) || callback.IsObjType(ObjType::NATIVE)
+			|| callback.IsObjType(ObjType::CLASS);
+		if (!is_callable || callback.As<LoxCallable>()->Arity() > 1)
+			throw NativeError("Argument " + std::to_string(arguments.size()) + " must be a function of 0 or 1 arguments.");
+		auto operation = m_native.m_function(interpreter.Loop(), { std::begin(arguments), std::prev(std::end(arguments)) });
+		operation.ThrowIfFailed();
+		interpreter.Loop().Spawn(Complete(interpreter, std::move(operation), callback, paren));
+		return {};
+	}
+	std::string ToString() const override { return "<native fn>"; }
+	void Trace(Tracer& tracer) const override {}
+	void Clear() override {}
+private:
+	//The parameters are copied into the frame, which lives until the callback returned.
+	static Task Complete(Interpreter& interpreter, Async operation, Value callback, Token paren)
+	{
+		try
+		{
+			auto result = co_await operation;
+			std::vector<Value> arguments;
+			if (callback.As<LoxCallable>()->Arity() == 1)
+				arguments.push_back(std::move(result));
+			interpreter.Call(callback, arguments);
+		}
+		catch (const NativeError& error)
+		{
+			throw RuntimeError(paren, error.what());
+		}
+	}
+};
+
+//Function registered by the host, see Interpreter::DefineHostFunction.
+export class HostCallable : public LoxCallable
+{
+	const int m_arity;
+	const HostFunction m_function;
+public:
+	HostCallable(int arity, HostFunction function)
+		: LoxCallable(ObjType::NATIVE)
+		, m_arity(arity)
+		, m_function(std::move(function))
+	{}
+	int Arity() const override { return m_arity; }
+	Value Call(Interpreter& interpreter, const std::vector<Value>& arguments) override
+	{
+		return m_function(arguments);
+	}
+	std::string ToString() const override { return "<native fn>"; }
+	void Trace(Tracer& tracer) const override {}
+	void Clear() override {}
 };
-//class LoxInstance;
 
 export class LoxFunction : public LoxCallable
 {
-	//Should be safe, because AST lifetime same as program`s
+	//Kept alive by m_unit.
 	const ast::stmt::Function& m_declaration;
-	std::shared_ptr<Environment> m_closure;
+	const Ref<CodeUnit> m_unit;
+	Ref<Environment> m_closure;
+	//Receiver of a bound method, nil for functions and methods in a class table.
+	Value m_this;
 	const bool m_is_class_initializer = false;
+	const bool m_is_method = false;
+	//Body compiled by the ClosureCompiler, null when the tree is walked.
+	const BlockCode* const m_code = nullptr;
 public:
-	explicit LoxFunction(const ast::stmt::Function& function,
-		std::shared_ptr<Environment> closure,
-		bool is_class_initializer = false)
-		: m_declaration(function)
+	LoxFunction(const ast::stmt::Function& function,
+		Ref<CodeUnit> unit,
+		Ref<Environment> closure,
+		bool is_class_initializer = false,
+		bool is_method = false,
+		Value receiver = {},
+		const BlockCode* code = nullptr)
+		: LoxCallable(ObjType::FUNCTION)
+		, m_declaration(function)
+		, m_unit(std::move(unit))
 		, m_closure(std::move(closure))
+		, m_this(std::move(receiver))
 		, m_is_class_initializer(is_class_initializer)
+		, m_is_method(is_method)
+		, m_code(code)
 	{}
-	//for some reason, when I fwd LoxInstance class, the linker can't find LoxInstance methods while resovling symbols in interpreter.obj
-	template<class T>
-	std::shared_ptr<LoxFunction> Bind(std::shared_ptr<T> instance)
+	Ref<LoxFunction> Bind(Value instance)
 	{
-		auto environment = std::make_shared<Environment>(m_closure);
-		environment->Define("this", std::move(instance));
-		return std::make_shared<LoxFunction>(m_declaration, std::move(environment));
+		return MakeRef<LoxFunction>(m_declaration, m_unit, m_closure, m_is_class_initializer, m_is_method,
+			std::move(instance), m_code);
 	}
 
 	int Arity() const override
 	{
 		return m_declaration.params.size();
 	}
-	std::any Call(Interpreter& interpreter, const std::vector<std::any>& arguments) override
+	Value Call(Interpreter& interpreter, const std::vector<Value>& arguments) override
+	{
+		return Invoke(interpreter, m_this, arguments);
+	}
+	//Calls a method with receiver as this, without creating a bound LoxFunction for it.
+	Value Invoke(Interpreter& interpreter, const Value& receiver, const std::vector<Value>& arguments)
 	{
-		auto environment = std::make_shared<Environment>(m_closure);
-		
+		const Profiler::Scope profile{ interpreter.m_profiler, &m_declaration, m_unit.get(),
+			m_declaration.name.m_lexeme, m_declaration.name.m_line };
+		const Interpreter::UnitScope unit{ interpreter, m_unit.get() };
+		auto environment = MakeRef<Environment>(m_closure);
+		//The Resolver put this in the first slot of a method's scope.
+		if (m_is_method)
+			environment->Define("this", receiver);
 		for (int i = 0; i < m_declaration.params.size(); ++i)
 		{
-			environment->Define(m_declaration.params[i].m_lexeme, arguments[i]);
-		}
-		try
-		{
-			interpreter.ExecuteBlock(m_declaration.body, std::move(environment));
-		}
-		catch (Return& return_value)
-		{
-			if (m_is_class_initializer)
-				return m_closure->GetAt(0, "this");
-			return std::move(return_value.m_val);
+			environment->Define(*m_declaration.params[i], arguments[i]);
 		}
+		const auto completion = m_code ? interpreter.ExecuteBlock(*m_code, std::move(environment))
+			: interpreter.ExecuteBlock(m_declaration.body, std::move(environment));
 		if (m_is_class_initializer)
-			return m_closure->GetAt(0, "this");
+			return receiver;
+		if (completion == ast::Completion::RETURN)
+			return std::move(interpreter.m_return_value);
 		return {};
 	}
 
+	void Trace(Tracer& tracer) const override
+	{
+		tracer.Visit(m_closure);
+		tracer.Visit(m_this);
+	}
+	void Clear() override
+	{
+		m_closure = nullptr;
+		m_this = {};
+	}
 	std::string ToString() const override
 	{
-		return "<fn " + m_declaration.name.m_lexeme + ">";
+		return "<fn " + std::string(m_declaration.name.m_lexeme) + ">";
 	}
 };
@@ -1,87 +1,163 @@
 export module interpreter:loxclass;
 
+import ast;
 import core;
+import interpreter;
+import log;
+import value;
 import :loxcallable;
+import :profiler;
+import :shape;
 
-import <any>;
 import <string>;
-import <memory>;
-import <unordered_map>;
+import <vector>;
 
-class LoxInstance;
-
-export class LoxClass : public LoxCallable, public std::enable_shared_from_this<LoxClass>
+export class LoxClass : public LoxCallable
 {
 	friend class LoxInstance;
+	//Kept alive by m_unit.
+	const ast::stmt::Class& m_declaration;
+	const Ref<CodeUnit> m_unit;
 	const std::string m_name;
-	const std::shared_ptr<LoxClass> m_superclass;
-	std::unordered_map<std::string, std::shared_ptr<LoxFunction>> m_methods;
+	Ref<LoxClass> m_superclass;
+	//Own methods and every inherited one that is not overridden,
+	//so finding a method is a single lookup whatever the depth of the hierarchy.
+	StringMap<Ref<LoxFunction>> m_methods;
+	//Found once, it is kept alive by m_methods.
+	LoxFunction* m_initializer = nullptr;
 public:
-	explicit LoxClass(std::string name,
-		std::shared_ptr<LoxClass> superclass,
-		std::unordered_map<std::string, std::shared_ptr<LoxFunction>> methods)
-		: m_name(std::move(name))
+	LoxClass(const ast::stmt::Class& declaration,
+		Ref<CodeUnit> unit,
+		Ref<LoxClass> superclass,
+		StringMap<Ref<LoxFunction>> methods)
+		: LoxCallable(ObjType::CLASS)
+		, m_declaration(declaration)
+		, m_unit(std::move(unit))
+		, m_name(declaration.name.m_lexeme)
 		, m_superclass(std::move(superclass))
 		, m_methods(std::move(methods))
-	{}
+	{
+		if (m_superclass)
+		{
+			for (const auto& [method_name, method] : m_superclass->m_methods)
+				m_methods.try_emplace(method_name, method);
+		}
+		m_initializer = FindMethod(Intern("init").get());
+	}
 	int Arity() const
 	{
-		auto initializer = FindMethod("init");
-		if (!initializer)
+		if (!m_initializer)
 			return 0;
-		return initializer->Arity();
+		return m_initializer->Arity();
 	}
 
-	std::any Call(Interpreter& interpreter, const std::vector<std::any>& arguments) override
-	{
-		const auto instance =
-			std::make_shared<LoxInstance>(shared_from_this());
-		const auto initializer = FindMethod("init");
-		if (initializer)
-			initializer->Bind(instance)->Call(interpreter, arguments);
-		return instance;
-	}
+	Value Call(Interpreter& interpreter, const std::vector<Value>& arguments) override;
 
-	std::string ToString() const
+	std::string ToString() const override
 	{
 		return m_name;
 	}
+	void Trace(Tracer& tracer) const override
+	{
+		tracer.Visit(m_superclass);
+		tracer.Visit(m_methods);
+	}
+	void Clear() override
+	{
+		m_initializer = nullptr;
+		m_methods.clear();
+		m_superclass = nullptr;
+	}
 
-	std::shared_ptr<LoxFunction> FindMethod(const std::string& name) const
+	LoxFunction* FindMethod(const ObjString* name) const
 	{
 		const auto it = m_methods.find(name);
 		if (it != std::end(m_methods))
-			return it->second;
-		if (m_superclass)
-			return m_superclass->FindMethod(name);
+			return it->second.get();
 		return nullptr;
 	}
 };
 
-export class LoxInstance : public std::enable_shared_from_this<LoxInstance>
+//Fields can reference the instance back (e.g. a bound method), so instances are garbage collected.
+//Field values are stored in the order they were added, their names are in the shared Shape.
+export class LoxInstance : public Container
 {
-	const std::shared_ptr<LoxClass> m_class;
-	std::unordered_map<std::string, std::any> m_fields;
+	Ref<LoxClass> m_class;
+	//Points into the tree of the Interpreter that created the instance.
+	const Shape* m_shape;
+	std::vector<Value> m_fields;
 public:
-	explicit LoxInstance(std::shared_ptr<LoxClass> klass)
-		: m_class(std::move(klass))
+	LoxInstance(Ref<LoxClass> klass, const Shape* root)
+		: Container(ObjType::INSTANCE)
+		, m_class(std::move(klass))
+		, m_shape(root)
 	{}
-	std::string ToString() const
+	std::string ToString() const override
 	{
 		return m_class->m_name + " instance";
 	}
-	std::any Get(const Token& name)
+	void Trace(Tracer& tracer) const override
+	{
+		tracer.Visit(m_class);
+		tracer.Visit(m_fields);
+	}
+	void Clear() override
+	{
+		m_fields.clear();
+		m_class = nullptr;
+	}
+	//cache belongs to the Get expression, a hit skips the shape lookup.
+	const Value* FindField(const Token& name, ast::PropertyCache& cache) const
 	{
-		const auto it = m_fields.find(name.m_lexeme);
-		if (it != std::end(m_fields))
-			return it->second;
-		auto method = m_class->FindMethod(name.m_lexeme);
+		const auto* entry = cache.Find(m_shape);
+		if (!entry)
+			entry = &cache.Add({ m_shape, nullptr, m_shape->Find(name.Name()) });
+		if (entry->m_slot >= 0)
+			return &m_fields[entry->m_slot];
+		return nullptr;
+	}
+	LoxFunction* FindMethod(const Token& name) const
+	{
+		return m_class->FindMethod(name.Name());
+	}
+	Value Get(const Token& name, ast::PropertyCache& cache)
+	{
+		if (const auto* field = FindField(name, cache))
+			return *field;
+		auto method = FindMethod(name);
 		if (method)
-			return std::static_pointer_cast<LoxCallable>(method->Bind(shared_from_this()));
-		throw RuntimeError(name, "Undefined property'" + name.m_lexeme + "'.");
+			return method->Bind(this);
+		throw UndefinedProperty(name);
+	}
+	static RuntimeError UndefinedProperty(const Token& name)
+	{
+		return RuntimeError(name, "Undefined property'" + std::string(name.m_lexeme) + "'.");
 	}
-	void Set(const Token& name, std::any value)
+	//cache belongs to the Set expression, it also remembers the transition when a field is added.
+	void Set(const Token& name, Value value, ast::PropertyCache& cache)
 	{
-		m_fields[name.m_lexeme] = std::move(value);
+		const auto* entry = cache.Find(m_shape);
+		if (!entry)
+		{
+			const auto slot = m_shape->Find(name.Name());
+			entry = &cache.Add({ m_shape, slot < 0 ? m_shape->Transition(name.Name()) : nullptr, slot });
+		}
+		if (entry->m_slot >= 0)
+		{
+			m_fields[entry->m_slot] = std::move(value);
+			return;
+		}
+		m_shape = static_cast<const Shape*>(entry->m_next_shape);
+		m_fields.push_back(std::move(value));
 	}
-};
\ No newline at end of file
+};
+
+Value LoxClass::Call(Interpreter& interpreter, const std::vector<Value>& arguments)
+{
+	const Profiler::Scope profile{ interpreter.GetProfiler(), &m_declaration, m_unit.get(),
+		m_name, m_declaration.name.m_line, "()" };
+	const auto instance = MakeRef<LoxInstance>(Ref<LoxClass>(this), interpreter.RootShape());
+	if (m_initializer)
+		m_initializer->Invoke(interpreter, instance, arguments);
+	return instance;
+}
@@ -0,0 +1,191 @@
+export module interpreter:profiler;
+
+import value;
+
+import <algorithm>;
+import <chrono>;
+import <cstdint>;
+import <iomanip>;
+import <memory>;
+import <ostream>;
+import <string>;
+import <string_view>;
+import <unordered_map>;
+import <vector>;
+
+//Collects what --profile reports for the tree-walker: calls, inclusive and exclusive time of every
+//Lox function (and class construction), the call tree for a collapsed-stack file and how many times
+//each source line was executed. The Interpreter only holds a pointer, null when profiling is off.
+//Functions are keyed by their declaration, so the code unit (REPL line, --stream declaration) it lives in
+//is kept alive while profiling: its memory could otherwise be reused by the declaration of another function.
+export class Profiler
+{
+	using Clock = std::chrono::steady_clock;
+	struct Function
+	{
+		std::string m_name;
+		std::string_view m_suffix;
+		int m_line = 0;
+		Ref<Object> m_unit;
+		std::uint64_t m_calls = 0;
+		//Inclusive time is only added when the outermost of the recursive calls returns.
+		Clock::duration m_total{};
+		Clock::duration m_self{};
+		int m_active = 0;
+	};
+	//Call tree node, one per distinct stack.
+	struct Node
+	{
+		const Function* m_function = nullptr;
+		Clock::duration m_self{};
+		std::unordered_map<const void*, std::unique_ptr<Node>> m_children;
+	};
+	struct Frame
+	{
+		Function* m_function;
+		Node* m_node;
+		Clock::time_point m_start;
+		Clock::duration m_children{};
+	};
+	std::unordered_map<const void*, Function> m_functions;
+	Node m_root;
+	std::vector<Frame> m_frames;
+	std::vector<std::uint64_t> m_lines;
+	const Clock::time_point m_start = Clock::now();
+	Clock::duration m_top_level{};
+public:
+	//Calls Enter and Exit around a call, does nothing without a profiler.
+	class Scope
+	{
+		Profiler* const m_profiler;
+	public:
+		Scope(Profiler* profiler, const void* key, Object* unit, std::string_view name, int line, std::string_view suffix = {})
+			: m_profiler(profiler)
+		{
+			if (m_profiler)
+				m_profiler->Enter(key, unit, name, line, suffix);
+		}
+		~Scope()
+		{
+			if (m_profiler)
+				m_profiler->Exit();
+		}
+		Scope(const Scope&) = delete;
+		Scope& operator=(const Scope&) = delete;
+	};
+
+	//key identifies the function (its declaration), owned by unit. Name, line and suffix
+	//(e.g. "()" for a class) are only used for the report.
+	void Enter(const void* key, Object* unit, std::string_view name, int line, std::string_view suffix)
+	{
+		auto [it, inserted] = m_functions.try_emplace(key);
+		auto& function = it->second;
+		if (inserted)
+		{
+			function.m_name = name;
+			function.m_suffix = suffix;
+			function.m_line = line;
+			function.m_unit = Ref<Object>(unit);
+		}
+		++function.m_calls;
+		++function.m_active;
+		auto& parent = m_frames.empty() ? m_root : *m_frames.back().m_node;
+		auto& node = parent.m_children[key];
+		if (!node)
+		{
+			node = std::make_unique<Node>();
+			node->m_function = &function;
+		}
+		m_frames.push_back({ &function, node.get(), Clock::now() });
+	}
+	void Exit()
+	{
+		const auto frame = m_frames.back();
+		m_frames.pop_back();
+		const auto elapsed = Clock::now() - frame.m_start;
+		const auto self = elapsed - frame.m_children;
+		frame.m_function->m_self += self;
+		frame.m_node->m_self += self;
+		if (--frame.m_function->m_active == 0)
+			frame.m_function->m_total += elapsed;
+		if (m_frames.empty())
+			m_top_level += elapsed;
+		else
+			m_frames.back().m_children += elapsed;
+	}
+	void CountLine(int line)
+	{
+		if (line >= static_cast<int>(m_lines.size()))
+			m_lines.resize(line + 1);
+		++m_lines[line];
+	}
+
+	//Writes the functions sorted by exclusive time and the hottest lines to report,
+	//and every stack with its exclusive time in microseconds to folded (flamegraph.pl's input).
+	void Report(std::ostream& report, std::ostream& folded)
+	{
+		const auto total = Clock::now() - m_start;
+		m_root.m_self = total - m_top_level;
+		const auto ms = [](Clock::duration time)
+		{
+			return std::chrono::duration<double, std::milli>(time).count();
+		};
+
+		std::vector<const Function*> functions;
+		for (const auto& [key, function] : m_functions)
+			functions.push_back(&function);
+		std::sort(std::begin(functions), std::end(functions), [](const Function* lhs, const Function* rhs)
+		{
+			return lhs->m_self > rhs->m_self;
+		});
+		report << std::fixed << std::setprecision(3);
+		report << "profile: " << ms(total) << " ms total, " << ms(m_root.m_self) << " ms at top level\n";
+		report << std::setw(12) << "calls" << std::setw(14) << "total ms" << std::setw(14) << "self ms"
+			<< std::setw(8) << "self%" << "  function\n";
+		for (const auto* function : functions)
+		{
+			report << std::setw(12) << function->m_calls
+				<< std::setw(14) << ms(function->m_total)
+				<< std::setw(14) << ms(function->m_self)
+				<< std::setw(8) << std::setprecision(1) << 100 * ms(function->m_self) / std::max(ms(total), 1e-9)
+				<< std::setprecision(3) << "  " << Label(*function) << '\n';
+		}
+
+		std::vector<int> lines;
+		for (int line = 0; line < static_cast<int>(m_lines.size()); ++line)
+		{
+			if (m_lines[line])
+				lines.push_back(line);
+		}
+		std::sort(std::begin(lines), std::end(lines), [this](int lhs, int rhs)
+		{
+			return m_lines[lhs] > m_lines[rhs];
+		});
+		constexpr std::size_t hot_lines = 20;
+		lines.resize(std::min(lines.size(), hot_lines));
+		report << std::setw(12) << "executions" << "  line\n";
+		for (const auto line : lines)
+			report << std::setw(12) << m_lines[line] << "  " << line << '\n';
+
+		std::string stack = "<script>";
+		Fold(m_root, stack, folded);
+	}
+private:
+	static std::string Label(const Function& function)
+	{
+		return function.m_name + std::string(function.m_suffix) + ':' + std::to_string(function.m_line);
+	}
+	static void Fold(const Node& node, std::string& stack, std::ostream& folded)
+	{
+		const auto us = std::chrono::duration_cast<std::chrono::microseconds>(node.m_self).count();
+		if (us > 0)
+			folded << stack << ' ' << us << '\n';
+		for (const auto& [key, child] : node.m_children)
+		{
+			const auto size = stack.size();
+			stack += ';' + Label(*child->m_function);
+			Fold(*child, stack, folded);
+			stack.resize(size);
+		}
+	}
+};
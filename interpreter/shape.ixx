@@ -0,0 +1,47 @@
+export module interpreter:shape;
+
+import value;
+
+import <memory>;
+
+//Hidden class: the field layout shared by every instance that got the same fields in the same order.
+//Instances only store the values in a dense array, the Shape maps names to their indices.
+//Adding a field moves the instance along a transition to a child shape, created the first time.
+//Every Interpreter owns a tree of them, which holds its isolate's strings. Shapes are only freed with it,
+//there are only as many as distinct layouts its scripts build.
+export class Shape
+{
+	StringMap<int> m_slots;
+	mutable StringMap<std::unique_ptr<Shape>> m_transitions;
+	Shape() = default;
+public:
+	//Shape of an instance without fields, the root of a new tree.
+	static std::unique_ptr<const Shape> NewRoot()
+	{
+		return std::unique_ptr<const Shape>(new Shape());
+	}
+	//Index of the field or -1.
+	int Find(const ObjString* name) const
+	{
+		const auto it = m_slots.find(name);
+		if (it != std::end(m_slots))
+			return it->second;
+		return -1;
+	}
+	int FieldCount() const
+	{
+		return static_cast<int>(m_slots.size());
+	}
+	//Shape with name added as the last field.
+	const Shape* Transition(ObjString* name) const
+	{
+		auto it = m_transitions.find(name);
+		if (it != std::end(m_transitions))
+			return it->second.get();
+		auto next = std::unique_ptr<Shape>(new Shape());
+		next->m_slots = m_slots;
+		next->m_slots.emplace(Ref<ObjString>(name), FieldCount());
+		return m_transitions.emplace(Ref<ObjString>(name), std::move(next))
+			.first->second.get();
+	}
+};
@@ -1,24 +1,47 @@
+module;
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define LEXER_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define LEXER_SSE2
+#endif
+
 export module lexer;
 
 import core;
 import log;
+import value;
 
+import <algorithm>;
+import <array>;
+import <bit>;
+import <charconv>;
+import <cstddef>;
+import <cstdint>;
+import <istream>;
 import <vector>;
 import <string>;
-import <unordered_map>;
+import <string_view>;
 
 export class Lexer
 {
-	std::string m_text;
+	//Not owned, see Token::m_lexeme.
+	std::string_view m_text;
 	int m_curr_pos = 0;
 	int m_start_pos = 0;
 	int m_line = 1;
 	std::vector<Token> m_tokens;
 public:
-	explicit Lexer(std::string text);
+	//line is the line text starts on, for a part of a script.
+	explicit Lexer(std::string_view text, int line = 1);
 	std::vector<Token> GetTokens();
 private:
 	void AddNextToken();
+	//Moves m_curr_pos past the bytes of the class, see Skip.
+	template<class Class>
+	void SkipAll();
 	bool IsAtEnd() const;
 	char Advance();
 	bool CheckMatchNext(char expected);
@@ -29,12 +52,52 @@ private:
 	void ConsumeNumericLiteral();
 	void ConsumeIdentifier();
 	void AddToken(TokenType type);
-	void AddToken(TokenType type, LiteralT literal);
+	void AddToken(TokenType type, Value literal);
+};
+
+//Splits a script read from a stream into its top-level declarations for the streaming pipeline (lox --stream),
+//so only the declaration being read is kept in memory and each one can run as soon as it is complete.
+//It knows just enough of the syntax to find where a declaration ends: at a ';' or '}' outside of parentheses
+//and braces that is not followed by an else, and not in a string or a comment.
+//The text of a declaration includes the whitespace and comments before it, and is lexed on its own.
+export class DeclarationReader
+{
+	std::istream& m_input;
+	//Text read and not returned yet, always whole lines.
+	std::string m_buffer;
+	//Line of the first character of m_buffer.
+	int m_line = 1;
+	//Scan state, kept when more lines have to be read to find the end.
+	std::size_t m_pos = 0;
+	int m_depth = 0;
+	bool m_in_string = false;
+	bool m_in_comment = false;
+	//Position after a ';' or '}' that ends the declaration unless an else follows, npos if there is none.
+	std::size_t m_end = std::string::npos;
+public:
+	explicit DeclarationReader(std::istream& input)
+		: m_input(input)
+	{}
+	//Moves the next declaration to text and the line it starts on to line, false at the end of the input.
+	bool Next(std::string& text, int& line);
+private:
+	bool ReadLine();
+	//Position where the declaration at the start of m_buffer ends, npos if more lines are needed.
+	std::size_t FindEnd(bool at_end);
 };
 
 module :private;
 
-static std::unordered_map<std::string_view, TokenType> keywords
+//Keywords are found with a perfect hash computed at compile time: a seed is searched for so that
+//(first char * seed + second char * 3 + length) puts each keyword in a slot of its own,
+//so a lookup is one hash and one comparison.
+struct Keyword
+{
+	std::string_view m_text;
+	TokenType m_type = TokenType::IDENTIFIER;
+};
+
+constexpr Keyword keywords[] =
 {
 	{"and", TokenType::AND},
 	{"class", TokenType::CLASS},
@@ -54,18 +117,232 @@ static std::unordered_map<std::string_view, TokenType> keywords
 	{"while", TokenType::WHILE},
 };
 
-static bool IsAlphanumeric(char ch)
+constexpr std::size_t KEYWORD_SLOTS = 32;
+constexpr std::size_t MIN_KEYWORD = 2;
+constexpr std::size_t MAX_KEYWORD = 6;
+
+//Only called with MIN_KEYWORD <= text.size() <= MAX_KEYWORD.
+constexpr std::size_t KeywordHash(std::string_view text, std::size_t seed)
+{
+	const auto first = static_cast<unsigned char>(text[0]);
+	const auto second = static_cast<unsigned char>(text[1]);
+	return (first * seed + second * 3 + text.size()) % KEYWORD_SLOTS;
+}
+
+consteval std::size_t FindKeywordSeed()
+{
+	for (std::size_t seed = 1; seed < 1000; ++seed)
+	{
+		bool used[KEYWORD_SLOTS]{};
+		bool perfect = true;
+		for (const auto& keyword : keywords)
+		{
+			auto& slot = used[KeywordHash(keyword.m_text, seed)];
+			perfect = perfect && !slot;
+			slot = true;
+		}
+		if (perfect)
+			return seed;
+	}
+	return 0;
+}
+
+constexpr std::size_t keyword_seed = FindKeywordSeed();
+static_assert(keyword_seed != 0, "no perfect hash for the keywords, grow KEYWORD_SLOTS");
+
+constexpr std::array<Keyword, KEYWORD_SLOTS> keyword_table = []
+{
+	std::array<Keyword, KEYWORD_SLOTS> res{};
+	for (const auto& keyword : keywords)
+		res[KeywordHash(keyword.m_text, keyword_seed)] = keyword;
+	return res;
+}();
+
+constexpr TokenType IdentifierType(std::string_view text)
+{
+	if (text.size() < MIN_KEYWORD || text.size() > MAX_KEYWORD)
+		return TokenType::IDENTIFIER;
+	const auto& keyword = keyword_table[KeywordHash(text, keyword_seed)];
+	return keyword.m_text == text ? keyword.m_type : TokenType::IDENTIFIER;
+}
+
+static_assert(IdentifierType("while") == TokenType::WHILE);
+static_assert(IdentifierType("whilst") == TokenType::IDENTIFIER);
+
+//Character classes of the ASCII Lox source, independent of the locale (unlike std::isalnum),
+//and bytes outside ASCII are in none of them.
+enum CharClass : std::uint8_t
+{
+	DIGIT = 1,
+	ALPHA = 2, //Letters and '_'
+	SPACE = 4, //' ', '\t', '\r' and '\n'
+};
+
+constexpr std::array<std::uint8_t, 256> char_classes = []
+{
+	std::array<std::uint8_t, 256> res{};
+	for (int c = '0'; c <= '9'; ++c)
+		res[c] = DIGIT;
+	for (int c = 'a'; c <= 'z'; ++c)
+		res[c] = res[c - 'a' + 'A'] = ALPHA;
+	res['_'] = ALPHA;
+	for (const unsigned char c : { ' ', '\t', '\r', '\n' })
+		res[c] = SPACE;
+	return res;
+}();
+
+static bool Is(char c, std::uint8_t classes)
+{
+	return char_classes[static_cast<unsigned char>(c)] & classes;
+}
+
+//Runs of whitespace, comments, string bodies, identifiers and digits are skipped a block of bytes
+//at a time: each byte of the block is compared with the class at once (AVX2 when the compiler targets it,
+//otherwise SSE2, which every x86-64 has), the mask of the bytes that are not in the class gives
+//the end of the run, and the newlines in the block are counted with a popcount.
+//The bytes after the last full block, and every byte on other targets, are checked one at a time.
+#if defined(LEXER_AVX2)
+using Bytes = __m256i;
+using Mask = std::uint32_t;
+constexpr std::size_t BLOCK_SIZE = 32;
+static Bytes Load(const char* data) { return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data)); }
+static Bytes Splat(char c) { return _mm256_set1_epi8(c); }
+static Bytes Equal(Bytes lhs, Bytes rhs) { return _mm256_cmpeq_epi8(lhs, rhs); }
+static Bytes Either(Bytes lhs, Bytes rhs) { return _mm256_or_si256(lhs, rhs); }
+static Bytes Minus(Bytes lhs, Bytes rhs) { return _mm256_sub_epi8(lhs, rhs); }
+static Bytes Min(Bytes lhs, Bytes rhs) { return _mm256_min_epu8(lhs, rhs); }
+static Mask Bits(Bytes block) { return static_cast<Mask>(_mm256_movemask_epi8(block)); }
+#elif defined(LEXER_SSE2)
+using Bytes = __m128i;
+using Mask = std::uint32_t;
+constexpr std::size_t BLOCK_SIZE = 16;
+static Bytes Load(const char* data) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(data)); }
+static Bytes Splat(char c) { return _mm_set1_epi8(c); }
+static Bytes Equal(Bytes lhs, Bytes rhs) { return _mm_cmpeq_epi8(lhs, rhs); }
+static Bytes Either(Bytes lhs, Bytes rhs) { return _mm_or_si128(lhs, rhs); }
+static Bytes Minus(Bytes lhs, Bytes rhs) { return _mm_sub_epi8(lhs, rhs); }
+static Bytes Min(Bytes lhs, Bytes rhs) { return _mm_min_epu8(lhs, rhs); }
+static Mask Bits(Bytes block) { return static_cast<Mask>(_mm_movemask_epi8(block)); }
+#endif
+
+#if defined(LEXER_AVX2) || defined(LEXER_SSE2)
+constexpr Mask ALL = BLOCK_SIZE == 32 ? ~Mask{} : (Mask{ 1 } << BLOCK_SIZE) - 1;
+
+//Bytes from first to last, compared as unsigned: (byte - first) <= (last - first).
+static Bytes InRange(Bytes bytes, char first, char last)
 {
-	return std::isalnum(ch) || ch == '_';
+	const auto offset = Minus(bytes, Splat(first));
+	return Equal(Min(offset, Splat(static_cast<char>(last - first))), offset);
 }
+#endif
 
+//A class has Contains for a single byte and, with SIMD, Match for a block.
+//LINES is set when a run can contain newlines, which are then counted.
+struct Whitespace
+{
+	static constexpr bool LINES = true;
+	static bool Contains(char c) { return Is(c, SPACE); }
+#if defined(LEXER_AVX2) || defined(LEXER_SSE2)
+	static Bytes Match(Bytes bytes)
+	{
+		return Either(Either(Equal(bytes, Splat(' ')), Equal(bytes, Splat('\n'))),
+			Either(Equal(bytes, Splat('\t')), Equal(bytes, Splat('\r'))));
+	}
+#endif
+};
 
-Lexer::Lexer(std::string text)
-	: m_text(std::move(text))
+//Rest of a // comment.
+struct CommentBody
+{
+	static constexpr bool LINES = false;
+	static bool Contains(char c) { return c != '\n'; }
+#if defined(LEXER_AVX2) || defined(LEXER_SSE2)
+	static Bytes Match(Bytes bytes)
+	{
+		return Equal(Equal(bytes, Splat('\n')), Splat(0));
+	}
+#endif
+};
+
+//Strings have no escapes, they end at the next quote and may span lines.
+struct StringBody
+{
+	static constexpr bool LINES = true;
+	static bool Contains(char c) { return c != '"'; }
+#if defined(LEXER_AVX2) || defined(LEXER_SSE2)
+	static Bytes Match(Bytes bytes)
+	{
+		return Equal(Equal(bytes, Splat('"')), Splat(0));
+	}
+#endif
+};
+
+struct IdentifierChar
+{
+	static constexpr bool LINES = false;
+	static bool Contains(char c) { return Is(c, ALPHA | DIGIT); }
+#if defined(LEXER_AVX2) || defined(LEXER_SSE2)
+	static Bytes Match(Bytes bytes)
+	{
+		//Setting bit 5 turns upper case letters into lower case ones and no other byte into a letter.
+		const auto lower = Either(bytes, Splat(0x20));
+		return Either(Either(InRange(lower, 'a', 'z'), InRange(bytes, '0', '9')), Equal(bytes, Splat('_')));
+	}
+#endif
+};
+
+struct Digit
+{
+	static constexpr bool LINES = false;
+	static bool Contains(char c) { return Is(c, DIGIT); }
+#if defined(LEXER_AVX2) || defined(LEXER_SSE2)
+	static Bytes Match(Bytes bytes)
+	{
+		return InRange(bytes, '0', '9');
+	}
+#endif
+};
+
+//Index of the first byte at or after pos that is not in the class (text.size() if there is none).
+//Newlines before it are added to lines.
+template<class Class>
+static std::size_t Skip(std::string_view text, std::size_t pos, int& lines)
+{
+	const auto* data = text.data();
+#if defined(LEXER_AVX2) || defined(LEXER_SSE2)
+	for (; pos + BLOCK_SIZE <= text.size(); pos += BLOCK_SIZE)
+	{
+		const auto bytes = Load(data + pos);
+		const auto outside = ~Bits(Class::Match(bytes)) & ALL;
+		//Bytes of the run in this block.
+		const auto run = outside ? (Mask{ 1 } << std::countr_zero(outside)) - 1 : ALL;
+		if constexpr (Class::LINES)
+			lines += std::popcount(Bits(Equal(bytes, Splat('\n'))) & run);
+		if (outside)
+			return pos + std::countr_zero(outside);
+	}
+#endif
+	for (; pos < text.size() && Class::Contains(data[pos]); ++pos)
+	{
+		if constexpr (Class::LINES)
+			lines += data[pos] == '\n';
+	}
+	return pos;
+}
+
+Lexer::Lexer(std::string_view text, int line)
+	: m_text(text)
+	, m_line(line)
 {
 	//m_text.erase(std::remove_if(m_text.begin(), m_text.end(), isspace), m_text.end());
 }
 
+template<class Class>
+void Lexer::SkipAll()
+{
+	m_curr_pos = static_cast<int>(Skip<Class>(m_text, m_curr_pos, m_line));
+}
+
 void Lexer::AddNextToken()
 {
 	const char c = Advance();
@@ -96,28 +373,25 @@ void Lexer::AddNextToken()
 	case '/':
 		// Only one-lined comments
 		if (CheckMatchNext('/'))
-		{
-			while (Peek() != '\n' && !IsAtEnd())
-				Advance();
-		}
+			SkipAll<CommentBody>();
 		else
 			AddToken(TokenType::SLASH);
 		break;
 	case ' ':
 	case '\r':
 	case '\t':
-		// Ignore whitespace.
-		break;
 	case '\n':
-		++m_line;
+		// Ignore whitespace, the whole run at once.
+		--m_curr_pos;
+		SkipAll<Whitespace>();
 		break;
 	case '"':
 		ConsumeStringLiteral();
 		break;
 	default:
-		if (std::isdigit(c))
+		if (Is(c, DIGIT))
 			ConsumeNumericLiteral();
-		else if (IsAlphanumeric(c))
+		else if (Is(c, ALPHA))
 			ConsumeIdentifier();
 		else
 			Error(m_line, "Unexpected character.");  break;
@@ -126,12 +400,15 @@ void Lexer::AddNextToken()
 
 std::vector<Token> Lexer::GetTokens()
 {
+	//Sources have about one token per 5 to 8 bytes, this saves most of the reallocations
+	//(every one moves all the tokens so far) without reserving much more than needed.
+	m_tokens.reserve(m_text.size() / 8);
 	while (!IsAtEnd())
 	{
 		m_start_pos = m_curr_pos;
 		AddNextToken();
 	}
-	m_tokens.emplace_back(TokenType::END_OF_FILE, "", LiteralT{}, m_line);
+	m_tokens.emplace_back(TokenType::END_OF_FILE, "", Value{}, m_line);
 	return std::move(m_tokens);
 }
 
@@ -176,12 +453,7 @@ int Lexer::GetLexemeSize() const
 
 void Lexer::ConsumeStringLiteral()
 {
-	while (Peek() != '"' && !IsAtEnd())
-	{
-		if (Peek() == '\n')
-			++m_line;
-		Advance();
-	}
+	SkipAll<StringBody>();
 	if (IsAtEnd())
 	{
 		Error(m_line, "Unterminated string.");
@@ -189,38 +461,32 @@ void Lexer::ConsumeStringLiteral()
 	}
 	// Closing "
 	Advance();
-	auto val =
-		m_text.substr(m_start_pos + 1, GetLexemeSize() - 2);
-	AddToken(TokenType::STRING, std::move(val));
+	const auto val = m_text.substr(m_start_pos + 1, GetLexemeSize() - 2);
+	AddToken(TokenType::STRING, Intern(val));
 
 }
 
 void Lexer::ConsumeNumericLiteral()
 {
-	while (std::isdigit(Peek()))
-		Advance();
-	if (Peek() == '.' && std::isdigit(PeekNext()))
+	SkipAll<Digit>();
+	if (Peek() == '.' && Is(PeekNext(), DIGIT))
 	{
 		//Skip the "."
 		Advance();
-		while (std::isdigit(Peek()))
-			Advance();
+		SkipAll<Digit>();
 	}
-	AddToken(TokenType::NUMBER,
-		strtod(m_text.substr(m_start_pos, GetLexemeSize()).c_str(), nullptr));
+	//The text is not null terminated, from_chars parses the exact range without a copy.
+	double number = 0;
+	const auto* begin = m_text.data() + m_start_pos;
+	std::from_chars(begin, begin + GetLexemeSize(), number);
+	AddToken(TokenType::NUMBER, number);
 }
 
 void Lexer::ConsumeIdentifier()
 {
-	while (IsAlphanumeric(Peek()))
-		Advance();
-
-	auto lexeme = m_text.substr(m_start_pos, GetLexemeSize());
-	const auto it = keywords.find(lexeme);
-	if (it != std::end(keywords))
-		AddToken(it->second, std::move(lexeme));
-	else
-		AddToken(TokenType::IDENTIFIER, std::move(lexeme));
+	SkipAll<IdentifierChar>();
+	const auto lexeme = m_text.substr(m_start_pos, GetLexemeSize());
+	AddToken(IdentifierType(lexeme), Intern(lexeme));
 }
 
 void Lexer::AddToken(TokenType type)
@@ -228,9 +494,85 @@ void Lexer::AddToken(TokenType type)
 	AddToken(type, {});
 }
 
-void Lexer::AddToken(TokenType type, LiteralT literal)
+void Lexer::AddToken(TokenType type, Value literal)
 {
-	auto lexeme = m_text.substr(m_start_pos, GetLexemeSize());
-	m_tokens.emplace_back(type, std::move(lexeme), std::move(literal), m_line);
+	m_tokens.emplace_back(type, m_text.substr(m_start_pos, GetLexemeSize()), std::move(literal), m_line);
+
+}
+
+bool DeclarationReader::Next(std::string& text, int& line)
+{
+	auto end = FindEnd(false);
+	while (end == std::string::npos)
+	{
+		const auto at_end = !ReadLine();
+		end = FindEnd(at_end);
+	}
+	if (end == 0)
+		return false;
+	text.assign(m_buffer, 0, end);
+	line = m_line;
+	m_line += static_cast<int>(std::count(std::begin(text), std::end(text), '\n'));
+	m_buffer.erase(0, end);
+	m_pos = 0;
+	m_depth = 0;
+	m_in_string = m_in_comment = false;
+	m_end = std::string::npos;
+	return true;
+}
 
+bool DeclarationReader::ReadLine()
+{
+	std::string line;
+	if (!std::getline(m_input, line))
+		return false;
+	m_buffer += line;
+	m_buffer += '\n';
+	return true;
+}
+
+std::size_t DeclarationReader::FindEnd(bool at_end)
+{
+	int lines = 0;
+	const std::string_view text = m_buffer;
+	while (m_pos < text.size())
+	{
+		if (m_in_string || m_in_comment)
+		{
+			m_pos = m_in_string ? Skip<StringBody>(text, m_pos, lines) : Skip<CommentBody>(text, m_pos, lines);
+			if (m_pos == text.size())
+				break;
+			//Past the closing quote, the newline after a comment is whitespace.
+			m_pos += m_in_string;
+			m_in_string = m_in_comment = false;
+			continue;
+		}
+		const auto c = text[m_pos];
+		//Lines are read whole, so the character after a '/' is in the buffer unless the input ended.
+		const auto comment = c == '/' && m_pos + 1 < text.size() && text[m_pos + 1] == '/';
+		if (m_end != std::string::npos && !Is(c, SPACE) && !comment)
+		{
+			const auto word = Skip<IdentifierChar>(text, m_pos, lines);
+			if (text.substr(m_pos, word - m_pos) != "else")
+				return m_end;
+			m_end = std::string::npos;
+			m_pos = word;
+			continue;
+		}
+		++m_pos;
+		if (comment)
+			m_in_comment = true;
+		else if (c == '"')
+			m_in_string = true;
+		else if (c == '(' || c == '{')
+			++m_depth;
+		else if (c == ')' || c == '}')
+			m_depth = std::max(m_depth - 1, 0);
+		if ((c == ';' || c == '}') && m_depth == 0)
+			m_end = m_pos;
+	}
+	if (!at_end)
+		return std::string::npos;
+	//What is left is the last declaration, or only whitespace and comments.
+	return m_end != std::string::npos ? m_end : m_buffer.size();
 }
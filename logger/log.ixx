@@ -1,13 +1,18 @@
 export module log;
 
 import core;
+import value;
 
 import <iostream>;
 import <string_view>;
 import <string>;
 
-export bool has_error = false;
-export bool has_runtime_error = false;
+//Whether a compile (lexing, parsing, resolving, compiling) or a runtime error
+//was reported in the current isolate.
+export bool HasError();
+export bool HasRuntimeError();
+//Forgets the errors of the current isolate, e.g. after a line of the REPL.
+export void ClearErrors();
 
 export void Report(int line, std::string_view where, std::string_view message);
 
@@ -24,15 +29,41 @@ export struct RuntimeError : public std::runtime_error
 	{}
 };
 
+//Thrown by natives, which do not know where they were called from.
+//The backend that called the native reports it as a RuntimeError at the call.
+export struct NativeError : public std::runtime_error
+{
+	using std::runtime_error::runtime_error;
+};
+
 export void HandleRuntimeError(const RuntimeError& error);
 
 module :private;
 
+bool HasError()
+{
+	return Isolate::Current().m_has_error;
+}
+
+bool HasRuntimeError()
+{
+	return Isolate::Current().m_has_runtime_error;
+}
+
+void ClearErrors()
+{
+	auto& isolate = Isolate::Current();
+	isolate.m_has_error = false;
+	isolate.m_has_runtime_error = false;
+}
+
 void Report(int line, std::string_view where, std::string_view message)
 {
-	std::cerr << "[line " << std::to_string(line) <<
+	auto& isolate = Isolate::Current();
+	isolate.Out().Flush();
+	isolate.Errors() << "[line " << std::to_string(line) <<
 		" ] Error" << where << ": " << message << '\n';
-	has_error = true;
+	isolate.m_has_error = true;
 }
 
 void Error(int line, std::string_view message)
@@ -45,12 +76,14 @@ void Error(const Token& token, std::string_view message)
 	if (token.m_type == TokenType::END_OF_FILE)
 		Report(token.m_line, " at end", message);
 	else
-		Report(token.m_line, " at '" + token.m_lexeme + "'", message);
+		Report(token.m_line, " at '" + std::string(token.m_lexeme) + "'", message);
 }
 
 void HandleRuntimeError(const RuntimeError& error)
 {
-	std::cerr << std::string(error.what()) + "\n[line " +
+	auto& isolate = Isolate::Current();
+	isolate.Out().Flush();
+	isolate.Errors() << std::string(error.what()) + "\n[line " +
 		std::to_string(error.m_token.m_line) + " ]\n";
-	has_runtime_error = true;
+	isolate.m_has_runtime_error = true;
 }
\ No newline at end of file
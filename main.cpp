@@ -1,76 +1,481 @@
+#include <algorithm>
+#include <atomic>
 #include <filesystem>
-#include <iostream>
 #include <fstream>
+#include <future>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
 
+import ast;
 import lexer;
-import parser;
 import resolver;
+import optimizer;
+import program_cache;
 import interpreter;
+import compiler;
+import vm;
 import log;
 import ast_printer;
+import value;
+import source;
+
+//Selected with --vm, the tree-walking Interpreter stays the reference implementation.
+static bool use_vm = false;
+//Selected with --closures, the tree is compiled to closures once and run without the visitor.
+static bool use_closures = false;
+//--stats prints runtime statistics to stderr when the program ends.
+static bool print_stats = false;
+//--no-optimize runs the AST exactly as parsed, to check the Optimizer does not change results.
+static bool optimize = true;
+//--profile[=file] reports where the tree-walker spent its time and writes the collapsed stacks to file.
+static std::unique_ptr<Profiler> profiler;
+static std::string profile_path = "lox.folded";
+//--no-cache always compiles scripts and does not write script.loxc.
+static bool use_cache = true;
+//--stream runs a script (or stdin) one top-level declaration at a time, as it is read.
+static bool use_stream = false;
+//--gc-growth=factor, applied to every isolate a script runs in.
+static std::optional<double> gc_growth;
+//--flush=line|full|none, when print output is written (see FlushPolicy), for every isolate a script runs in.
+static FlushPolicy flush_policy = FlushPolicy::NONE;
 
-void Run(std::string source) noexcept(false)
+//Interpreter or VM, whichever the options select, created when the first script runs in it.
+//The REPL runs all its lines in the same one, every --jobs job gets its own.
+struct Backend
 {
-	Lexer l{ std::move(source) };
-	auto tokens = l.GetTokens();
-	Parser p{ std::move(tokens) };
-	auto stmts = p.Parse();
-	if (has_error)
-		return;
-	static Interpreter i;
-	Resolver r(i);
-	r.Resolve(stmts);
-	//Stop if there was a resolution error.
-	if (has_error)
+	std::unique_ptr<Interpreter> m_interpreter;
+	std::unique_ptr<VM> m_vm;
+};
+
+//Functions and classes defined by the tree-walker keep pointing into the Program after the run.
+//Without a unit the Backend must not outlive it, with one they keep the unit and the Program it owns alive.
+void Execute(ast::Program& program, Backend& backend, Ref<CodeUnit> unit = nullptr) noexcept(false)
+{
+	if (optimize)
+		Optimizer{ program }.Optimize();
+	if (use_vm)
+	{
+		if (!backend.m_vm)
+			backend.m_vm = std::make_unique<VM>();
+		auto script = Compiler{}.Compile(program.Statements());
+		if (!script)
+			return;
+		backend.m_vm->Interpret(std::move(script));
 		return;
-	i.Interpret(stmts);
+	}
+	if (!backend.m_interpreter)
+		backend.m_interpreter = std::make_unique<Interpreter>(profiler.get());
+	auto& interpreter = *backend.m_interpreter;
+	if (unit && use_closures)
+		interpreter.InterpretCompiled(std::move(unit));
+	else if (unit)
+		interpreter.Interpret(std::move(unit));
+	else if (use_closures)
+		interpreter.InterpretCompiled(program.Statements());
+	else
+		interpreter.Interpret(program.Statements());
 	//ASTPrinter printer;
 	//std::cout << printer.Print(*expr) << std::endl;
+}
+
+//Runs the tasks the script started (sleep, read...) until none is left. Only the top level of a script
+//is followed by them: a whole script, the last declaration of a stream or a REPL line.
+void RunTasks(Backend& backend) noexcept(false)
+{
+	if (backend.m_interpreter)
+		backend.m_interpreter->InterpretTasks();
+}
+
+//The VM copies what it needs from the tree, the other backends keep the line for as long as
+//a function or class it defined is reachable, so a long session does not accumulate old lines.
+void RunLine(std::string line, Backend& backend) noexcept(false)
+{
+	const auto unit = MakeRef<CodeUnit>(std::move(line));
+	unit->SetProgram(Compile(unit->Source()));
+	//Stop if there was a parse or resolution error.
+	if (!HasError())
+		Execute(unit->GetProgram(), backend, unit);
+	RunTasks(backend);
+}
+
+//Statistics of the current isolate, written with its errors.
+void PrintStats()
+{
+	auto& out = Isolate::Current().Errors();
+	const auto& strings = GetStringPoolStats();
+	out << "string pool: " << strings.m_count << " strings, "
+		<< strings.m_bytes << " bytes, "
+		<< strings.m_hits << '/' << strings.m_lookups << " lookups hit\n";
+	const auto& gc = GetGcStats();
+	out << "gc: " << gc.m_collections << " collections, "
+		<< gc.m_objects_reclaimed << " objects/" << gc.m_bytes_reclaimed << " bytes reclaimed, "
+		<< gc.m_total_pause_ms << " ms total pause, " << gc.m_max_pause_ms << " ms max pause, "
+		<< gc.m_live_objects << " objects/" << gc.m_live_bytes << " bytes live\n";
+}
+
+void WriteProfile()
+{
+	std::ofstream folded{ profile_path };
+	if (!folded.is_open())
+		throw std::runtime_error("can`t open file: " + profile_path);
+	profiler->Report(std::cerr, folded);
+	std::cerr << "collapsed stacks written to " << profile_path << '\n';
+}
 
+//The Program cached for source in cache_path, mapped into cache, which has to outlive the Program.
+//Whatever is wrong with the cache (missing, unreadable, not a file, stale or corrupt), the script is compiled instead.
+std::optional<ast::Program> LoadCached(const std::filesystem::path& cache_path, std::string_view source,
+	std::optional<SourceFile>& cache)
+{
+	try
+	{
+		if (std::filesystem::exists(cache_path))
+		{
+			cache.emplace(cache_path);
+			if (auto program = LoadProgram(cache->Text(), source))
+				return program;
+		}
+	}
+	catch (const std::exception&)
+	{
+	}
+	cache.reset();
+	return std::nullopt;
 }
 
 void RunFile(std::string_view path) noexcept(false)
 {
-	std::ifstream f{ std::filesystem::path(path) };
-	std::string text((std::istreambuf_iterator<char>(f)),
-		std::istreambuf_iterator<char>());
-	Run(std::move(text));
+	const std::filesystem::path script{ path };
+	const SourceFile file{ script };
+	if (!use_cache)
+	{
+		auto program = Compile(file.Text());
+		Backend backend;
+		if (!HasError())
+		{
+			Execute(program, backend);
+			RunTasks(backend);
+		}
+		return;
+	}
+	//A cache written for this exact source skips the Lexer, Parser and Resolver.
+	//Tokens loaded from it view the mapped cache, so it stays mapped as long as the program.
+	const auto cache_path = CachePath(script);
+	std::optional<SourceFile> cache;
+	auto program = LoadCached(cache_path, file.Text(), cache);
+	if (!program)
+	{
+		program = Compile(file.Text());
+		if (HasError())
+			return;
+		StoreProgram(cache_path, *program, file.Text());
+	}
+	Backend backend;
+	Execute(*program, backend);
+	RunTasks(backend);
+}
+
+//Each declaration is compiled and run as soon as it has been read, in a unit of its own (see RunLine),
+//so the first output does not wait for the end of the script and memory holds the declaration being read
+//and what the earlier ones defined, not the whole source, its tokens and its tree.
+//Like a script run whole, the first compile or runtime error stops it, but what came before has already run.
+void RunStream(std::istream& input) noexcept(false)
+{
+	DeclarationReader reader{ input };
+	Backend backend;
+	std::string text;
+	int line = 0;
+	while (!HasError() && !HasRuntimeError() && reader.Next(text, line))
+	{
+		const auto unit = MakeRef<CodeUnit>(std::move(text));
+		unit->SetProgram(Compile(unit->Source(), line));
+		if (!HasError())
+			Execute(unit->GetProgram(), backend, unit);
+	}
+	//The first error stopped the script and the tasks it started.
+	if (!HasError() && !HasRuntimeError())
+		RunTasks(backend);
 }
 
 void RunPrompt() noexcept(false)
 {
+	Backend backend;
 	while (true)
 	{
+		Isolate::Current().Out().Flush();
 		std::cout << "> ";
-		std::string text;
-		std::getline(std::cin, text);
-		if (text.empty())
+		std::string line;
+		std::getline(std::cin, line);
+		if (line.empty())
 			return;
-		Run(std::move(text));
-		has_error = false;
+		RunLine(std::move(line), backend);
+		ClearErrors();
+	}
+}
+
+//Exit code for the scripts run in the current isolate.
+int ExitStatus()
+{
+	if (HasError())
+		return 65;
+	if (HasRuntimeError())
+		return 70;
+	return 0;
+}
+
+//A script of a --jobs batch, compiled once by the first job that runs it.
+//The other jobs load their own tree from its serialized form, which is immutable and shared by the threads.
+//A tree can't be shared: it holds the strings of the isolate it was built in
+//and the property caches of the interpreter that runs it.
+struct SharedScript
+{
+	std::once_flag m_prepared;
+	std::filesystem::path m_path;
+	std::optional<SourceFile> m_source;
+	//The mapped script.loxc if it was written for this source, otherwise m_image is the compiled tree.
+	std::optional<SourceFile> m_cache;
+	std::string m_image;
+	bool m_compiled = false;
+	//Written by every job when the script does not compile.
+	std::string m_errors;
+
+	std::string_view Image() const
+	{
+		return m_cache ? m_cache->Text() : m_image;
+	}
+};
+
+//One run of a script in an isolate of its own. What it prints and its errors are kept until the jobs
+//before it were written, so the output is the same as if the scripts ran one after another.
+struct Job
+{
+	SharedScript* m_script = nullptr;
+	std::ostringstream m_out;
+	std::ostringstream m_errors;
+	int m_status = 0;
+	std::promise<void> m_done;
+};
+
+//Loads or compiles the script in the job's isolate, the tree is only returned to that job.
+std::optional<ast::Program> Prepare(SharedScript& script, Job& job) noexcept(false)
+{
+	const auto& source = script.m_source.emplace(script.m_path);
+	const auto cache_path = CachePath(script.m_path);
+	if (use_cache)
+	{
+		if (auto program = LoadCached(cache_path, source.Text(), script.m_cache))
+		{
+			script.m_compiled = true;
+			return program;
+		}
+	}
+	auto program = Compile(source.Text());
+	if (HasError())
+	{
+		script.m_errors = job.m_errors.str();
+		return std::nullopt;
+	}
+	script.m_image = SerializeProgram(program, source.Text());
+	if (use_cache)
+		StoreProgram(cache_path, script.m_image);
+	script.m_compiled = true;
+	return program;
+}
+
+void RunJob(Job& job) noexcept(false)
+{
+	Isolate isolate{ job.m_out, job.m_errors, flush_policy };
+	const Isolate::Scope scope{ isolate };
+	if (gc_growth)
+		SetGcGrowthFactor(*gc_growth);
+	auto& script = *job.m_script;
+	std::optional<ast::Program> program;
+	bool prepared = false;
+	std::call_once(script.m_prepared, [&]
+	{
+		prepared = true;
+		program = Prepare(script, job);
+	});
+	if (!script.m_compiled)
+	{
+		if (!prepared)
+			job.m_errors << script.m_errors;
+		job.m_status = 65;
+		return;
+	}
+	if (!program)
+		program = LoadProgram(script.Image(), script.m_source->Text());
+	if (!program)
+		throw std::runtime_error("can`t load the compiled " + script.m_path.string());
+	{
+		Backend backend;
+		Execute(*program, backend);
+		RunTasks(backend);
+	}
+	if (print_stats)
+		PrintStats();
+	job.m_status = ExitStatus();
+}
+
+//--jobs: every script runs in its own isolate, on a pool of threads. A script can be given several times.
+//Returns the exit code of the first script that failed.
+int RunJobs(const std::vector<std::string_view>& paths, unsigned threads) noexcept(false)
+{
+	std::map<std::filesystem::path, SharedScript> scripts;
+	std::vector<Job> jobs(paths.size());
+	std::vector<std::future<void>> done;
+	for (std::size_t i = 0; i < paths.size(); ++i)
+	{
+		const auto path = std::filesystem::path(paths[i]).lexically_normal();
+		auto& script = scripts[path];
+		script.m_path = path;
+		jobs[i].m_script = &script;
+		done.push_back(jobs[i].m_done.get_future());
+	}
+	std::atomic<std::size_t> next = 0;
+	const auto work = [&]
+	{
+		for (auto i = next++; i < jobs.size(); i = next++)
+		{
+			try
+			{
+				RunJob(jobs[i]);
+			}
+			catch (const std::exception& error)
+			{
+				jobs[i].m_errors << error.what() << '\n';
+				jobs[i].m_status = -1;
+			}
+			jobs[i].m_done.set_value();
+		}
+	};
+	if (threads == 0)
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	std::vector<std::jthread> workers;
+	for (std::size_t i = 0; i < std::min<std::size_t>(threads, jobs.size()); ++i)
+		workers.emplace_back(work);
+	int status = 0;
+	for (std::size_t i = 0; i < jobs.size(); ++i)
+	{
+		done[i].wait();
+		std::cout << jobs[i].m_out.view() << std::flush;
+		std::cerr << jobs[i].m_errors.view();
+		if (!status)
+			status = jobs[i].m_status;
 	}
+	return status;
+}
+
+FlushPolicy ParseFlushPolicy(std::string_view policy) noexcept(false)
+{
+	if (policy == "line")
+		return FlushPolicy::LINE;
+	if (policy == "full")
+		return FlushPolicy::FULL;
+	if (policy == "none")
+		return FlushPolicy::NONE;
+	throw std::invalid_argument("unknown flush policy: " + std::string(policy));
 }
 
 int main(int argc, char** argv) try
 {
-	if (argc > 2)
+	std::vector<std::string_view> args(argv + 1, argv + argc);
+	//--jobs N, 0 is one thread per core.
+	std::optional<unsigned> jobs;
+	while (!args.empty() && args.front().starts_with("--"))
+	{
+		if (args.front() == "--vm")
+			use_vm = true;
+		else if (args.front() == "--closures")
+			use_closures = true;
+		else if (args.front() == "--stats")
+			print_stats = true;
+		else if (args.front() == "--no-optimize")
+			optimize = false;
+		else if (args.front() == "--no-cache")
+			use_cache = false;
+		else if (args.front() == "--stream")
+			use_stream = true;
+		else if (args.front() == "--profile" || args.front().starts_with("--profile="))
+		{
+			profiler = std::make_unique<Profiler>();
+			if (args.front().starts_with("--profile="))
+				profile_path = args.front().substr(std::string_view("--profile=").size());
+		}
+		//Heap size after a collection times this factor triggers the next one.
+		else if (args.front().starts_with("--gc-growth="))
+		{
+			gc_growth = std::stod(std::string(args.front().substr(std::string_view("--gc-growth=").size())));
+			SetGcGrowthFactor(*gc_growth);
+		}
+		else if (args.front().starts_with("--flush="))
+		{
+			flush_policy = ParseFlushPolicy(args.front().substr(std::string_view("--flush=").size()));
+			Isolate::Current().Out().SetPolicy(flush_policy);
+		}
+		else if (args.front() == "--jobs" && args.size() > 1)
+		{
+			args.erase(args.begin());
+			jobs = static_cast<unsigned>(std::stoul(std::string(args.front())));
+		}
+		else
+			break;
+		args.erase(args.begin());
+	}
+	const auto is_option = [](std::string_view arg)
 	{
-		std::cerr << "Usage: ./clox [script]\n";
+		return arg.starts_with("--");
+	};
+	if ((jobs ? args.empty() || use_stream : args.size() > 1) || std::ranges::any_of(args, is_option))
+	{
+		std::cerr << "Usage: ./clox [--vm | --closures] [--stats] [--no-optimize] [--no-cache] [--profile[=file]] [--gc-growth=factor] [--flush=line|full|none] "
+			"[script | --stream [script] | --jobs N script...]\n";
 		return 64;
 	}
-	if (argc == 2)
-		RunFile(argv[1]);
+	if (profiler && use_vm)
+	{
+		std::cerr << "--profile is only supported by the tree-walking interpreter, ignored with --vm\n";
+		profiler = nullptr;
+	}
+	if (profiler && jobs)
+	{
+		std::cerr << "--profile is not supported with --jobs, ignored\n";
+		profiler = nullptr;
+	}
+	if (jobs)
+		return RunJobs(args, *jobs);
+	if (use_stream && args.size() == 1)
+	{
+		std::ifstream script{ std::string(args.front()) };
+		if (!script.is_open())
+			throw std::runtime_error("can`t open file: " + std::string(args.front()));
+		RunStream(script);
+	}
+	else if (use_stream)
+		RunStream(std::cin);
+	else if (args.size() == 1)
+		RunFile(args.front());
 	else
 		RunPrompt();
-	if (has_error)
-		return 65;
-	if (has_runtime_error)
-		return 70;
-	return 0;
+	Isolate::Current().Out().Flush();
+	if (print_stats)
+		PrintStats();
+	if (profiler)
+		WriteProfile();
+	return ExitStatus();
 }
 catch (const std::exception& error)
 {
+	Isolate::Current().Out().Flush();
 	std::cerr << error.what() << std::endl;
 	return -1;
-}
\ No newline at end of file
+}
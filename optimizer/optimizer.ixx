@@ -0,0 +1,463 @@
+export module optimizer;
+
+import ast;
+import core;
+import value;
+
+import <optional>;
+import <span>;
+import <string>;
+import <vector>;
+
+//Rewrites a resolved Program before it runs: folds constant Binary/Unary/Logical/Grouping expressions,
+//prunes if/while with a constant condition and drops expression statements without side effects.
+//Nodes are immutable, so a changed node is copied into the Program arena along with its parents
+//and unchanged subtrees are shared. Folded values are owned by the Program.
+//Folding follows the Interpreter, an operation that would fail at runtime is left as is.
+export class Optimizer : ast::expr::VisitorExpr, ast::stmt::VisitorStmt
+{
+	ast::Program& m_program;
+	//Result of the last visited node, every Visit sets it. A removed statement is nullptr.
+	ast::expr::ExprPtr m_expr = nullptr;
+	ast::stmt::StmtPtr m_stmt = nullptr;
+public:
+	explicit Optimizer(ast::Program& program)
+		: m_program(program)
+	{}
+	void Optimize();
+private:
+	ast::Completion Visit(const ast::stmt::Block& val) override;
+	ast::Completion Visit(const ast::stmt::Class& val) override;
+	ast::Completion Visit(const ast::stmt::Expression& val) override;
+	ast::Completion Visit(const ast::stmt::Function& val) override;
+	ast::Completion Visit(const ast::stmt::If& val) override;
+	ast::Completion Visit(const ast::stmt::Print& val) override;
+	ast::Completion Visit(const ast::stmt::Return& val) override;
+	ast::Completion Visit(const ast::stmt::Var& val) override;
+	ast::Completion Visit(const ast::stmt::While& val) override;
+
+	Value Visit(const ast::expr::Assign& val) override;
+	Value Visit(const ast::expr::Binary& val) override;
+	Value Visit(const ast::expr::Call& val) override;
+	Value Visit(const ast::expr::Get& val) override;
+	Value Visit(const ast::expr::Grouping& val) override;
+	Value Visit(const ast::expr::Logical& val) override;
+	Value Visit(const ast::expr::Set& val) override;
+	Value Visit(const ast::expr::Literal& val) override;
+	Value Visit(const ast::expr::Super& val) override;
+	Value Visit(const ast::expr::This& val) override;
+	Value Visit(const ast::expr::Unary& val) override;
+	Value Visit(const ast::expr::Variable& val) override;
+
+	ast::expr::ExprPtr Optimize(ast::expr::ExprPtr expr);
+	ast::stmt::StmtPtr Optimize(ast::stmt::StmtPtr stmt);
+	//Sets changed if any statement was rewritten or removed.
+	std::span<const ast::stmt::StmtPtr> Optimize(std::span<const ast::stmt::StmtPtr> statements, bool& changed);
+	const ast::stmt::Function* OptimizeFunction(const ast::stmt::Function& function);
+	//Where a statement is required but the optimized one was removed.
+	ast::stmt::StmtPtr OrEmpty(ast::stmt::StmtPtr stmt);
+	ast::expr::ExprPtr Constant(Value value);
+
+	template<class T, class ...Args>
+	const T* New(Args&&... args)
+	{
+		return m_program.New<T>(std::forward<Args>(args)...);
+	}
+	static const Value* AsConstant(ast::expr::ExprPtr expr);
+	static std::optional<Value> Fold(TokenType op, const Value& left, const Value& right);
+	static bool IsPure(ast::expr::ExprPtr expr);
+};
+
+module :private;
+
+void Optimizer::Optimize()
+{
+	bool changed = false;
+	const auto statements = Optimize(m_program.Statements(), changed);
+	if (changed)
+		m_program.SetStatements(statements);
+}
+
+ast::expr::ExprPtr Optimizer::Optimize(ast::expr::ExprPtr expr)
+{
+	if (!expr)
+		return nullptr;
+	m_expr = expr;
+	expr->Accept(*this);
+	return m_expr;
+}
+
+ast::stmt::StmtPtr Optimizer::Optimize(ast::stmt::StmtPtr stmt)
+{
+	if (!stmt)
+		return nullptr;
+	m_stmt = stmt;
+	stmt->Accept(*this);
+	//A rewritten statement is still on the same line, a branch taken instead of an if keeps its own.
+	if (m_stmt && m_stmt->line == 0)
+		m_stmt->line = stmt->line;
+	return m_stmt;
+}
+
+std::span<const ast::stmt::StmtPtr> Optimizer::Optimize(std::span<const ast::stmt::StmtPtr> statements,
+	bool& changed)
+{
+	std::vector<ast::stmt::StmtPtr> res;
+	res.reserve(statements.size());
+	bool local_changed = false;
+	for (const auto& statement : statements)
+	{
+		const auto optimized = Optimize(statement);
+		local_changed |= optimized != statement;
+		if (optimized)
+			res.push_back(optimized);
+	}
+	if (!local_changed)
+		return statements;
+	changed = true;
+	return m_program.List(res);
+}
+
+const ast::stmt::Function* Optimizer::OptimizeFunction(const ast::stmt::Function& function)
+{
+	bool changed = false;
+	const auto body = Optimize(function.body, changed);
+	if (!changed)
+		return &function;
+	return New<ast::stmt::Function>(function.name, function.params, body);
+}
+
+ast::stmt::StmtPtr Optimizer::OrEmpty(ast::stmt::StmtPtr stmt)
+{
+	if (stmt)
+		return stmt;
+	return New<ast::stmt::Block>(std::span<const ast::stmt::StmtPtr>{});
+}
+
+ast::expr::ExprPtr Optimizer::Constant(Value value)
+{
+	return New<ast::expr::Literal>(m_program.Constant(std::move(value)));
+}
+
+const Value* Optimizer::AsConstant(ast::expr::ExprPtr expr)
+{
+	if (const auto* literal = dynamic_cast<const ast::expr::Literal*>(expr))
+		return &literal->value;
+	return nullptr;
+}
+
+std::optional<Value> Optimizer::Fold(TokenType op, const Value& left, const Value& right)
+{
+	switch (op)
+	{
+	case TokenType::BANG_EQUAL:
+		return !IsEqual(left, right);
+	case TokenType::EQUAL_EQUAL:
+		return IsEqual(left, right);
+	case TokenType::PLUS:
+		if (left.IsNumber() && right.IsNumber())
+			return left.AsNumber() + right.AsNumber();
+		if ((left.IsString() || left.IsNumber()) && (right.IsString() || right.IsNumber()))
+			return MakeString(Stringify(left) + Stringify(right));
+		return std::nullopt;
+	}
+	if (!left.IsNumber() || !right.IsNumber())
+		return std::nullopt;
+	const auto l = left.AsNumber();
+	const auto r = right.AsNumber();
+	switch (op)
+	{
+	case TokenType::MINUS:
+		return l - r;
+	case TokenType::SLASH:
+		return l / r;
+	case TokenType::STAR:
+		return l * r;
+	case TokenType::GREATER:
+		return l > r;
+	case TokenType::GREATER_EQUAL:
+		return l >= r;
+	case TokenType::LESS:
+		return l < r;
+	case TokenType::LESS_EQUAL:
+		return l <= r;
+	}
+	return std::nullopt;
+}
+
+//Evaluating it can neither fail nor change anything.
+//Reading a global can fail (undefined variable), arithmetic can fail on operand types.
+bool Optimizer::IsPure(ast::expr::ExprPtr expr)
+{
+	if (dynamic_cast<const ast::expr::Literal*>(expr) || dynamic_cast<const ast::expr::This*>(expr))
+		return true;
+	if (const auto* variable = dynamic_cast<const ast::expr::Variable*>(expr))
+		return !variable->slot.IsGlobal();
+	if (const auto* grouping = dynamic_cast<const ast::expr::Grouping*>(expr))
+		return IsPure(grouping->expression);
+	if (const auto* logical = dynamic_cast<const ast::expr::Logical*>(expr))
+		return IsPure(logical->left) && IsPure(logical->right);
+	if (const auto* unary = dynamic_cast<const ast::expr::Unary*>(expr))
+		return unary->op.m_type == TokenType::BANG && IsPure(unary->right);
+	if (const auto* binary = dynamic_cast<const ast::expr::Binary*>(expr))
+	{
+		return (binary->op.m_type == TokenType::EQUAL_EQUAL || binary->op.m_type == TokenType::BANG_EQUAL)
+			&& IsPure(binary->left) && IsPure(binary->right);
+	}
+	return false;
+}
+
+ast::Completion Optimizer::Visit(const ast::stmt::Block& val)
+{
+	bool changed = false;
+	const auto statements = Optimize(val.statements, changed);
+	if (statements.empty())
+		m_stmt = nullptr;
+	else if (changed)
+		m_stmt = New<ast::stmt::Block>(statements);
+	else
+		m_stmt = &val;
+	return {};
+}
+
+ast::Completion Optimizer::Visit(const ast::stmt::Class& val)
+{
+	std::vector<const ast::stmt::Function*> methods;
+	methods.reserve(val.methods.size());
+	bool changed = false;
+	for (const auto& method : val.methods)
+	{
+		methods.push_back(OptimizeFunction(*method));
+		changed |= methods.back() != method;
+	}
+	if (changed)
+		m_stmt = New<ast::stmt::Class>(val.name, val.superclass, m_program.List(methods));
+	else
+		m_stmt = &val;
+	return {};
+}
+
+ast::Completion Optimizer::Visit(const ast::stmt::Expression& val)
+{
+	const auto expression = Optimize(val.expression);
+	if (IsPure(expression))
+		m_stmt = nullptr;
+	else if (expression != val.expression)
+		m_stmt = New<ast::stmt::Expression>(expression);
+	else
+		m_stmt = &val;
+	return {};
+}
+
+ast::Completion Optimizer::Visit(const ast::stmt::Function& val)
+{
+	m_stmt = OptimizeFunction(val);
+	return {};
+}
+
+ast::Completion Optimizer::Visit(const ast::stmt::If& val)
+{
+	const auto condition = Optimize(val.condition);
+	if (const auto* constant = AsConstant(condition))
+	{
+		m_stmt = Optimize(IsTruthy(*constant) ? val.then_branch : val.else_branch);
+		return {};
+	}
+	const auto then_branch = OrEmpty(Optimize(val.then_branch));
+	const auto else_branch = Optimize(val.else_branch);
+	if (condition != val.condition || then_branch != val.then_branch || else_branch != val.else_branch)
+		m_stmt = New<ast::stmt::If>(condition, then_branch, else_branch);
+	else
+		m_stmt = &val;
+	return {};
+}
+
+ast::Completion Optimizer::Visit(const ast::stmt::Print& val)
+{
+	const auto expression = Optimize(val.expression);
+	if (expression != val.expression)
+		m_stmt = New<ast::stmt::Print>(expression);
+	else
+		m_stmt = &val;
+	return {};
+}
+
+ast::Completion Optimizer::Visit(const ast::stmt::Return& val)
+{
+	const auto value = Optimize(val.value);
+	if (value != val.value)
+		m_stmt = New<ast::stmt::Return>(val.keyword, value);
+	else
+		m_stmt = &val;
+	return {};
+}
+
+ast::Completion Optimizer::Visit(const ast::stmt::Var& val)
+{
+	const auto initializer = Optimize(val.initializer);
+	if (initializer != val.initializer)
+		m_stmt = New<ast::stmt::Var>(val.name, initializer);
+	else
+		m_stmt = &val;
+	return {};
+}
+
+ast::Completion Optimizer::Visit(const ast::stmt::While& val)
+{
+	const auto condition = Optimize(val.condition);
+	if (const auto* constant = AsConstant(condition); constant && !IsTruthy(*constant))
+	{
+		m_stmt = nullptr;
+		return {};
+	}
+	const auto body = OrEmpty(Optimize(val.body));
+	if (condition != val.condition || body != val.body)
+		m_stmt = New<ast::stmt::While>(condition, body);
+	else
+		m_stmt = &val;
+	return {};
+}
+
+Value Optimizer::Visit(const ast::expr::Assign& val)
+{
+	const auto value = Optimize(val.value);
+	if (value != val.value)
+	{
+		const auto* assign = New<ast::expr::Assign>(val.name, value);
+		assign->slot = val.slot;
+		m_expr = assign;
+	}
+	else
+		m_expr = &val;
+	return {};
+}
+
+Value Optimizer::Visit(const ast::expr::Binary& val)
+{
+	const auto left = Optimize(val.left);
+	const auto right = Optimize(val.right);
+	const auto* left_constant = AsConstant(left);
+	const auto* right_constant = AsConstant(right);
+	if (left_constant && right_constant)
+	{
+		if (auto folded = Fold(val.op.m_type, *left_constant, *right_constant))
+		{
+			m_expr = Constant(std::move(*folded));
+			return {};
+		}
+	}
+	if (left != val.left || right != val.right)
+		m_expr = New<ast::expr::Binary>(left, val.op, right);
+	else
+		m_expr = &val;
+	return {};
+}
+
+Value Optimizer::Visit(const ast::expr::Call& val)
+{
+	const auto callee = Optimize(val.callee);
+	std::vector<ast::expr::ExprPtr> arguments;
+	arguments.reserve(val.arguments.size());
+	bool changed = callee != val.callee;
+	for (const auto& argument : val.arguments)
+	{
+		arguments.push_back(Optimize(argument));
+		changed |= arguments.back() != argument;
+	}
+	if (changed)
+	{
+		m_expr = New<ast::expr::Call>(callee, val.paren, m_program.List(arguments),
+			dynamic_cast<const ast::expr::Get*>(callee));
+	}
+	else
+		m_expr = &val;
+	return {};
+}
+
+Value Optimizer::Visit(const ast::expr::Get& val)
+{
+	const auto object = Optimize(val.object);
+	if (object != val.object)
+		m_expr = New<ast::expr::Get>(object, val.name);
+	else
+		m_expr = &val;
+	return {};
+}
+
+Value Optimizer::Visit(const ast::expr::Grouping& val)
+{
+	//Parentheses only matter to the parser.
+	m_expr = Optimize(val.expression);
+	return {};
+}
+
+Value Optimizer::Visit(const ast::expr::Logical& val)
+{
+	const auto left = Optimize(val.left);
+	if (const auto* constant = AsConstant(left))
+	{
+		const bool short_circuit = val.op.m_type == TokenType::OR ? IsTruthy(*constant) : !IsTruthy(*constant);
+		m_expr = short_circuit ? left : Optimize(val.right);
+		return {};
+	}
+	const auto right = Optimize(val.right);
+	if (left != val.left || right != val.right)
+		m_expr = New<ast::expr::Logical>(left, val.op, right);
+	else
+		m_expr = &val;
+	return {};
+}
+
+Value Optimizer::Visit(const ast::expr::Set& val)
+{
+	const auto object = Optimize(val.object);
+	const auto value = Optimize(val.value);
+	if (object != val.object || value != val.value)
+		m_expr = New<ast::expr::Set>(object, val.name, value);
+	else
+		m_expr = &val;
+	return {};
+}
+
+Value Optimizer::Visit(const ast::expr::Literal& val)
+{
+	return {};
+}
+
+Value Optimizer::Visit(const ast::expr::Super& val)
+{
+	return {};
+}
+
+Value Optimizer::Visit(const ast::expr::This& val)
+{
+	return {};
+}
+
+Value Optimizer::Visit(const ast::expr::Unary& val)
+{
+	const auto right = Optimize(val.right);
+	if (const auto* constant = AsConstant(right))
+	{
+		if (val.op.m_type == TokenType::BANG)
+		{
+			m_expr = Constant(!IsTruthy(*constant));
+			return {};
+		}
+		if (val.op.m_type == TokenType::MINUS && constant->IsNumber())
+		{
+			m_expr = Constant(-constant->AsNumber());
+			return {};
+		}
+	}
+	if (right != val.right)
+		m_expr = New<ast::expr::Unary>(val.op, right);
+	else
+		m_expr = &val;
+	return {};
+}
+
+Value Optimizer::Visit(const ast::expr::Variable& val)
+{
+	return {};
+}
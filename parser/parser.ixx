@@ -3,8 +3,10 @@ export module parser;
 import ast;
 import core;
 import log;
+import value;
 
-import <memory>;
+import <span>;
+import <utility>;
 import <vector>;
 import <stdexcept>;
 import <string_view>;
@@ -15,25 +17,28 @@ public:
 	using std::runtime_error::runtime_error;
 };
 
+//Nodes are allocated from the Program arena and reference its tokens.
 export class Parser
 {
-	std::vector<Token> m_tokens;
+	ast::Program m_program;
+	const std::vector<Token>& m_tokens;
 	int m_current = 0;
 public:
 	explicit Parser(std::vector<Token> tokens);
 
-	std::vector<ast::stmt::StmtPtr> Parse();
+	//Can only be called once, the Program is moved out.
+	ast::Program Parse();
 private:
 	ast::stmt::StmtPtr Declaration();
 	ast::stmt::StmtPtr ClassDeclaration();
 	ast::stmt::StmtPtr Statement();
-	std::unique_ptr<ast::stmt::Function> Function(const std::string& kind);
+	const ast::stmt::Function* Function(const std::string& kind);
 	ast::stmt::StmtPtr ForStatement();
 	ast::stmt::StmtPtr IfStatement();
 	ast::stmt::StmtPtr VarDeclaration();
 	ast::stmt::StmtPtr WhileStatement();
 	ast::stmt::StmtPtr ExprStmt();
-	std::vector<ast::stmt::StmtPtr> Block();
+	std::span<const ast::stmt::StmtPtr> Block();
 	ast::stmt::StmtPtr PrintStmt();
 	ast::stmt::StmtPtr ReturnStmt();
 
@@ -57,6 +62,18 @@ private:
 	const Token& ConsumeType(TokenType type, std::string_view error);
 
 	bool CheckCurrentType(TokenType type) const;
+	template<class T, class ...Args>
+	const T* New(Args&&... args)
+	{
+		return m_program.New<T>(std::forward<Args>(args)...);
+	}
+	//Statements nested in stmt already have their own line.
+	static ast::stmt::StmtPtr WithLine(ast::stmt::StmtPtr stmt, int line)
+	{
+		if (stmt && stmt->line == 0)
+			stmt->line = line;
+		return stmt;
+	}
 	ParseError Error(const Token& token, std::string_view message);
 	void Synchronize();
 	
@@ -74,30 +91,40 @@ private:
 
 module :private;
 
+//Literals that have no token of their own.
+static const Value true_value{ true };
+static const Value false_value{ false };
+static const Value nil_value{};
+
 Parser::Parser(std::vector<Token> tokens)
-	: m_tokens(std::move(tokens))
+	: m_program(std::move(tokens))
+	, m_tokens(m_program.Tokens())
 {}
 
-std::vector<ast::stmt::StmtPtr> Parser::Parse() try
+ast::Program Parser::Parse()
 {
-	std::vector<ast::stmt::StmtPtr> statements;
-	while (!IsAtEnd())
-		statements.push_back(Declaration());
-	return statements;
-}
-catch (const ParseError& error)
-{
-	return {};
+	try
+	{
+		std::vector<ast::stmt::StmtPtr> statements;
+		while (!IsAtEnd())
+			statements.push_back(Declaration());
+		m_program.SetStatements(m_program.List(statements));
+	}
+	catch (const ParseError& error)
+	{
+	}
+	return std::move(m_program);
 }
 
 ast::stmt::StmtPtr Parser::Declaration() try
 {
+	const auto line = Peek().m_line;
 	if (Match(TokenType::CLASS))
-		return ClassDeclaration();
+		return WithLine(ClassDeclaration(), line);
 	if (Match(TokenType::FUN))
-		return Function("function");
+		return WithLine(Function("function"), line);
 	if (Match(TokenType::VAR))
-		return VarDeclaration();
+		return WithLine(VarDeclaration(), line);
 	return Statement();
 }
 catch (const ParseError& err)
@@ -108,66 +135,67 @@ catch (const ParseError& err)
 
 ast::stmt::StmtPtr Parser::ClassDeclaration()
 {
-	auto name = ConsumeType(TokenType::IDENTIFIER, "Expect class name.");
-	std::unique_ptr<ast::expr::Variable> superclass;
+	const auto& name = ConsumeType(TokenType::IDENTIFIER, "Expect class name.");
+	const ast::expr::Variable* superclass = nullptr;
 	if (Match(TokenType::LESS))
 	{
 		ConsumeType(TokenType::IDENTIFIER, "Expect superclass name.");
-		superclass = std::make_unique<ast::expr::Variable>(Previous());
+		superclass = New<ast::expr::Variable>(Previous());
 	}
 	ConsumeType(TokenType::LEFT_BRACE, "Expect '{' before class body.");
-	std::vector<std::unique_ptr<ast::stmt::Function>> methods;
+	std::vector<const ast::stmt::Function*> methods;
 	while (!CheckCurrentType(TokenType::RIGHT_BRACE) && !IsAtEnd())
 	{
 		methods.push_back(Function("method"));
 	}
 	ConsumeType(TokenType::RIGHT_BRACE, "Expect '}' after class body.");
-	return std::make_unique<ast::stmt::Class>(
-		std::move(name), std::move(superclass), std::move(methods));
+	return New<ast::stmt::Class>(name, superclass, m_program.List(methods));
 }
 
 ast::stmt::StmtPtr Parser::Statement()
 {
+	const auto line = Peek().m_line;
 	if (Match(TokenType::FOR))
-		return ForStatement();
+		return WithLine(ForStatement(), line);
 	if (Match(TokenType::IF))
-		return IfStatement();
+		return WithLine(IfStatement(), line);
 	if (Match(TokenType::PRINT))
-		return PrintStmt();
+		return WithLine(PrintStmt(), line);
 	if (Match(TokenType::RETURN))
-		return ReturnStmt();
+		return WithLine(ReturnStmt(), line);
 	if (Match(TokenType::WHILE))
-		return WhileStatement();
+		return WithLine(WhileStatement(), line);
 	if (Match(TokenType::LEFT_BRACE))
-		return std::make_unique<ast::stmt::Block>(Block());
-	return ExprStmt();
+		return WithLine(New<ast::stmt::Block>(Block()), line);
+	return WithLine(ExprStmt(), line);
 }
 
-std::unique_ptr<ast::stmt::Function> Parser::Function(const std::string& kind)
+const ast::stmt::Function* Parser::Function(const std::string& kind)
 {
-	auto name = ConsumeType(TokenType::IDENTIFIER, "Expect" + kind + " name.");
+	const auto& name = ConsumeType(TokenType::IDENTIFIER, "Expect" + kind + " name.");
 	ConsumeType(TokenType::LEFT_PAREN, "Expect '(' after " + kind + " name.");
-	std::vector<Token> parameters;
+	std::vector<const Token*> parameters;
 	if (!CheckCurrentType(TokenType::RIGHT_PAREN))
 	{
 		do
 		{
 			if (parameters.size() >= 255)
 				Error(Peek(), "Can't have more than 255 parameters.");
-			parameters.push_back(ConsumeType(TokenType::IDENTIFIER, "Expect parameter name."));
+			parameters.push_back(&ConsumeType(TokenType::IDENTIFIER, "Expect parameter name."));
 		} while (Match(TokenType::COMMA));
 	}
 	ConsumeType(TokenType::RIGHT_PAREN, "Expect ')' after parameters.");
 	ConsumeType(TokenType::LEFT_BRACE, "Expect '{' before " + kind + " body.");
-	auto body = Block();
-	return std::make_unique<ast::stmt::Function>
-		(std::move(name), std::move(parameters), std::move(body));
+	const auto body = Block();
+	return New<ast::stmt::Function>(name, m_program.List(parameters), body);
 }
 
 ast::stmt::StmtPtr Parser::ForStatement()
 {
+	//The statements a for loop is desugared into are all on its line.
+	const auto line = Previous().m_line;
 	ConsumeType(TokenType::LEFT_PAREN, "Expect '(' after 'for'.");
-	ast::stmt::StmtPtr initializer;
+	ast::stmt::StmtPtr initializer = nullptr;
 	if (Match(TokenType::SEMICOLON))
 	{
 	}
@@ -176,32 +204,29 @@ ast::stmt::StmtPtr Parser::ForStatement()
 	else
 		initializer = ExprStmt();
 
-	ast::expr::ExprPtr condition;
+	ast::expr::ExprPtr condition = nullptr;
 	if (!CheckCurrentType(TokenType::SEMICOLON))
 		condition = Expression();
 	ConsumeType(TokenType::SEMICOLON, "Expect ';' after loop condition.");
 
-	ast::expr::ExprPtr increment;
+	ast::expr::ExprPtr increment = nullptr;
 	if (!CheckCurrentType(TokenType::LEFT_PAREN))
 		increment = Expression();
 	ConsumeType(TokenType::RIGHT_PAREN, "Expect ')' after for clauses.");
 	auto body = Statement();
 	if (increment)
 	{
-		std::vector<ast::stmt::StmtPtr> block;
-		block.push_back(std::move(body));
-		block.push_back(std::make_unique<ast::stmt::Expression>(std::move(increment)));
-		body = std::make_unique<ast::stmt::Block>(std::move(block));
+		const std::vector<ast::stmt::StmtPtr> block{ body,
+			WithLine(New<ast::stmt::Expression>(increment), line) };
+		body = WithLine(New<ast::stmt::Block>(m_program.List(block)), line);
 	}
 	if (!condition)
-		condition = std::make_unique<ast::expr::Literal>(true);
-	body = std::make_unique<ast::stmt::While>(std::move(condition), std::move(body));
+		condition = New<ast::expr::Literal>(true_value);
+	body = WithLine(New<ast::stmt::While>(condition, body), line);
 	if (initializer)
 	{
-		std::vector<ast::stmt::StmtPtr> block;
-		block.push_back(std::move(initializer));
-		block.push_back(std::move(body));
-		body = std::make_unique<ast::stmt::Block>(std::move(block));
+		const std::vector<ast::stmt::StmtPtr> block{ WithLine(initializer, line), body };
+		body = WithLine(New<ast::stmt::Block>(m_program.List(block)), line);
 	}
 	return body;
 }
@@ -211,22 +236,21 @@ ast::stmt::StmtPtr Parser::IfStatement()
 	ConsumeType(TokenType::LEFT_PAREN, "Expect '(' after 'if'.");
 	auto condition = Expression();
 	ConsumeType(TokenType::RIGHT_PAREN, "Expect ')' after if condition.");
-	auto then_branch = Statement();
-	ast::stmt::StmtPtr else_branch;
+	const auto then_branch = Statement();
+	ast::stmt::StmtPtr else_branch = nullptr;
 	if (Match(TokenType::ELSE))
 		else_branch = Statement();
-	return std::make_unique<ast::stmt::If>(std::move(condition),
-		std::move(then_branch), std::move(else_branch));
+	return New<ast::stmt::If>(condition, then_branch, else_branch);
 }
 
 ast::stmt::StmtPtr Parser::VarDeclaration()
 {
-	auto name = ConsumeType(TokenType::IDENTIFIER, "Expect variable name.");
-	ast::expr::ExprPtr initializer;
+	const auto& name = ConsumeType(TokenType::IDENTIFIER, "Expect variable name.");
+	ast::expr::ExprPtr initializer = nullptr;
 	if (Match(TokenType::EQUAL))
 		initializer = Expression();
 	ConsumeType(TokenType::SEMICOLON, "Expect ';' after variable declaration.");
-	return std::make_unique<ast::stmt::Var>(std::move(name), std::move(initializer));
+	return New<ast::stmt::Var>(name, initializer);
 }
 
 ast::stmt::StmtPtr Parser::WhileStatement()
@@ -234,41 +258,41 @@ ast::stmt::StmtPtr Parser::WhileStatement()
 	ConsumeType(TokenType::LEFT_PAREN, "Expect '(' after 'while'.");
 	auto condition = Expression();
 	ConsumeType(TokenType::RIGHT_PAREN, "Expect ')' after condition.");
-	auto body = Statement();
-	return std::make_unique<ast::stmt::While>(std::move(condition), std::move(body));
+	const auto body = Statement();
+	return New<ast::stmt::While>(condition, body);
 }
 
 ast::stmt::StmtPtr Parser::ExprStmt()
 {
 	auto expr = Expression();
 	ConsumeType(TokenType::SEMICOLON, "Expect ';' after expression.");
-	return std::make_unique<ast::stmt::Expression>(std::move(expr));
+	return New<ast::stmt::Expression>(expr);
 }
 
-std::vector<ast::stmt::StmtPtr> Parser::Block()
+std::span<const ast::stmt::StmtPtr> Parser::Block()
 {
 	std::vector<ast::stmt::StmtPtr> res;
 	while (!CheckCurrentType(TokenType::RIGHT_BRACE) && !IsAtEnd())
 		res.push_back(Declaration());
 	ConsumeType(TokenType::RIGHT_BRACE, "Expect '}' after block.");
-	return res;
+	return m_program.List(res);
 }
 
 ast::stmt::StmtPtr Parser::PrintStmt()
 {
 	auto expr = Expression();
 	ConsumeType(TokenType::SEMICOLON, "Expect ';' after value.");
-	return std::make_unique<ast::stmt::Print>(std::move(expr));
+	return New<ast::stmt::Print>(expr);
 }
 
 ast::stmt::StmtPtr Parser::ReturnStmt()
 {
-	auto keyword = Previous();
-	ast::expr::ExprPtr val;
+	const auto& keyword = Previous();
+	ast::expr::ExprPtr val = nullptr;
 	if (!CheckCurrentType(TokenType::SEMICOLON))
 		val = Expression();
 	ConsumeType(TokenType::SEMICOLON, "Expect ';' after return value.");
-	return std::make_unique<ast::stmt::Return>(std::move(keyword), std::move(val));
+	return New<ast::stmt::Return>(keyword, val);
 }
 
 ast::expr::ExprPtr Parser::Expression()
@@ -281,19 +305,17 @@ ast::expr::ExprPtr Parser::Assigment()
 	auto expr = Or();
 	if (Match(TokenType::EQUAL))
 	{
-		auto equals = Previous();
-		auto value = Assigment();
-		const auto var = dynamic_cast<ast::expr::Variable*>(expr.get());
-		const auto getter = dynamic_cast<ast::expr::Get*>(expr.get());
+		const auto& equals = Previous();
+		const auto value = Assigment();
+		const auto var = dynamic_cast<const ast::expr::Variable*>(expr);
+		const auto getter = dynamic_cast<const ast::expr::Get*>(expr);
 		if (var)
 		{
-			auto name = var->name;
-			return std::make_unique<ast::expr::Assign>(std::move(name), std::move(value));
+			return New<ast::expr::Assign>(var->name, value);
 		}
 		else if (getter)
 		{
-			return std::make_unique<ast::expr::Set>
-				(std::move(getter->object), getter->name, std::move(value));
+			return New<ast::expr::Set>(getter->object, getter->name, value);
 		}
 		Error(equals, "Invalid assigment target.");
 	}
@@ -305,9 +327,9 @@ ast::expr::ExprPtr Parser::Or()
 	auto expr = And();
 	while (Match(TokenType::OR))
 	{
-		auto op = Previous();
-		auto right = And();
-		expr = std::make_unique<ast::expr::Logical>(std::move(expr), std::move(op), std::move(right));
+		const auto& op = Previous();
+		const auto right = And();
+		expr = New<ast::expr::Logical>(expr, op, right);
 
 	}
 	return expr;
@@ -318,9 +340,9 @@ ast::expr::ExprPtr Parser::And()
 	auto expr = Equality();
 	while (Match(TokenType::AND))
 	{
-		auto op = Previous();
-		auto right = Equality();
-		expr = std::make_unique<ast::expr::Logical>(std::move(expr), std::move(op), std::move(right));
+		const auto& op = Previous();
+		const auto right = Equality();
+		expr = New<ast::expr::Logical>(expr, op, right);
 
 	}
 	return expr;
@@ -331,10 +353,9 @@ ast::expr::ExprPtr Parser::Equality()
 	auto expr = Comparison();
 	while (Match(TokenType::BANG_EQUAL, TokenType::EQUAL_EQUAL))
 	{
-		auto op = Previous();
-		auto right = Comparison();
-		expr = std::make_unique<ast::expr::Binary>
-			(std::move(expr), std::move(op), std::move(right));
+		const auto& op = Previous();
+		const auto right = Comparison();
+		expr = New<ast::expr::Binary>(expr, op, right);
 	}
 	return expr;
 }
@@ -345,10 +366,9 @@ ast::expr::ExprPtr Parser::Comparison()
 	while (Match(TokenType::GREATER, TokenType::GREATER_EQUAL,
 		TokenType::LESS, TokenType::LESS_EQUAL))
 	{
-		auto op = Previous();
-		auto right = Term();
-		expr = std::make_unique<ast::expr::Binary>
-			(std::move(expr), std::move(op), std::move(right));
+		const auto& op = Previous();
+		const auto right = Term();
+		expr = New<ast::expr::Binary>(expr, op, right);
 	}
 	return expr;
 }
@@ -358,10 +378,9 @@ ast::expr::ExprPtr Parser::Term()
 	auto expr = Factor();
 	while (Match(TokenType::MINUS, TokenType::PLUS))
 	{
-		auto op = Previous();
-		auto right = Factor();
-		expr = std::make_unique<ast::expr::Binary>
-			(std::move(expr), std::move(op), std::move(right));
+		const auto& op = Previous();
+		const auto right = Factor();
+		expr = New<ast::expr::Binary>(expr, op, right);
 	}
 	return expr;
 }
@@ -371,10 +390,9 @@ ast::expr::ExprPtr Parser::Factor()
 	auto expr = Unary();
 	while (Match(TokenType::SLASH, TokenType::STAR))
 	{
-		auto op = Previous();
-		auto right = Unary();
-		expr = std::make_unique<ast::expr::Binary>
-			(std::move(expr), std::move(op), std::move(right));
+		const auto& op = Previous();
+		const auto right = Unary();
+		expr = New<ast::expr::Binary>(expr, op, right);
 	}
 	return expr;
 }
@@ -383,10 +401,9 @@ ast::expr::ExprPtr Parser::Unary()
 {
 	if (Match(TokenType::BANG, TokenType::MINUS))
 	{
-		auto op = Previous();
-		auto right = Unary();
-		return std::make_unique<ast::expr::Unary>
-			(std::move(op), std::move(right));
+		const auto& op = Previous();
+		const auto right = Unary();
+		return New<ast::expr::Unary>(op, right);
 	}
 	return Call();
 }
@@ -403,9 +420,10 @@ ast::expr::ExprPtr Parser::FinishCall(ast::expr::ExprPtr callee)
 			arguments.push_back(Expression());
 		} while (Match(TokenType::COMMA));
 	}
-	auto paren = ConsumeType(TokenType::RIGHT_PAREN, "Expect ')' after arguments.");
-	return std::make_unique<ast::expr::Call>
-		(std::move(callee), std::move(paren), std::move(arguments));
+	const auto& paren = ConsumeType(TokenType::RIGHT_PAREN, "Expect ')' after arguments.");
+	//obj.method(args) is marked once here, so backends can call the method without binding it.
+	const auto invoke = dynamic_cast<const ast::expr::Get*>(callee);
+	return New<ast::expr::Call>(callee, paren, m_program.List(arguments), invoke);
 }
 
 ast::expr::ExprPtr Parser::Call()
@@ -414,11 +432,11 @@ ast::expr::ExprPtr Parser::Call()
 	while (true)
 	{
 		if (Match(TokenType::LEFT_PAREN))
-			expr = FinishCall(std::move(expr));
+			expr = FinishCall(expr);
 		else if (Match(TokenType::DOT))
 		{
-			auto name = ConsumeType(TokenType::IDENTIFIER, "Expect property name after '.'.");
-			expr = std::make_unique<ast::expr::Get>(std::move(expr), std::move(name));
+			const auto& name = ConsumeType(TokenType::IDENTIFIER, "Expect property name after '.'.");
+			expr = New<ast::expr::Get>(expr, name);
 		}
 		else
 			break;
@@ -429,29 +447,29 @@ ast::expr::ExprPtr Parser::Call()
 ast::expr::ExprPtr Parser::Primary()
 {
 	if (Match(TokenType::FALSE))
-		return std::make_unique<ast::expr::Literal>(false);
+		return New<ast::expr::Literal>(false_value);
 	if (Match(TokenType::TRUE))
-		return std::make_unique<ast::expr::Literal>(true);
+		return New<ast::expr::Literal>(true_value);
 	if (Match(TokenType::NIL))
-		return std::make_unique<ast::expr::Literal>(std::monostate{});
+		return New<ast::expr::Literal>(nil_value);
 	if (Match(TokenType::NUMBER, TokenType::STRING))
-		return std::make_unique<ast::expr::Literal>(Previous().m_literal);
+		return New<ast::expr::Literal>(Previous().m_literal);
 	if (Match(TokenType::SUPER))
 	{
-		auto keyword = Previous();
+		const auto& keyword = Previous();
 		ConsumeType(TokenType::DOT, "Expect '.' after 'super'.");
-		auto method = ConsumeType(TokenType::IDENTIFIER, "Expect superclass method name.");
-		return std::make_unique<ast::expr::Super>(std::move(keyword), std::move(method));
+		const auto& method = ConsumeType(TokenType::IDENTIFIER, "Expect superclass method name.");
+		return New<ast::expr::Super>(keyword, method);
 	}
 	if (Match(TokenType::THIS))
-		return std::make_unique<ast::expr::This>(Previous());
+		return New<ast::expr::This>(Previous());
 	if (Match(TokenType::IDENTIFIER))
-		return std::make_unique<ast::expr::Variable>(Previous());
+		return New<ast::expr::Variable>(Previous());
 	if (Match(TokenType::LEFT_PAREN))
 	{
-		auto expr = Expression();
+		const auto expr = Expression();
 		ConsumeType(TokenType::RIGHT_PAREN, "Expect ')' after expression.");
-		return std::make_unique<ast::expr::Grouping>(std::move(expr));
+		return New<ast::expr::Grouping>(expr);
 	}
 	throw Error(Peek(), "Expect expression.");
 }
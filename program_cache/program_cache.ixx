@@ -0,0 +1,950 @@
+export module program_cache;
+
+import ast;
+import core;
+import value;
+
+import <algorithm>;
+import <cstdint>;
+import <cstring>;
+import <filesystem>;
+import <fstream>;
+import <optional>;
+import <stdexcept>;
+import <string>;
+import <string_view>;
+import <span>;
+import <type_traits>;
+import <unordered_map>;
+import <vector>;
+
+//Compiled script cache: a resolved Program is written to script.loxc next to script.lox,
+//and later runs of the same source load it instead of lexing, parsing and resolving again.
+//
+//Layout (native byte order, the cache is local to the machine that wrote it, integers after the header are varints):
+//header: "LOXC", format version, hash of everything after it,
+//        hash and size of the source, token and string counts, offset of the strings
+//tokens: type, line, then the interned name of identifiers and keywords or the lexeme and literal of others
+//tree: the statements in pre-order, each node is a kind byte followed by its fields,
+//      children inline, tokens as indices into the token table and lists prefixed with their size
+//strings: offset and size of every distinct lexeme and string literal, then their text.
+//         Tokens loaded from the cache view it in place, so the mapped cache file
+//         has to outlive the Program like the source text does.
+//
+//The tree is stored before the Optimizer runs, so --no-optimize can use the same cache.
+//A cache whose bytes do not match their hash is ignored (and rewritten by the next run), and what
+//the hash cannot vouch for is checked again when it is loaded: token types, node kinds, and that
+//every resolved variable refers to a scope and a slot the Resolver would have created.
+
+//Where the cache of a script is written.
+export std::filesystem::path CachePath(const std::filesystem::path& script);
+//The Program stored in data (the mapped cache file) if it was written for this source, std::nullopt otherwise.
+export std::optional<ast::Program> LoadProgram(std::string_view data, std::string_view source);
+//The cache of a resolved Program, in memory. The bytes are immutable, so threads share a program
+//through them: each isolate loads its own tree (with its own strings and property caches) with LoadProgram.
+export std::string SerializeProgram(const ast::Program& program, std::string_view source);
+//Writes a resolved Program, errors are ignored: a missing cache only costs the next run some time.
+export void StoreProgram(const std::filesystem::path& path, const ast::Program& program, std::string_view source);
+//Writes a cache serialized already.
+export void StoreProgram(const std::filesystem::path& path, std::string_view data);
+
+module :private;
+
+//Bumped whenever the layout or the AST changes, older caches are rebuilt.
+constexpr std::uint32_t FORMAT_VERSION = 2;
+constexpr char MAGIC[4] = { 'L', 'O', 'X', 'C' };
+
+enum class Kind : std::uint8_t
+{
+	NONE,
+	//Expressions
+	ASSIGN, BINARY, CALL, GET, GROUPING, LOGICAL, SET, LITERAL, SUPER, THIS, UNARY, VARIABLE,
+	//Statements
+	BLOCK, CLASS, EXPRESSION, FUNCTION, IF, PRINT, RETURN, VAR, WHILE,
+};
+
+enum class ValueKind : std::uint8_t
+{
+	NIL, BOOL_FALSE, BOOL_TRUE, NUMBER, STRING,
+};
+
+//FNV-1a
+static std::uint64_t Hash(std::string_view text)
+{
+	std::uint64_t res = 14695981039346656037ull;
+	for (const auto c : text)
+	{
+		res ^= static_cast<unsigned char>(c);
+		res *= 1099511628211ull;
+	}
+	return res;
+}
+
+//Hash of the cache bytes, checked on every load. It reads 8 bytes at a time,
+//the shift folds the high bits of each product back into the low ones.
+static std::uint64_t Checksum(std::string_view data)
+{
+	std::uint64_t res = 14695981039346656037ull;
+	std::size_t i = 0;
+	for (; i + sizeof(std::uint64_t) <= data.size(); i += sizeof(std::uint64_t))
+	{
+		std::uint64_t word;
+		std::memcpy(&word, data.data() + i, sizeof(word));
+		res = (res ^ word) * 1099511628211ull;
+		res ^= res >> 32;
+	}
+	for (; i < data.size(); ++i)
+	{
+		res ^= static_cast<unsigned char>(data[i]);
+		res *= 1099511628211ull;
+	}
+	return res;
+}
+
+class Writer : ast::expr::VisitorExpr, ast::stmt::VisitorStmt
+{
+	const ast::Program& m_program;
+	std::string m_tree;
+	std::string m_tokens;
+	std::uint32_t m_token_count = 0;
+	//Index in the cache of each of the Program's tokens, NO_INDEX until the tree references it.
+	std::vector<std::uint32_t> m_token_indices;
+	static constexpr std::uint32_t NO_INDEX = -1;
+	std::string m_strings;
+	std::vector<std::pair<std::uint32_t, std::uint32_t>> m_string_spans;
+	std::unordered_map<std::string_view, std::uint32_t> m_string_ids;
+	//Interned strings are looked up by pointer, it is cheaper than hashing their text.
+	std::unordered_map<const ObjString*, std::uint32_t> m_name_ids;
+public:
+	explicit Writer(const ast::Program& program)
+		: m_program(program)
+		, m_token_indices(program.Tokens().size(), NO_INDEX)
+	{}
+	std::string Write(std::string_view source);
+private:
+	template<class T>
+	static void Put(std::string& out, T value)
+	{
+		char bytes[sizeof(T)];
+		std::memcpy(bytes, &value, sizeof(T));
+		out.append(bytes, sizeof(T));
+	}
+	template<class T>
+	void Put(T value)
+	{
+		Put(m_tree, value);
+	}
+	//Integers are LEB128 varints, most ids, lines and sizes fit in one or two bytes.
+	static void PutVarint(std::string& out, std::uint64_t value)
+	{
+		while (value >= 0x80)
+		{
+			out += static_cast<char>(value | 0x80);
+			value >>= 7;
+		}
+		out += static_cast<char>(value);
+	}
+	void PutVarint(std::uint64_t value)
+	{
+		PutVarint(m_tree, value);
+	}
+	//Zigzag encoded, for -1 depths and lines.
+	static void PutSigned(std::string& out, std::int64_t value)
+	{
+		PutVarint(out, (static_cast<std::uint64_t>(value) << 1) ^ static_cast<std::uint64_t>(value >> 63));
+	}
+	void PutSigned(std::int64_t value)
+	{
+		PutSigned(m_tree, value);
+	}
+	void PutKind(Kind kind)
+	{
+		Put(kind);
+	}
+	//Every distinct string is stored once and referenced by its id.
+	std::uint32_t StringId(std::string_view text)
+	{
+		auto [it, inserted] = m_string_ids.try_emplace(text, static_cast<std::uint32_t>(m_string_spans.size()));
+		if (inserted)
+		{
+			m_string_spans.emplace_back(static_cast<std::uint32_t>(m_strings.size()), static_cast<std::uint32_t>(text.size()));
+			m_strings += text;
+		}
+		return it->second;
+	}
+	void PutString(std::string& out, std::string_view text)
+	{
+		PutVarint(out, StringId(text));
+	}
+	//name is an interned string
+	void PutName(std::string& out, const Value& name)
+	{
+		auto [it, inserted] = m_name_ids.try_emplace(name.As<ObjString>(), 0);
+		if (inserted)
+			it->second = StringId(name.AsString());
+		PutVarint(out, it->second);
+	}
+	void PutValue(std::string& out, const Value& value);
+	void PutToken(const Token& token);
+	void PutSlot(const ast::LocalSlot& slot)
+	{
+		PutSigned(slot.m_depth);
+		PutSigned(slot.m_slot);
+	}
+	void PutExpr(const ast::expr::Expr* expr);
+	void PutStmt(const ast::stmt::Stmt* stmt);
+	template<class T>
+	void PutStmts(std::span<const T* const> statements)
+	{
+		PutVarint(statements.size());
+		for (const auto* statement : statements)
+			PutStmt(statement);
+	}
+
+	ast::Completion Visit(const ast::stmt::Block& val) override;
+	ast::Completion Visit(const ast::stmt::Class& val) override;
+	ast::Completion Visit(const ast::stmt::Expression& val) override;
+	ast::Completion Visit(const ast::stmt::Function& val) override;
+	ast::Completion Visit(const ast::stmt::If& val) override;
+	ast::Completion Visit(const ast::stmt::Print& val) override;
+	ast::Completion Visit(const ast::stmt::Return& val) override;
+	ast::Completion Visit(const ast::stmt::Var& val) override;
+	ast::Completion Visit(const ast::stmt::While& val) override;
+
+	Value Visit(const ast::expr::Assign& val) override;
+	Value Visit(const ast::expr::Binary& val) override;
+	Value Visit(const ast::expr::Call& val) override;
+	Value Visit(const ast::expr::Get& val) override;
+	Value Visit(const ast::expr::Grouping& val) override;
+	Value Visit(const ast::expr::Logical& val) override;
+	Value Visit(const ast::expr::Set& val) override;
+	Value Visit(const ast::expr::Literal& val) override;
+	Value Visit(const ast::expr::Super& val) override;
+	Value Visit(const ast::expr::This& val) override;
+	Value Visit(const ast::expr::Unary& val) override;
+	Value Visit(const ast::expr::Variable& val) override;
+};
+
+std::string Writer::Write(std::string_view source)
+{
+	PutStmts(m_program.Statements());
+	std::string body;
+	Put(body, Hash(source));
+	Put(body, static_cast<std::uint64_t>(source.size()));
+	Put(body, m_token_count);
+	Put(body, static_cast<std::uint32_t>(m_string_spans.size()));
+	const auto header_size = sizeof(MAGIC) + sizeof(FORMAT_VERSION) + sizeof(std::uint64_t) + body.size() + sizeof(std::uint64_t);
+	Put(body, static_cast<std::uint64_t>(header_size + m_tokens.size() + m_tree.size()));
+	body += m_tokens;
+	body += m_tree;
+	for (const auto& [offset, size] : m_string_spans)
+	{
+		Put(body, offset);
+		Put(body, size);
+	}
+	body += m_strings;
+
+	std::string res;
+	res.reserve(header_size + body.size());
+	res.append(MAGIC, sizeof(MAGIC));
+	Put(res, FORMAT_VERSION);
+	Put(res, Checksum(body));
+	res += body;
+	return res;
+}
+
+void Writer::PutValue(std::string& out, const Value& value)
+{
+	if (value.IsNil())
+		Put(out, ValueKind::NIL);
+	else if (value.IsBool())
+		Put(out, value.AsBool() ? ValueKind::BOOL_TRUE : ValueKind::BOOL_FALSE);
+	else if (value.IsNumber())
+	{
+		Put(out, ValueKind::NUMBER);
+		Put(out, value.AsNumber());
+	}
+	else if (value.IsString())
+	{
+		Put(out, ValueKind::STRING);
+		PutName(out, value);
+	}
+	else
+		throw std::runtime_error("can`t cache a value of this type: " + Stringify(value));
+}
+
+//Tokens are written to the table the first time the tree references them.
+void Writer::PutToken(const Token& token)
+{
+	const auto& tokens = m_program.Tokens();
+	if (tokens.empty() || &token < tokens.data() || &token > &tokens.back())
+		throw std::runtime_error("can`t cache a token the Program does not own");
+	auto& index = m_token_indices[&token - tokens.data()];
+	if (index == NO_INDEX)
+	{
+		index = m_token_count++;
+		Put(m_tokens, static_cast<std::uint8_t>(token.m_type));
+		PutSigned(m_tokens, token.m_line);
+		const auto& literal = token.m_literal;
+		const bool is_name = literal.IsString() && literal.AsString() == token.m_lexeme;
+		Put(m_tokens, static_cast<std::uint8_t>(is_name));
+		if (is_name)
+			PutName(m_tokens, literal);
+		else
+		{
+			PutString(m_tokens, token.m_lexeme);
+			PutValue(m_tokens, literal);
+		}
+	}
+	PutVarint(index);
+}
+
+void Writer::PutExpr(const ast::expr::Expr* expr)
+{
+	if (expr)
+		expr->Accept(*this);
+	else
+		PutKind(Kind::NONE);
+}
+
+void Writer::PutStmt(const ast::stmt::Stmt* stmt)
+{
+	if (!stmt)
+	{
+		PutKind(Kind::NONE);
+		return;
+	}
+	stmt->Accept(*this);
+}
+
+ast::Completion Writer::Visit(const ast::stmt::Block& val)
+{
+	PutKind(Kind::BLOCK);
+	PutSigned(val.line);
+	PutStmts(val.statements);
+	return {};
+}
+
+ast::Completion Writer::Visit(const ast::stmt::Class& val)
+{
+	PutKind(Kind::CLASS);
+	PutSigned(val.line);
+	PutToken(val.name);
+	PutExpr(val.superclass);
+	PutStmts(val.methods);
+	return {};
+}
+
+ast::Completion Writer::Visit(const ast::stmt::Expression& val)
+{
+	PutKind(Kind::EXPRESSION);
+	PutSigned(val.line);
+	PutExpr(val.expression);
+	return {};
+}
+
+ast::Completion Writer::Visit(const ast::stmt::Function& val)
+{
+	PutKind(Kind::FUNCTION);
+	PutSigned(val.line);
+	PutToken(val.name);
+	PutVarint(val.params.size());
+	for (const auto* param : val.params)
+		PutToken(*param);
+	PutStmts(val.body);
+	return {};
+}
+
+ast::Completion Writer::Visit(const ast::stmt::If& val)
+{
+	PutKind(Kind::IF);
+	PutSigned(val.line);
+	PutExpr(val.condition);
+	PutStmt(val.then_branch);
+	PutStmt(val.else_branch);
+	return {};
+}
+
+ast::Completion Writer::Visit(const ast::stmt::Print& val)
+{
+	PutKind(Kind::PRINT);
+	PutSigned(val.line);
+	PutExpr(val.expression);
+	return {};
+}
+
+ast::Completion Writer::Visit(const ast::stmt::Return& val)
+{
+	PutKind(Kind::RETURN);
+	PutSigned(val.line);
+	PutToken(val.keyword);
+	PutExpr(val.value);
+	return {};
+}
+
+ast::Completion Writer::Visit(const ast::stmt::Var& val)
+{
+	PutKind(Kind::VAR);
+	PutSigned(val.line);
+	PutToken(val.name);
+	PutExpr(val.initializer);
+	return {};
+}
+
+ast::Completion Writer::Visit(const ast::stmt::While& val)
+{
+	PutKind(Kind::WHILE);
+	PutSigned(val.line);
+	PutExpr(val.condition);
+	PutStmt(val.body);
+	return {};
+}
+
+Value Writer::Visit(const ast::expr::Assign& val)
+{
+	PutKind(Kind::ASSIGN);
+	PutToken(val.name);
+	PutExpr(val.value);
+	PutSlot(val.slot);
+	return {};
+}
+
+Value Writer::Visit(const ast::expr::Binary& val)
+{
+	PutKind(Kind::BINARY);
+	PutExpr(val.left);
+	PutToken(val.op);
+	PutExpr(val.right);
+	return {};
+}
+
+Value Writer::Visit(const ast::expr::Call& val)
+{
+	PutKind(Kind::CALL);
+	PutExpr(val.callee);
+	PutToken(val.paren);
+	PutVarint(val.arguments.size());
+	for (const auto* argument : val.arguments)
+		PutExpr(argument);
+	//invoke is always the callee
+	Put(static_cast<std::uint8_t>(val.invoke != nullptr));
+	return {};
+}
+
+Value Writer::Visit(const ast::expr::Get& val)
+{
+	PutKind(Kind::GET);
+	PutExpr(val.object);
+	PutToken(val.name);
+	return {};
+}
+
+Value Writer::Visit(const ast::expr::Grouping& val)
+{
+	PutKind(Kind::GROUPING);
+	PutExpr(val.expression);
+	return {};
+}
+
+Value Writer::Visit(const ast::expr::Logical& val)
+{
+	PutKind(Kind::LOGICAL);
+	PutExpr(val.left);
+	PutToken(val.op);
+	PutExpr(val.right);
+	return {};
+}
+
+Value Writer::Visit(const ast::expr::Set& val)
+{
+	PutKind(Kind::SET);
+	PutExpr(val.object);
+	PutToken(val.name);
+	PutExpr(val.value);
+	return {};
+}
+
+Value Writer::Visit(const ast::expr::Literal& val)
+{
+	PutKind(Kind::LITERAL);
+	PutValue(m_tree, val.value);
+	return {};
+}
+
+Value Writer::Visit(const ast::expr::Super& val)
+{
+	PutKind(Kind::SUPER);
+	PutToken(val.keyword);
+	PutToken(val.method);
+	PutSlot(val.slot);
+	return {};
+}
+
+Value Writer::Visit(const ast::expr::This& val)
+{
+	PutKind(Kind::THIS);
+	PutToken(val.keyword);
+	PutSlot(val.slot);
+	return {};
+}
+
+Value Writer::Visit(const ast::expr::Unary& val)
+{
+	PutKind(Kind::UNARY);
+	PutToken(val.op);
+	PutExpr(val.right);
+	return {};
+}
+
+Value Writer::Visit(const ast::expr::Variable& val)
+{
+	PutKind(Kind::VARIABLE);
+	PutToken(val.name);
+	PutSlot(val.slot);
+	return {};
+}
+
+//Rebuilds the tree in a new Program, every read is bounds checked and a malformed cache throws.
+class Reader
+{
+	std::string_view m_data;
+	std::string_view m_strings;
+	std::string_view m_string_spans;
+	//String values by id, interned the first time they are read.
+	std::vector<Value> m_interned;
+	std::size_t m_pos = 0;
+	ast::Program* m_program = nullptr;
+	//Slots declared so far in each local scope the Resolver opened around the node being read,
+	//the innermost last. Resolved variables are checked against them, the Interpreter trusts them.
+	std::vector<int> m_scopes;
+public:
+	explicit Reader(std::string_view data)
+		: m_data(data)
+	{}
+	std::optional<ast::Program> Read(std::string_view source);
+private:
+	template<class T>
+	T Next()
+	{
+		if (m_data.size() - m_pos < sizeof(T))
+			throw std::runtime_error("truncated cache");
+		T res;
+		std::memcpy(&res, m_data.data() + m_pos, sizeof(T));
+		m_pos += sizeof(T);
+		return res;
+	}
+	std::uint64_t NextVarint()
+	{
+		std::uint64_t res = 0;
+		for (int shift = 0; shift < 64; shift += 7)
+		{
+			const auto byte = Next<std::uint8_t>();
+			res |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+			if (!(byte & 0x80))
+				return res;
+		}
+		throw std::runtime_error("malformed cache");
+	}
+	//Ids, indices and sizes
+	std::uint32_t NextIndex()
+	{
+		const auto res = NextVarint();
+		if (res > UINT32_MAX)
+			throw std::runtime_error("malformed cache");
+		return static_cast<std::uint32_t>(res);
+	}
+	int NextSigned()
+	{
+		const auto value = NextVarint();
+		return static_cast<int>(static_cast<std::int64_t>(value >> 1) ^ -static_cast<std::int64_t>(value & 1));
+	}
+	std::string_view GetString(std::uint32_t id);
+	//Interned string by id
+	const Value& GetName(std::uint32_t id);
+	Value GetValue();
+	const Token& GetToken();
+	ast::LocalSlot GetSlot()
+	{
+		ast::LocalSlot res;
+		res.m_depth = NextSigned();
+		res.m_slot = NextSigned();
+		if (res.IsGlobal())
+		{
+			if (res.m_depth != -1 || res.m_slot != 0)
+				throw std::runtime_error("malformed cache");
+			return res;
+		}
+		const auto scopes = static_cast<int>(m_scopes.size());
+		if (res.m_depth >= scopes || res.m_slot < 0 || res.m_slot >= m_scopes[scopes - 1 - res.m_depth])
+			throw std::runtime_error("malformed cache");
+		return res;
+	}
+	//A declaration takes the next slot of the innermost scope, at top level it is a global.
+	void Declare()
+	{
+		if (!m_scopes.empty())
+			++m_scopes.back();
+	}
+	ast::expr::ExprPtr GetExpr();
+	ast::stmt::StmtPtr GetStmt();
+	const ast::stmt::Function* GetFunction(bool is_method);
+	template<class T>
+	std::span<const T* const> GetList();
+	template<class T, class ...Args>
+	const T* New(Args&&... args)
+	{
+		return m_program->New<T>(std::forward<Args>(args)...);
+	}
+	template<class T>
+	static const T* As(const void* node)
+	{
+		if (!node)
+			throw std::runtime_error("malformed cache");
+		return static_cast<const T*>(node);
+	}
+};
+
+std::optional<ast::Program> Reader::Read(std::string_view source)
+{
+	if (m_data.size() < sizeof(MAGIC) || std::memcmp(m_data.data(), MAGIC, sizeof(MAGIC)) != 0)
+		return std::nullopt;
+	m_pos = sizeof(MAGIC);
+	if (Next<std::uint32_t>() != FORMAT_VERSION)
+		return std::nullopt;
+	const auto checksum = Next<std::uint64_t>();
+	if (checksum != Checksum(m_data.substr(m_pos)))
+		return std::nullopt;
+	const auto hash = Next<std::uint64_t>();
+	if (Next<std::uint64_t>() != source.size() || hash != Hash(source))
+		return std::nullopt;
+	const auto token_count = Next<std::uint32_t>();
+	const auto string_count = Next<std::uint32_t>();
+	const auto strings = Next<std::uint64_t>();
+	const auto spans_size = std::uint64_t{ string_count } * 2 * sizeof(std::uint32_t);
+	if (strings > m_data.size() || m_data.size() - strings < spans_size)
+		throw std::runtime_error("malformed cache");
+	m_string_spans = m_data.substr(strings, spans_size);
+	m_strings = m_data.substr(strings + spans_size);
+	m_data = m_data.substr(0, strings);
+	m_interned.resize(string_count);
+
+	std::vector<Token> tokens;
+	tokens.reserve(token_count);
+	for (std::uint32_t i = 0; i < token_count; ++i)
+	{
+		const auto type = static_cast<TokenType>(Next<std::uint8_t>());
+		if (type > TokenType::END_OF_FILE)
+			throw std::runtime_error("malformed cache");
+		const auto line = NextSigned();
+		if (Next<std::uint8_t>())
+		{
+			const auto id = NextIndex();
+			tokens.emplace_back(type, GetString(id), GetName(id), line);
+			continue;
+		}
+		const auto lexeme = GetString(NextIndex());
+		tokens.emplace_back(type, lexeme, GetValue(), line);
+	}
+	ast::Program program{ std::move(tokens) };
+	m_program = &program;
+	const auto statements = GetList<ast::stmt::Stmt>();
+	program.SetStatements(statements);
+	return program;
+}
+
+std::string_view Reader::GetString(std::uint32_t id)
+{
+	if (id >= m_interned.size())
+		throw std::runtime_error("malformed cache");
+	std::uint32_t span[2];
+	std::memcpy(span, m_string_spans.data() + id * sizeof(span), sizeof(span));
+	const auto [offset, size] = span;
+	if (offset > m_strings.size() || m_strings.size() - offset < size)
+		throw std::runtime_error("malformed cache");
+	return m_strings.substr(offset, size);
+}
+
+Value Reader::GetValue()
+{
+	switch (Next<ValueKind>())
+	{
+	case ValueKind::NIL:
+		return {};
+	case ValueKind::BOOL_FALSE:
+		return false;
+	case ValueKind::BOOL_TRUE:
+		return true;
+	case ValueKind::NUMBER:
+		return Next<double>();
+	case ValueKind::STRING:
+		return GetName(NextIndex());
+	}
+	throw std::runtime_error("malformed cache");
+}
+
+const Value& Reader::GetName(std::uint32_t id)
+{
+	auto& res = m_interned.at(id);
+	if (res.IsNil())
+		res = Intern(GetString(id));
+	return res;
+}
+
+const Token& Reader::GetToken()
+{
+	const auto index = NextIndex();
+	const auto& tokens = m_program->Tokens();
+	if (index >= tokens.size())
+		throw std::runtime_error("malformed cache");
+	return tokens[index];
+}
+
+template<class T>
+std::span<const T* const> Reader::GetList()
+{
+	const auto size = NextIndex();
+	std::vector<const T*> res;
+	res.reserve(std::min<std::size_t>(size, m_data.size() - m_pos));
+	for (std::uint32_t i = 0; i < size; ++i)
+	{
+		if constexpr (std::is_same_v<T, ast::expr::Expr>)
+			res.push_back(As<T>(GetExpr()));
+		else
+			res.push_back(As<T>(GetStmt()));
+	}
+	return m_program->List(res);
+}
+
+ast::expr::ExprPtr Reader::GetExpr()
+{
+	using namespace ast::expr;
+	switch (Next<Kind>())
+	{
+	case Kind::NONE:
+		return nullptr;
+	case Kind::ASSIGN:
+	{
+		const auto& name = GetToken();
+		const auto* value = As<Expr>(GetExpr());
+		const auto* res = New<Assign>(name, value);
+		res->slot = GetSlot();
+		return res;
+	}
+	case Kind::BINARY:
+	{
+		const auto* left = As<Expr>(GetExpr());
+		const auto& op = GetToken();
+		return New<Binary>(left, op, As<Expr>(GetExpr()));
+	}
+	case Kind::CALL:
+	{
+		const auto* callee = As<Expr>(GetExpr());
+		const auto& paren = GetToken();
+		const auto arguments = GetList<Expr>();
+		const auto* invoke = Next<std::uint8_t>() ? As<ast::expr::Get>(dynamic_cast<const ast::expr::Get*>(callee)) : nullptr;
+		return New<Call>(callee, paren, arguments, invoke);
+	}
+	case Kind::GET:
+	{
+		const auto* object = As<Expr>(GetExpr());
+		return New<ast::expr::Get>(object, GetToken());
+	}
+	case Kind::GROUPING:
+		return New<Grouping>(As<Expr>(GetExpr()));
+	case Kind::LOGICAL:
+	{
+		const auto* left = As<Expr>(GetExpr());
+		const auto& op = GetToken();
+		return New<Logical>(left, op, As<Expr>(GetExpr()));
+	}
+	case Kind::SET:
+	{
+		const auto* object = As<Expr>(GetExpr());
+		const auto& name = GetToken();
+		return New<Set>(object, name, As<Expr>(GetExpr()));
+	}
+	case Kind::LITERAL:
+		return New<Literal>(m_program->Constant(GetValue()));
+	case Kind::SUPER:
+	{
+		const auto& keyword = GetToken();
+		const auto* res = New<Super>(keyword, GetToken());
+		res->slot = GetSlot();
+		return res;
+	}
+	case Kind::THIS:
+	{
+		const auto* res = New<This>(GetToken());
+		res->slot = GetSlot();
+		return res;
+	}
+	case Kind::UNARY:
+	{
+		const auto& op = GetToken();
+		return New<Unary>(op, As<Expr>(GetExpr()));
+	}
+	case Kind::VARIABLE:
+	{
+		const auto* res = New<Variable>(GetToken());
+		res->slot = GetSlot();
+		return res;
+	}
+	}
+	throw std::runtime_error("malformed cache");
+}
+
+ast::stmt::StmtPtr Reader::GetStmt()
+{
+	using namespace ast::stmt;
+	const auto kind = Next<Kind>();
+	if (kind == Kind::NONE)
+		return nullptr;
+	const auto line = NextSigned();
+	const Stmt* res = nullptr;
+	switch (kind)
+	{
+	case Kind::BLOCK:
+	{
+		m_scopes.push_back(0);
+		res = New<Block>(GetList<Stmt>());
+		m_scopes.pop_back();
+		break;
+	}
+	case Kind::CLASS:
+	{
+		const auto& name = GetToken();
+		Declare();
+		const auto* superclass = GetExpr();
+		const auto* variable = dynamic_cast<const ast::expr::Variable*>(superclass);
+		if (superclass && !variable)
+			throw std::runtime_error("malformed cache");
+		//The methods of a subclass see super in a scope of its own.
+		if (variable)
+			m_scopes.push_back(1);
+		std::vector<const Function*> methods(NextIndex());
+		for (auto& method : methods)
+		{
+			if (Next<Kind>() != Kind::FUNCTION)
+				throw std::runtime_error("malformed cache");
+			const auto method_line = NextSigned();
+			method = GetFunction(true);
+			method->line = method_line;
+		}
+		if (variable)
+			m_scopes.pop_back();
+		res = New<Class>(name, variable, m_program->List(methods));
+		break;
+	}
+	case Kind::EXPRESSION:
+		res = New<Expression>(As<ast::expr::Expr>(GetExpr()));
+		break;
+	case Kind::FUNCTION:
+		res = GetFunction(false);
+		break;
+	case Kind::IF:
+	{
+		const auto* condition = As<ast::expr::Expr>(GetExpr());
+		const auto* then_branch = As<Stmt>(GetStmt());
+		res = New<If>(condition, then_branch, GetStmt());
+		break;
+	}
+	case Kind::PRINT:
+		res = New<Print>(As<ast::expr::Expr>(GetExpr()));
+		break;
+	case Kind::RETURN:
+	{
+		const auto& keyword = GetToken();
+		res = New<Return>(keyword, GetExpr());
+		break;
+	}
+	case Kind::VAR:
+	{
+		//The variable is only readable once it is initialized.
+		const auto& name = GetToken();
+		const auto* initializer = GetExpr();
+		Declare();
+		res = New<Var>(name, initializer);
+		break;
+	}
+	case Kind::WHILE:
+	{
+		const auto* condition = As<ast::expr::Expr>(GetExpr());
+		res = New<While>(condition, As<Stmt>(GetStmt()));
+		break;
+	}
+	default:
+		throw std::runtime_error("malformed cache");
+	}
+	res->line = line;
+	return res;
+}
+
+//A function declares its name, a method does not. Its scope starts with this (methods) and the parameters.
+const ast::stmt::Function* Reader::GetFunction(bool is_method)
+{
+	const auto& name = GetToken();
+	if (!is_method)
+		Declare();
+	std::vector<const Token*> params(NextIndex());
+	for (auto& param : params)
+		param = &GetToken();
+	const auto params_list = m_program->List(params);
+	m_scopes.push_back(static_cast<int>(params.size()) + is_method);
+	const auto body = GetList<ast::stmt::Stmt>();
+	m_scopes.pop_back();
+	return New<ast::stmt::Function>(name, params_list, body);
+}
+
+std::filesystem::path CachePath(const std::filesystem::path& script)
+{
+	auto res = script;
+	res.replace_extension(".loxc");
+	return res;
+}
+
+std::optional<ast::Program> LoadProgram(std::string_view data, std::string_view source)
+{
+	try
+	{
+		return Reader{ data }.Read(source);
+	}
+	catch (const std::exception&)
+	{
+		return std::nullopt;
+	}
+}
+
+std::string SerializeProgram(const ast::Program& program, std::string_view source)
+{
+	return Writer{ program }.Write(source);
+}
+
+void StoreProgram(const std::filesystem::path& path, const ast::Program& program, std::string_view source)
+{
+	try
+	{
+		StoreProgram(path, SerializeProgram(program, source));
+	}
+	catch (const std::exception&)
+	{
+	}
+}
+
+void StoreProgram(const std::filesystem::path& path, std::string_view data)
+{
+	try
+	{
+		//Written aside and renamed, so a concurrent run never maps a partial file.
+		auto temp = path;
+		temp += ".tmp";
+		{
+			std::ofstream file{ temp, std::ios::binary | std::ios::trunc };
+			if (!file.write(data.data(), data.size()))
+				return;
+		}
+		std::filesystem::rename(temp, path);
+	}
+	catch (const std::exception&)
+	{
+	}
+}
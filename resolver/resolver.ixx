@@ -2,12 +2,16 @@ export module resolver;
 
 import ast;
 import core;
+import lexer;
 import log;
-import interpreter;
+import parser;
+import value;
 
 
 import <vector>;
+import <span>;
 import <string>;
+import <string_view>;
 import <unordered_map>;
 
 enum class FunctionType
@@ -26,63 +30,77 @@ enum class ClassType
 
 export class Resolver : ast::expr::VisitorExpr, ast::stmt::VisitorStmt
 {
-	Interpreter& m_interpreter;
-	std::vector<std::unordered_map<std::string, bool>> m_scopes;
+	struct Local
+	{
+		bool m_is_defined = false;
+		int m_slot = 0;
+	};
+	//Every declaration takes the next slot of its scope, the Interpreter defines
+	//locals in the same order, so a variable is found by (depth, slot) at runtime.
+	//The result is stored in the node itself, variables left unresolved are globals.
+	struct Scope
+	{
+		StringMap<Local> m_locals;
+		int m_slot_count = 0;
+	};
+	std::vector<Scope> m_scopes;
 	FunctionType m_current_function_type = FunctionType::NONE;
 	ClassType m_current_class_type = ClassType::NONE;
 
 public:
-	explicit Resolver(Interpreter& interpreter);
-	void Resolve(const std::vector<ast::stmt::StmtPtr>& statements);
+	void Resolve(std::span<const ast::stmt::StmtPtr> statements);
 private:
-	std::any Visit(const ast::stmt::Expression& val) override;
-	std::any Visit(const ast::stmt::Function& val) override;
-	std::any Visit(const ast::stmt::If& val) override;
-	std::any Visit(const ast::stmt::Print& val) override;
-	std::any Visit(const ast::stmt::Return& val) override;
-	std::any Visit(const ast::stmt::Var& val) override;
-	std::any Visit(const ast::stmt::While& val) override;
-	std::any Visit(const ast::stmt::Block& val) override;
-	std::any Visit(const ast::stmt::Class& val) override;
-
-	std::any Visit(const ast::expr::Assign& val) override;
-	std::any Visit(const ast::expr::Variable& val) override;
-	std::any Visit(const ast::expr::Binary& val) override;
-	std::any Visit(const ast::expr::Call& val) override;
-	std::any Visit(const ast::expr::Get& val) override;
-	std::any Visit(const ast::expr::Grouping& val) override;
-	std::any Visit(const ast::expr::Literal& val) override;
-	std::any Visit(const ast::expr::Logical& val) override;
-	std::any Visit(const ast::expr::Set& val) override;
-	std::any Visit(const ast::expr::Super& val) override;
-	std::any Visit(const ast::expr::This& val) override;
-	std::any Visit(const ast::expr::Unary& val) override;
+	ast::Completion Visit(const ast::stmt::Expression& val) override;
+	ast::Completion Visit(const ast::stmt::Function& val) override;
+	ast::Completion Visit(const ast::stmt::If& val) override;
+	ast::Completion Visit(const ast::stmt::Print& val) override;
+	ast::Completion Visit(const ast::stmt::Return& val) override;
+	ast::Completion Visit(const ast::stmt::Var& val) override;
+	ast::Completion Visit(const ast::stmt::While& val) override;
+	ast::Completion Visit(const ast::stmt::Block& val) override;
+	ast::Completion Visit(const ast::stmt::Class& val) override;
+
+	Value Visit(const ast::expr::Assign& val) override;
+	Value Visit(const ast::expr::Variable& val) override;
+	Value Visit(const ast::expr::Binary& val) override;
+	Value Visit(const ast::expr::Call& val) override;
+	Value Visit(const ast::expr::Get& val) override;
+	Value Visit(const ast::expr::Grouping& val) override;
+	Value Visit(const ast::expr::Literal& val) override;
+	Value Visit(const ast::expr::Logical& val) override;
+	Value Visit(const ast::expr::Set& val) override;
+	Value Visit(const ast::expr::Super& val) override;
+	Value Visit(const ast::expr::This& val) override;
+	Value Visit(const ast::expr::Unary& val) override;
 
 	void BeginScope();
 	void EndScope();
 	void Declare(const Token& name);
 	void Define(const Token& name);
-	void ResolveLocal(const ast::expr::Expr& expr, const Token& name);
+	void Define(Ref<ObjString> name);
+	void ResolveLocal(ast::LocalSlot& slot, const Token& name);
 
 	void Resolve(const ast::stmt::Stmt& statement);
 	void Resolve(const ast::expr::Expr& expr);
 	void ResolveFunction(const ast::stmt::Function& function, FunctionType type);
 };
 
+//Lexes, parses and resolves source, the front end every driver runs before its backend.
+//Errors are reported to the current isolate (HasError), the Program is only resolved without them.
+//Tokens and the AST point into source, it has to outlive the returned Program.
+//line is the line source starts on when it is a part of a script.
+export ast::Program Compile(std::string_view source, int line = 1);
 
-module :private;
 
-Resolver::Resolver(Interpreter& interpreter)
-	: m_interpreter(interpreter)
-{}
+module :private;
 
-std::any Resolver::Visit(const ast::stmt::Expression& val)
+ast::Completion Resolver::Visit(const ast::stmt::Expression& val)
 {
 	Resolve(*val.expression);
 	return {};
 }
 
-std::any Resolver::Visit(const ast::stmt::Function & val)
+ast::Completion Resolver::Visit(const ast::stmt::Function & val)
 {
 	//Declare(val.name);
 	Define(val.name);
@@ -90,7 +108,7 @@ std::any Resolver::Visit(const ast::stmt::Function & val)
 	return {};
 }
 
-std::any Resolver::Visit(const ast::stmt::If& val)
+ast::Completion Resolver::Visit(const ast::stmt::If& val)
 {
 	Resolve(*val.condition);
 	Resolve(*val.then_branch);
@@ -99,13 +117,13 @@ std::any Resolver::Visit(const ast::stmt::If& val)
 	return {};
 }
 
-std::any Resolver::Visit(const ast::stmt::Print& val)
+ast::Completion Resolver::Visit(const ast::stmt::Print& val)
 {
 	Resolve(*val.expression);
 	return {};
 }
 
-std::any Resolver::Visit(const ast::stmt::Return& val)
+ast::Completion Resolver::Visit(const ast::stmt::Return& val)
 {
 	if (m_current_function_type == FunctionType::NONE)
 		Error(val.keyword, "Can't return form top-level code.");
@@ -118,7 +136,7 @@ std::any Resolver::Visit(const ast::stmt::Return& val)
 	return {};
 }
 
-std::any Resolver::Visit(const ast::stmt::Var& val)
+ast::Completion Resolver::Visit(const ast::stmt::Var& val)
 {
 	Declare(val.name);
 	if (val.initializer)
@@ -127,14 +145,14 @@ std::any Resolver::Visit(const ast::stmt::Var& val)
 	return {};
 }
 
-std::any Resolver::Visit(const ast::stmt::While& val)
+ast::Completion Resolver::Visit(const ast::stmt::While& val)
 {
 	Resolve(*val.condition);
 	Resolve(*val.body);
 	return {};
 }
 
-std::any Resolver::Visit(const ast::stmt::Block& val)
+ast::Completion Resolver::Visit(const ast::stmt::Block& val)
 {
 	BeginScope();
 	Resolve(val.statements);
@@ -142,7 +160,7 @@ std::any Resolver::Visit(const ast::stmt::Block& val)
 	return {};
 }
 
-std::any Resolver::Visit(const ast::stmt::Class& val)
+ast::Completion Resolver::Visit(const ast::stmt::Class& val)
 {
 	auto enclosing_class = m_current_class_type;
 	m_current_class_type = ClassType::CLASS;
@@ -159,10 +177,8 @@ std::any Resolver::Visit(const ast::stmt::Class& val)
 	if (val.superclass)
 	{
 		BeginScope();
-		m_scopes.back()["super"] = true;
+		Define(Intern("super"));
 	}
-	BeginScope();
-	m_scopes.back()["this"] = true;
 	for (const auto& method : val.methods)
 	{
 		auto declaration = FunctionType::METHOD;
@@ -170,43 +186,42 @@ std::any Resolver::Visit(const ast::stmt::Class& val)
 			declaration = FunctionType::INITIALIZER;
 		ResolveFunction(*method, declaration);
 	}
-	EndScope();
 	if (val.superclass)
 		EndScope();
 	m_current_class_type = enclosing_class;
 	return {};
 }
 
-std::any Resolver::Visit(const ast::expr::Assign& val)
+Value Resolver::Visit(const ast::expr::Assign& val)
 {
 	Resolve(*val.value);
-	ResolveLocal(val, val.name);
+	ResolveLocal(val.slot, val.name);
 	return {};
 }
 
-std::any Resolver::Visit(const ast::expr::Variable& val)
+Value Resolver::Visit(const ast::expr::Variable& val)
 {
 	if (!m_scopes.empty())
 	{
-		const auto& scope = m_scopes.back();
-		const auto it = scope.find(val.name.m_lexeme);
-		if (it != std::end(scope) && it->second == false)
+		const auto& scope = m_scopes.back().m_locals;
+		const auto it = scope.find(val.name.Name());
+		if (it != std::end(scope) && !it->second.m_is_defined)
 		{
 			Error(val.name, "Can't read local variable in its own initializer.");
 		}
 	}
-	ResolveLocal(val, val.name);
+	ResolveLocal(val.slot, val.name);
 	return {};
 }
 
-std::any Resolver::Visit(const ast::expr::Binary& val)
+Value Resolver::Visit(const ast::expr::Binary& val)
 {
 	Resolve(*val.right);
 	Resolve(*val.left);
 	return {};
 }
 
-std::any Resolver::Visit(const ast::expr::Call& val)
+Value Resolver::Visit(const ast::expr::Call& val)
 {
 	Resolve(*val.callee);
 	for (const auto& argument : val.arguments)
@@ -214,38 +229,38 @@ std::any Resolver::Visit(const ast::expr::Call& val)
 	return {};
 }
 
-std::any Resolver::Visit(const ast::expr::Get& val)
+Value Resolver::Visit(const ast::expr::Get& val)
 {
 	Resolve(*val.object);
 	return {};
 }
 
-std::any Resolver::Visit(const ast::expr::Grouping& val)
+Value Resolver::Visit(const ast::expr::Grouping& val)
 {
 	Resolve(*val.expression);
 	return {};
 }
 
-std::any Resolver::Visit(const ast::expr::Literal& val)
+Value Resolver::Visit(const ast::expr::Literal& val)
 {
 	return {};
 }
 
-std::any Resolver::Visit(const ast::expr::Logical& val)
+Value Resolver::Visit(const ast::expr::Logical& val)
 {
 	Resolve(*val.left);
 	Resolve(*val.right);
 	return {};
 }
 
-std::any Resolver::Visit(const ast::expr::Set& val)
+Value Resolver::Visit(const ast::expr::Set& val)
 {
 	Resolve(*val.value);
 	Resolve(*val.object);
 	return {};
 }
 
-std::any Resolver::Visit(const ast::expr::Super& val)
+Value Resolver::Visit(const ast::expr::Super& val)
 {
 	if (m_current_class_type == ClassType::NONE)
 	{
@@ -255,22 +270,22 @@ std::any Resolver::Visit(const ast::expr::Super& val)
 	{
 		Error(val.keyword, "Can't use 'super' in a class with no superclass.");
 	}
-	ResolveLocal(val, val.keyword);
+	ResolveLocal(val.slot, val.keyword);
 	return {};
 }
 
-std::any Resolver::Visit(const ast::expr::This& val)
+Value Resolver::Visit(const ast::expr::This& val)
 {
 	if (m_current_class_type == ClassType::NONE)
 	{
 		Error(val.keyword, "Can't use 'this' outside of a class.");
 		return {};
 	}
-	ResolveLocal(val, val.keyword);
+	ResolveLocal(val.slot, val.keyword);
 	return {};
 }
 
-std::any Resolver::Visit(const ast::expr::Unary& val)
+Value Resolver::Visit(const ast::expr::Unary& val)
 {
 	Resolve(*val.right);
 	return {};
@@ -291,32 +306,47 @@ void Resolver::Declare(const Token& name)
 	if (m_scopes.empty())
 		return;
 	auto& scope = m_scopes.back();
-	const auto emplace_res = scope.emplace(name.m_lexeme, false);
+	const auto emplace_res = scope.m_locals.emplace(Ref<ObjString>(name.Name()), Local{ false, scope.m_slot_count });
 	if (!emplace_res.second)
 		Error(name, "Already a variable with this name in this scope.");
+	else
+		++scope.m_slot_count;
 }
 
 void Resolver::Define(const Token& name)
+{
+	Define(Ref<ObjString>(name.Name()));
+}
+
+void Resolver::Define(Ref<ObjString> name)
 {
 	if (m_scopes.empty())
 		return;
-	m_scopes.back()[name.m_lexeme] = true;
+	auto& scope = m_scopes.back();
+	const auto [it, inserted] = scope.m_locals.try_emplace(std::move(name));
+	auto& local = it->second;
+	//Declared variables keep their slot, new names and redefinitions
+	//(functions and parameters are not declared first) take the next one.
+	if (inserted || local.m_is_defined)
+		local.m_slot = scope.m_slot_count++;
+	local.m_is_defined = true;
 }
 
-void Resolver::ResolveLocal(const ast::expr::Expr& expr, const Token& name)
+void Resolver::ResolveLocal(ast::LocalSlot& slot, const Token& name)
 {
 	for (int i = m_scopes.size() - 1; i >= 0; --i)
 	{
-		const auto& scope = m_scopes[i];
-		if (scope.find(name.m_lexeme) != std::end(scope))
+		const auto& scope = m_scopes[i].m_locals;
+		const auto it = scope.find(name.Name());
+		if (it != std::end(scope))
 		{
-			m_interpreter.Resolve(expr, m_scopes.size() - 1 - i);
+			slot = ast::LocalSlot{ static_cast<int>(m_scopes.size()) - 1 - i, it->second.m_slot };
 			return;
 		}
 	}
 }
 
-void Resolver::Resolve(const std::vector<ast::stmt::StmtPtr>& statements)
+void Resolver::Resolve(std::span<const ast::stmt::StmtPtr> statements)
 {
 	for (const auto& statement : statements)
 		Resolve(*statement);
@@ -332,15 +362,28 @@ void Resolver::Resolve(const ast::expr::Expr& expr)
 	expr.Accept(*this);
 }
 
+ast::Program Compile(std::string_view source, int line)
+{
+	Lexer lexer{ source, line };
+	Parser parser{ lexer.GetTokens() };
+	auto program = parser.Parse();
+	if (!HasError())
+		Resolver{}.Resolve(program.Statements());
+	return program;
+}
+
 void Resolver::ResolveFunction(const ast::stmt::Function& function, FunctionType type)
 {
 	auto enclosing_function = m_current_function_type;
 	m_current_function_type = type;
 	BeginScope();
+	//A method gets its receiver as the first slot of its own scope, so calling it needs no extra environment.
+	if (type == FunctionType::METHOD || type == FunctionType::INITIALIZER)
+		Define(Intern("this"));
 	for (const auto& param : function.params)
 	{
-		//Declare(param);
-		Define(param);
+		//Declare(*param);
+		Define(*param);
 	}
 	Resolve(function.body);
 	EndScope();
@@ -0,0 +1,114 @@
+module;
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+export module source;
+
+import <filesystem>;
+import <stdexcept>;
+import <string>;
+import <string_view>;
+import <utility>;
+
+//Read-only memory mapping of a script.
+//Tokens keep views into the text, so it has to outlive everything produced from it.
+export class SourceFile
+{
+	const char* m_data = nullptr;
+	std::size_t m_size = 0;
+#ifdef _WIN32
+	HANDLE m_file = INVALID_HANDLE_VALUE;
+	HANDLE m_mapping = nullptr;
+#endif
+public:
+	explicit SourceFile(const std::filesystem::path& path);
+	SourceFile(const SourceFile&) = delete;
+	SourceFile& operator=(const SourceFile&) = delete;
+	~SourceFile();
+
+	std::string_view Text() const
+	{
+		return { m_data, m_size };
+	}
+};
+
+module :private;
+
+#ifdef _WIN32
+
+SourceFile::SourceFile(const std::filesystem::path& path)
+{
+	m_file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (m_file == INVALID_HANDLE_VALUE)
+		throw std::runtime_error("can`t open file: " + path.string());
+	LARGE_INTEGER size{};
+	GetFileSizeEx(m_file, &size);
+	m_size = static_cast<std::size_t>(size.QuadPart);
+	//Mapping an empty file fails, there is nothing to read anyway.
+	if (m_size == 0)
+		return;
+	m_mapping = CreateFileMappingW(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (m_mapping)
+		m_data = static_cast<const char*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+	if (!m_data)
+	{
+		if (m_mapping)
+			CloseHandle(m_mapping);
+		CloseHandle(m_file);
+		throw std::runtime_error("can`t map file: " + path.string());
+	}
+}
+
+SourceFile::~SourceFile()
+{
+	if (m_data)
+		UnmapViewOfFile(m_data);
+	if (m_mapping)
+		CloseHandle(m_mapping);
+	CloseHandle(m_file);
+}
+
+#else
+
+SourceFile::SourceFile(const std::filesystem::path& path)
+{
+	const auto fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw std::runtime_error("can`t open file: " + path.string());
+	struct stat info {};
+	if (fstat(fd, &info) == 0)
+		m_size = static_cast<std::size_t>(info.st_size);
+	//Mapping an empty file fails, there is nothing to read anyway.
+	if (m_size != 0)
+	{
+		auto* data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data != MAP_FAILED)
+		{
+			//The lexer reads it front to back exactly once.
+			madvise(data, m_size, MADV_SEQUENTIAL);
+			m_data = static_cast<const char*>(data);
+		}
+	}
+	//The mapping stays valid after the descriptor is closed.
+	close(fd);
+	if (m_size != 0 && !m_data)
+		throw std::runtime_error("can`t map file: " + path.string());
+}
+
+SourceFile::~SourceFile()
+{
+	if (m_data)
+		munmap(const_cast<char*>(m_data), m_size);
+}
+
+#endif
@@ -1,6 +1,7 @@
 #include <array>
 #include <iostream>
 #include <fstream>
+#include <string>
 #include <string_view>
 #include <span>
 #include <ranges>
@@ -9,29 +10,125 @@
 
 constexpr std::string_view VERSION{ "1.0.0" };
 
-void DefineAST(std::ofstream& file, std::string_view base_name,
-	std::span<const std::string_view> members, bool add_expr_namespace = false);
+void DefineAST(std::ofstream& file, std::string_view base_name, std::string_view return_type,
+	std::span<const std::string_view> members, bool add_expr_namespace = false,
+	std::string_view base_fields = {});
 
 void WriteProlog(std::ofstream& file)
 {
 	file << "//This file was generated by ast_builder.exe v" << VERSION << '\n';
 	file << "export module ast;\n\n";
-	file << "import <any>;\n";
-	file << "import <memory>;\n";
+	file << "import <list>;\n";
+	file << "import <span>;\n";
+	file << "import <utility>;\n";
 	file << "import <vector>;\n\n";
-	file << "import core;\n\n";
+	file << "import arena;\n";
+	file << "import core;\n";
+	file << "import value;\n\n";
 	file << "export namespace ast\n";
+	file << "{\n\n";
+	file << "//Where the Resolver found a variable: how many scopes up and which slot in that scope.\n";
+	file << "struct LocalSlot\n";
 	file << "{\n";
+	file << "\tint m_depth = -1; //-1 until resolved, unresolved variables are globals\n";
+	file << "\tint m_slot = 0;\n";
+	file << "\tbool IsGlobal() const { return m_depth < 0; }\n";
+	file << "};\n\n";
+	file << "//How a statement finished. A return leaves its value with the Interpreter\n";
+	file << "//and unwinds the enclosing blocks and loops up to the function call.\n";
+	file << "enum class Completion\n";
+	file << "{\n";
+	file << "\tNORMAL,\n";
+	file << "\tRETURN,\n";
+	file << "};\n\n";
+	file << "//Polymorphic inline cache of a property access: the instance shapes seen at this site\n";
+	file << "//and what looking the name up in each of them gave. Shapes are opaque to the AST.\n";
+	file << "struct PropertyCache\n";
+	file << "{\n";
+	file << "\tstruct Entry\n";
+	file << "\t{\n";
+	file << "\t\tconst void* m_shape = nullptr;\n";
+	file << "\t\tconst void* m_next_shape = nullptr; //Set only: the shape after adding the field\n";
+	file << "\t\tint m_slot = -1; //-1 if the shape has no such field\n";
+	file << "\t};\n";
+	file << "\tstatic constexpr int SIZE = 4;\n";
+	file << "\tEntry m_entries[SIZE]{};\n";
+	file << "\tint m_next = 0; //Entry replaced on the next miss\n";
+	file << "\tconst Entry* Find(const void* shape) const\n";
+	file << "\t{\n";
+	file << "\t\tfor (const auto& entry : m_entries)\n";
+	file << "\t\t{\n";
+	file << "\t\t\tif (entry.m_shape == shape)\n";
+	file << "\t\t\t\treturn &entry;\n";
+	file << "\t\t}\n";
+	file << "\t\treturn nullptr;\n";
+	file << "\t}\n";
+	file << "\tconst Entry& Add(const Entry& entry)\n";
+	file << "\t{\n";
+	file << "\t\tauto& res = m_entries[m_next];\n";
+	file << "\t\tres = entry;\n";
+	file << "\t\tm_next = (m_next + 1) % SIZE;\n";
+	file << "\t\treturn res;\n";
+	file << "\t}\n";
+	file << "};\n";
 }
 
 void WriteEpilog(std::ofstream& file)
 {
+	file << "\n//Owns a parsed script: its tokens and the arena every node is allocated from.\n";
+	file << "//Nodes only hold non-owning pointers to each other and references to the tokens,\n";
+	file << "//so the whole tree is freed at once and must not outlive the Program.\n";
+	file << "class Program\n";
+	file << "{\n";
+	file << "\tstd::vector<Token> m_tokens;\n";
+	file << "\tArena m_arena;\n";
+	file << "\t//Values computed after parsing (e.g. folded constants), a list so Literals can reference them\n";
+	file << "\t//and a program without any (most declarations of a streamed script) allocates nothing for it.\n";
+	file << "\tstd::list<Value> m_constants;\n";
+	file << "\tstd::span<const stmt::StmtPtr> m_statements;\n";
+	file << "public:\n";
+	file << "\texplicit Program(std::vector<Token> tokens)\n";
+	file << "\t\t: m_tokens(std::move(tokens))\n";
+	file << "\t\t{}\n";
+	file << "\tProgram(Program&&) noexcept = default;\n";
+	file << "\tProgram& operator=(Program&&) noexcept = default;\n";
+	file << "\tconst std::vector<Token>& Tokens() const\n";
+	file << "\t{\n";
+	file << "\t\treturn m_tokens;\n";
+	file << "\t}\n";
+	file << "\ttemplate<class T, class ...Args>\n";
+	file << "\tconst T* New(Args&&... args)\n";
+	file << "\t{\n";
+	file << "\t\treturn m_arena.New<T>(std::forward<Args>(args)...);\n";
+	file << "\t}\n";
+	file << "\ttemplate<class T>\n";
+	file << "\tstd::span<const T> List(const std::vector<T>& values)\n";
+	file << "\t{\n";
+	file << "\t\treturn m_arena.Copy(values);\n";
+	file << "\t}\n";
+	file << "\tconst Value& Constant(Value value)\n";
+	file << "\t{\n";
+	file << "\t\treturn m_constants.emplace_back(std::move(value));\n";
+	file << "\t}\n";
+	file << "\tvoid SetStatements(std::span<const stmt::StmtPtr> statements)\n";
+	file << "\t{\n";
+	file << "\t\tm_statements = statements;\n";
+	file << "\t}\n";
+	file << "\tstd::span<const stmt::StmtPtr> Statements() const\n";
+	file << "\t{\n";
+	file << "\t\treturn m_statements;\n";
+	file << "\t}\n";
+	file << "\tstd::size_t BytesAllocated() const\n";
+	file << "\t{\n";
+	file << "\t\treturn m_arena.BytesAllocated();\n";
+	file << "\t}\n";
+	file << "};\n\n";
 	file << "}//namespace ast\n";
 }
 
 int main(int argc, char** argv)
 {
-	const auto path = "C:/Users/Eduard/Desktop/my_int/ast/ast.ixx";
+	const auto path = argc > 1 ? argv[1] : "C:/Users/Eduard/Desktop/my_int/ast/ast.ixx";
 	std::ofstream file { path };
 	if (!file.is_open())
 	{
@@ -40,45 +137,49 @@ int main(int argc, char** argv)
 	}
 	WriteProlog(file);
 	file << "\nnamespace expr \n{\n\n";
-	DefineAST(file, "Expr", {{
-		"Assign   ^Token-name,Expr-value",
+	DefineAST(file, "Expr", "Value", {{
+		"Assign   ^Token-name,Expr-value^LocalSlot-slot",
 		"Binary   ^Expr-left,Token-op,Expr-right",
-		"Call     ^Expr-callee,Token-paren,std::vector<ExprPtr>-arguments",
-		"Get      ^Expr-object,Token-name",
+		"Call     ^Expr-callee,Token-paren,List<Expr>-arguments,Get-invoke",
+		"Get      ^Expr-object,Token-name^PropertyCache-cache",
 		"Grouping ^Expr-expression",
 		"Logical  ^Expr-left,Token-op,Expr-right",
-		"Set      ^Expr-object,Token-name,Expr-value",
-		"Literal  ^LiteralT-value",
-		"Super    ^Token-keyword,Token-method",
-		"This     ^Token-keyword",
+		"Set      ^Expr-object,Token-name,Expr-value^PropertyCache-cache",
+		"Literal  ^Value-value",
+		"Super    ^Token-keyword,Token-method^LocalSlot-slot",
+		"This     ^Token-keyword^LocalSlot-slot",
 		"Unary    ^Token-op,Expr-right",
-		"Variable ^Token-name"
+		"Variable ^Token-name^LocalSlot-slot"
 		} } );
 	file << "\n} //namespace expr\n";
 	file << "\nnamespace stmt \n{\n\n";
-	DefineAST(file, "Stmt", { {
-		"Block      ^std::vector<StmtPtr>-statements",
-		"Class      ^Token-name,std::unique_ptr<expr::Variable>-superclass,std::vector<std::unique_ptr<Function>>-methods",
+	DefineAST(file, "Stmt", "Completion", { {
+		"Block      ^List<Stmt>-statements",
+		"Class      ^Token-name,expr::Variable-superclass,List<Function>-methods",
 		"Expression ^Expr-expression",
-		"Function   ^Token-name,std::vector<Token>-params,std::vector<StmtPtr>-body",
-		"If         ^Expr-condition,StmtPtr-then_branch,StmtPtr-else_branch",
+		"Function   ^Token-name,List<Token>-params,List<Stmt>-body",
+		"If         ^Expr-condition,Stmt-then_branch,Stmt-else_branch",
 		"Print      ^Expr-expression",
 		"Return     ^Token-keyword,Expr-value",
 		"Var        ^Token-name,Expr-initializer",
-		"While      ^Expr-condition,StmtPtr-body"
-		} }, true);
+		"While      ^Expr-condition,Stmt-body"
+		} }, true,
+		"\t//First line of the statement, set by the Parser for runtime reports.\n"
+		"\tmutable int line = 0;\n");
 	file << "\n} //namespace stmt\n";
 	WriteEpilog(file);
 	return 0;
 }
 
-void DefineType(std::ostream& file, std::string_view base_name,
-	std::string_view struct_name, std::string_view fiends, bool add_expr_namespace = false);
-void DefineVisitor(std::ofstream& file, std::span<std::string_view> types, std::string_view base_name);
+void DefineType(std::ostream& file, std::string_view base_name, std::string_view return_type,
+	std::string_view struct_name, std::string_view fiends, std::string_view mutable_fields,
+	bool add_expr_namespace = false);
+void DefineVisitor(std::ofstream& file, std::span<std::string_view> types,
+	std::string_view base_name, std::string_view return_type);
 void ForwardDeclareTypes(std::ofstream& file, std::span<std::string_view> types);
 
-void DefineAST(std::ofstream& file, std::string_view base_name,
-	std::span<const std::string_view> members, bool add_expr_namespace)
+void DefineAST(std::ofstream& file, std::string_view base_name, std::string_view return_type,
+	std::span<const std::string_view> members, bool add_expr_namespace, std::string_view base_fields)
 {
 	std::vector<std::string_view> types;
 	std::stringstream ss;
@@ -93,17 +194,23 @@ void DefineAST(std::ofstream& file, std::string_view base_name,
 			views.emplace_back(view);
 		}
 			
-		if (views.size() == 2)
-			DefineType(ss, base_name, views[0], views[1], add_expr_namespace);
+		//An optional third part lists fields filled in after parsing (e.g. by the Resolver).
+		if (views.size() == 2 || views.size() == 3)
+			DefineType(ss, base_name, return_type, views[0], views[1],
+				views.size() == 3 ? views[2] : std::string_view{}, add_expr_namespace);
 	}
 	ForwardDeclareTypes(file, types);
-	DefineVisitor(file, types, base_name);
+	DefineVisitor(file, types, base_name, return_type);
+	//Nodes are never deleted through a base pointer (the arena drops them all at once),
+	//so the destructor is protected and trivial.
 	file << "struct " << base_name
 		<< "\n{\n"
-		<< "\tvirtual ~" << base_name << "() = default;\n"
-		<< "\tvirtual std::any Accept(Visitor" << base_name << "& visitor) const = 0;\n"
+		<< "\tvirtual " << return_type << " Accept(Visitor" << base_name << "& visitor) const = 0;\n"
+		<< base_fields
+		<< "protected:\n"
+		<< "\t~" << base_name << "() = default;\n"
 		<< "};\n\n"
-		<< "using " << base_name << "Ptr = std::unique_ptr<" << base_name << ">; \n\n";
+		<< "using " << base_name << "Ptr = const " << base_name << "*; \n\n";
 	file << ss.str();
 }
 
@@ -114,20 +221,44 @@ void ForwardDeclareTypes(std::ofstream& file, std::span<std::string_view> types)
 	file << '\n';
 }
 
-void DefineVisitor(std::ofstream& file, std::span<std::string_view> types, std::string_view base_name)
+void DefineVisitor(std::ofstream& file, std::span<std::string_view> types,
+	std::string_view base_name, std::string_view return_type)
 {
 	file << "struct Visitor" << base_name << "\n"
 		<< "{\n"
 		<< "\tvirtual ~Visitor" << base_name << "() = default;\n";
 	for (const auto& type : types)
 	{
-		file << "\tvirtual std::any Visit(const " << type << "& val) = 0;\n";
+		file << "\tvirtual " << return_type << " Visit(const " << type << "& val) = 0;\n";
 	}
 	file << "};\n";
 }
 
-void DefineType(std::ostream& file, std::string_view base_name,
-	std::string_view struct_name, std::string_view fiends, bool add_expr_namespace)
+//Tokens and literal values are owned by the Program and referenced,
+//child nodes are non-owning pointers and lists of them are spans, all allocated from the Program arena.
+std::string FieldType(std::string_view type, bool add_expr_namespace)
+{
+	const auto node_type = [&](std::string_view node)
+	{
+		if (add_expr_namespace && node == "Expr")
+			return "expr::" + std::string(node);
+		return std::string(node);
+	};
+	if (type == "Token" || type == "Value")
+		return "const " + std::string(type) + "&";
+	constexpr std::string_view list{ "List<" };
+	if (type.starts_with(list) && type.ends_with('>'))
+	{
+		type.remove_prefix(list.size());
+		type.remove_suffix(1);
+		return "std::span<const " + node_type(type) + "* const>";
+	}
+	return "const " + node_type(type) + "*";
+}
+
+void DefineType(std::ostream& file, std::string_view base_name, std::string_view return_type,
+	std::string_view struct_name, std::string_view fiends, std::string_view mutable_fields,
+	bool add_expr_namespace)
 {
 	file << "struct " << struct_name << " : " << base_name << '\n'
 		<< "{\n";
@@ -149,33 +280,34 @@ void DefineType(std::ostream& file, std::string_view base_name,
 		}
 		if (type_then_name.size() != 2)
 			continue;
-		std::stringstream ss;
-		if (type_then_name[0] == base_name || type_then_name[0] == "Expr")
-		{
-			ss << '\t' << "std::unique_ptr<" << (!add_expr_namespace ? type_then_name[0] : "expr::" + std::string(type_then_name[0]))
-				<< "> " << type_then_name[1] << ";\n";
-		}
-		else
-		{
-			ss << '\t' << type_then_name[0] << " " << type_then_name[1] << ";\n";
-		}
-		file << ss.str();
-		auto str = ss.str();
-		str.erase(0, 1); // \t
-		str.pop_back(); // \n
-		str.pop_back(); // \;
-		str.push_back('_');
-		constructor_params << sep << str;
-		constructor_init_list << tabs2 << sep << type_then_name[1] << "(std::move("
-			<< std::string(type_then_name[1]) + "_))\n";
+		const auto type = FieldType(type_then_name[0], add_expr_namespace);
+		file << '\t' << type << " " << type_then_name[1] << ";\n";
+		constructor_params << sep << type << " " << type_then_name[1] << '_';
+		constructor_init_list << tabs2 << sep << type_then_name[1] << "("
+			<< std::string(type_then_name[1]) + "_)\n";
 		tabs2 = "\t\t";
 		sep = ", ";
 	}
+	//Not part of the constructor, nodes are const once parsed so these are mutable.
+	for (const auto& field :
+		std::views::split(mutable_fields, std::string_view(",")))
+	{
+		std::vector<std::string_view> type_then_name;
+		for (const auto& val :
+			std::views::split(
+				std::string_view(field.begin(), field.end()), std::string_view("-")))
+		{
+			type_then_name.emplace_back(val);
+		}
+		if (type_then_name.size() != 2)
+			continue;
+		file << "\tmutable " << type_then_name[0] << " " << type_then_name[1] << "{};\n";
+	}
 	constructor_params << ")\n";
 	file << constructor_params.str();
 	file << constructor_init_list.str()
 		<< "\t\t{}\n";
-	file << "\tstd::any Accept(Visitor" << base_name << "& visitor) const override\n"
+	file << "\t" << return_type << " Accept(Visitor" << base_name << "& visitor) const override\n"
 		<< "\t{\n"
 		<< "\t\treturn visitor.Visit(*this);\n"
 		<< "\t}\n";
@@ -1,16 +1,17 @@
 export module ast_printer;
 
-import <any>;
 import <string>;
 
 import ast;
+import core;
+import value;
 
 export class ASTPrinter : public ast::expr::VisitorExpr
 {
-	std::any Visit(const ast::expr::Binary& val) override;
-	std::any Visit(const ast::expr::Grouping& val) override;
-	std::any Visit(const ast::expr::Literal& val) override;
-	std::any Visit(const ast::expr::Unary& val) override;
+	Value Visit(const ast::expr::Binary& val) override;
+	Value Visit(const ast::expr::Grouping& val) override;
+	Value Visit(const ast::expr::Literal& val) override;
+	Value Visit(const ast::expr::Unary& val) override;
 
 	template<class ...Expr>
 	std::string Parenthesize(std::string_view name, const Expr&... expr)
@@ -18,7 +19,7 @@ export class ASTPrinter : public ast::expr::VisitorExpr
 		std::string res;
 		res += "(";
 		res += name;
-		(res += ... += (" " + std::any_cast<std::string>(expr.Accept(*this))));
+		(res += ... += (" " + expr.Accept(*this).AsString()));
 		res += ")";
 		return res;
 	}
@@ -29,26 +30,26 @@ public:
 
 module :private;
 
-std::any ASTPrinter::Visit(const ast::expr::Binary& val)
+Value ASTPrinter::Visit(const ast::expr::Binary& val)
 {
-	return Parenthesize(val.op.m_lexeme, *val.left, *val.right);
+	return MakeString(Parenthesize(val.op.m_lexeme, *val.left, *val.right));
 }
-std::any ASTPrinter::Visit(const ast::expr::Grouping& val)
+Value ASTPrinter::Visit(const ast::expr::Grouping& val)
 {
-	return Parenthesize("group", *val.expression);
+	return MakeString(Parenthesize("group", *val.expression));
 }
 
-std::any ASTPrinter::Visit(const ast::expr::Literal& val)
+Value ASTPrinter::Visit(const ast::expr::Literal& val)
 {
-	return std::visit(AnyGet{}, val.value);
+	return MakeString(Stringify(val.value));
 }
 
-std::any ASTPrinter::Visit(const ast::expr::Unary& val)
+Value ASTPrinter::Visit(const ast::expr::Unary& val)
 {
-	return Parenthesize(val.op.m_lexeme, *val.right);
+	return MakeString(Parenthesize(val.op.m_lexeme, *val.right));
 }
 
 std::string ASTPrinter::Print(const ast::expr::Expr& root)
 {
-	return std::any_cast<std::string>(root.Accept(*this));
+	return root.Accept(*this).AsString();
 }
@@ -0,0 +1,180 @@
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+import embed;
+import log;
+import value;
+
+//Concurrent tasks per second of the async natives: tasks that only get scheduled (spawn),
+//many timers in flight at once (sleep) and reads of local pipes fed by another thread (read).
+
+constexpr std::string_view tasks = R"(
+var finished = 0;
+fun done() { finished = finished + 1; }
+
+fun spawner(n) {
+  for (var i = 0; i < n; i = i + 1) spawn(done);
+}
+
+fun sleepers(n, ms) {
+  for (var i = 0; i < n; i = i + 1) sleep(ms, done);
+}
+
+var received = 0;
+fun got(text) {
+  if (text == "message") received = received + 1;
+  done();
+}
+
+fun readers(n) {
+  for (var i = 0; i < n; i = i + 1) read(pipe(i), got);
+}
+)";
+
+struct Options
+{
+	int m_tasks = 200000;
+	int m_sleepers = 20000;
+	int m_sleep_ms = 10;
+	int m_pipes = 64;
+	int m_rounds = 50;
+	bool m_use_closures = true;
+};
+
+//Seconds call takes.
+template<class Call>
+double Time(Call call)
+{
+	const auto start = std::chrono::steady_clock::now();
+	call();
+	const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	return elapsed.count();
+}
+
+int Usage()
+{
+	std::cerr << "Usage: ./lox_async_bench [--tasks=N] [--sleepers=N] [--sleep-ms=N] [--pipes=N] [--rounds=N] [--no-closures]\n";
+	return 64;
+}
+
+int main(int argc, char** argv) try
+{
+	Options options;
+	for (std::string_view arg : std::vector<std::string_view>(argv + 1, argv + argc))
+	{
+		const auto value = [&](std::string_view flag)
+		{
+			return std::max(1, std::stoi(std::string(arg.substr(flag.size()))));
+		};
+		if (arg.starts_with("--tasks="))
+			options.m_tasks = value("--tasks=");
+		else if (arg.starts_with("--sleepers="))
+			options.m_sleepers = value("--sleepers=");
+		else if (arg.starts_with("--sleep-ms="))
+			options.m_sleep_ms = value("--sleep-ms=");
+		else if (arg.starts_with("--pipes="))
+			options.m_pipes = value("--pipes=");
+		else if (arg.starts_with("--rounds="))
+			options.m_rounds = value("--rounds=");
+		else if (arg == "--no-closures")
+			options.m_use_closures = false;
+		else
+			return Usage();
+	}
+
+	std::ostringstream out;
+	Engine engine{ out, options.m_use_closures };
+	std::vector<std::string> pipes;
+	engine.Define("pipe", 1, [&](const std::vector<Value>& arguments)
+	{
+		return MakeString(pipes.at(static_cast<std::size_t>(arguments[0].AsNumber())));
+	});
+	auto& script = engine.Load(std::string(tasks));
+	const auto finished = [&]
+	{
+		return engine.Global(script, "finished").AsNumber();
+	};
+	std::cout << std::fixed << std::setprecision(0);
+
+	//Engine::Invoke returns when every task it started has finished.
+	const auto spawn_time = Time([&]
+	{
+		engine.Invoke(script, "spawner", { static_cast<double>(options.m_tasks) });
+	});
+	std::cout << "spawn: " << options.m_tasks / spawn_time << " tasks/s\n";
+
+	const auto before_sleep = finished();
+	const auto sleep_time = Time([&]
+	{
+		engine.Invoke(script, "sleepers", { static_cast<double>(options.m_sleepers), static_cast<double>(options.m_sleep_ms) });
+	});
+	if (finished() - before_sleep != options.m_sleepers)
+		throw std::runtime_error("a sleeping task did not finish");
+	std::cout << "sleep: " << options.m_sleepers << " tasks sleeping " << options.m_sleep_ms << " ms each, all done in "
+		<< std::setprecision(1) << sleep_time * 1000 << " ms (" << std::setprecision(0)
+		<< options.m_sleepers / sleep_time << " tasks/s)\n";
+
+#ifdef __linux__
+	//Pipes are FIFOs in a temporary directory. The writer opens each one in turn, which blocks until
+	//the script opened it for reading, writes a message and closes it, so the read ends.
+	const auto directory = std::filesystem::temp_directory_path() / ("lox_async_bench." + std::to_string(getpid()));
+	std::filesystem::create_directories(directory);
+	for (int i = 0; i < options.m_pipes; ++i)
+	{
+		pipes.push_back((directory / std::to_string(i)).string());
+		if (mkfifo(pipes.back().c_str(), 0600) == -1)
+			throw std::runtime_error("can`t create pipe " + pipes.back());
+	}
+	const auto before_read = finished();
+	const auto read_time = Time([&]
+	{
+		for (int round = 0; round < options.m_rounds; ++round)
+		{
+			std::jthread writer{ [&]
+			{
+				constexpr std::string_view message = "message";
+				for (const auto& path : pipes)
+				{
+					const auto fd = open(path.c_str(), O_WRONLY);
+					if (fd == -1)
+						continue;
+					(void)write(fd, message.data(), message.size());
+					close(fd);
+				}
+			} };
+			engine.Invoke(script, "readers", { static_cast<double>(options.m_pipes) });
+		}
+	});
+	std::filesystem::remove_all(directory);
+	const auto reads = options.m_pipes * options.m_rounds;
+	if (finished() - before_read != reads || engine.Global(script, "received").AsNumber() != reads)
+		throw std::runtime_error("a read did not get its message");
+	std::cout << "read:  " << options.m_pipes << " pipes read at once, " << reads / read_time << " reads/s\n";
+#endif
+	return 0;
+}
+catch (const InvokeError& error)
+{
+	std::cerr << error.what() << "\n[line " << error.m_line << " ]" << std::endl;
+	return 70;
+}
+catch (const std::exception& error)
+{
+	std::cerr << error.what() << std::endl;
+	return -1;
+}
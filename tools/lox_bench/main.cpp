@@ -0,0 +1,279 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <regex>
+#include <sstream>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+import ast;
+import resolver;
+import optimizer;
+import interpreter;
+import compiler;
+import vm;
+import log;
+import value;
+import source;
+
+//Runs each benchmark script in-process several times and prints the median and p95
+//wall time of every script as JSON. Given a baseline (a previous output of lox_bench),
+//it also compares the medians and fails when one got slower than the threshold allows.
+//With --jobs=N every run starts N copies of the script on N threads, each in its own isolate:
+//compared to a --jobs=1 baseline, the change of the medians shows how far throughput is from scaling linearly.
+
+struct Options
+{
+	bool m_use_vm = false;
+	bool m_use_closures = false;
+	int m_runs = 5;
+	int m_warmup = 1;
+	int m_jobs = 1; //Copies of the script run at the same time
+	double m_threshold = 0.10; //Allowed slowdown of a median, relative to the baseline
+	std::filesystem::path m_baseline;
+	std::vector<std::filesystem::path> m_scripts;
+};
+
+struct Result
+{
+	std::string m_name;
+	double m_median_ms = 0;
+	double m_p95_ms = 0;
+};
+
+//Swallows what the scripts print, so only the JSON goes to stdout.
+class NullBuffer : public std::streambuf
+{
+protected:
+	int overflow(int c) override
+	{
+		return traits_type::not_eof(c);
+	}
+	std::streamsize xsputn(const char*, std::streamsize count) override
+	{
+		return count;
+	}
+};
+
+//Whole pipeline in the current isolate, from mapping the file to the end of the script.
+void RunScript(const std::filesystem::path& path, const Options& options)
+{
+	const SourceFile file{ path };
+	auto program = Compile(file.Text());
+	if (HasError())
+		throw std::runtime_error("can`t compile " + path.string());
+	Optimizer{ program }.Optimize();
+	if (options.m_use_vm)
+	{
+		VM vm;
+		if (auto script = Compiler{}.Compile(program.Statements()))
+			vm.Interpret(std::move(script));
+	}
+	else
+	{
+		Interpreter interpreter;
+		if (options.m_use_closures)
+			interpreter.InterpretCompiled(program.Statements());
+		else
+			interpreter.Interpret(program.Statements());
+		interpreter.InterpretTasks();
+	}
+	if (HasRuntimeError())
+		throw std::runtime_error("runtime error in " + path.string());
+}
+
+//Milliseconds until every copy of the script finished. Each copy prints nothing and runs in a new isolate,
+//which collects the cycles the script left when it is destroyed, after the copy was timed.
+double RunOnce(const std::filesystem::path& path, const Options& options)
+{
+	using Clock = std::chrono::steady_clock;
+	std::vector<Clock::time_point> ends(options.m_jobs);
+	std::vector<std::exception_ptr> errors(options.m_jobs);
+	const auto run_copy = [&](int copy)
+	{
+		NullBuffer null;
+		std::ostream out{ &null };
+		Isolate isolate{ out };
+		const Isolate::Scope scope{ isolate };
+		try
+		{
+			RunScript(path, options);
+		}
+		catch (...)
+		{
+			errors[copy] = std::current_exception();
+		}
+		ends[copy] = Clock::now();
+	};
+	const auto start = Clock::now();
+	if (options.m_jobs == 1)
+		run_copy(0);
+	else
+	{
+		std::vector<std::jthread> threads;
+		for (int copy = 0; copy < options.m_jobs; ++copy)
+			threads.emplace_back(run_copy, copy);
+	}
+	for (const auto& error : errors)
+	{
+		if (error)
+			std::rethrow_exception(error);
+	}
+	const std::chrono::duration<double, std::milli> elapsed = *std::max_element(std::begin(ends), std::end(ends)) - start;
+	return elapsed.count();
+}
+
+Result Measure(const std::filesystem::path& path, const Options& options)
+{
+	std::vector<double> times;
+	for (int i = 0; i < options.m_warmup + options.m_runs; ++i)
+	{
+		const auto time = RunOnce(path, options);
+		if (i >= options.m_warmup)
+			times.push_back(time);
+	}
+	std::sort(std::begin(times), std::end(times));
+	const auto size = times.size();
+	Result res;
+	res.m_name = path.stem().string();
+	res.m_median_ms = size % 2 ? times[size / 2] : (times[size / 2 - 1] + times[size / 2]) / 2;
+	//Nearest rank
+	res.m_p95_ms = times[static_cast<std::size_t>(std::ceil(0.95 * size)) - 1];
+	return res;
+}
+
+//Medians by name from a file written by lox_bench, one benchmark per line.
+std::map<std::string, double> ReadBaseline(const std::filesystem::path& path)
+{
+	std::ifstream file{ path };
+	if (!file.is_open())
+		throw std::runtime_error("can`t open file: " + path.string());
+	const std::regex entry{ R"re("([^"]+)"\s*:\s*\{\s*"median_ms"\s*:\s*([-+0-9.eE]+))re" };
+	std::map<std::string, double> res;
+	std::string line;
+	while (std::getline(file, line))
+	{
+		std::smatch match;
+		if (std::regex_search(line, match, entry))
+			res[match[1].str()] = std::stod(match[2].str());
+	}
+	return res;
+}
+
+std::vector<std::filesystem::path> CollectScripts(const std::vector<std::string_view>& paths)
+{
+	std::vector<std::filesystem::path> res;
+	for (const auto& arg : paths)
+	{
+		const std::filesystem::path path{ arg };
+		if (!std::filesystem::is_directory(path))
+		{
+			res.push_back(path);
+			continue;
+		}
+		std::vector<std::filesystem::path> scripts;
+		for (const auto& entry : std::filesystem::directory_iterator(path))
+		{
+			if (entry.path().extension() == ".lox")
+				scripts.push_back(entry.path());
+		}
+		std::sort(std::begin(scripts), std::end(scripts));
+		res.insert(std::end(res), std::begin(scripts), std::end(scripts));
+	}
+	return res;
+}
+
+int Usage()
+{
+	std::cerr << "Usage: ./lox_bench [--vm | --closures] [--runs=N] [--warmup=N] [--jobs=N] [--baseline=file.json] "
+		"[--threshold=0.1] script.lox|directory...\n";
+	return 64;
+}
+
+int main(int argc, char** argv) try
+{
+	Options options;
+	std::vector<std::string_view> paths;
+	for (std::string_view arg : std::vector<std::string_view>(argv + 1, argv + argc))
+	{
+		const auto value = [&](std::string_view flag)
+		{
+			return std::string(arg.substr(flag.size()));
+		};
+		if (arg == "--vm")
+			options.m_use_vm = true;
+		else if (arg == "--closures")
+			options.m_use_closures = true;
+		else if (arg.starts_with("--runs="))
+			options.m_runs = std::max(1, std::stoi(value("--runs=")));
+		else if (arg.starts_with("--warmup="))
+			options.m_warmup = std::max(0, std::stoi(value("--warmup=")));
+		else if (arg.starts_with("--jobs="))
+			options.m_jobs = std::max(1, std::stoi(value("--jobs=")));
+		else if (arg.starts_with("--threshold="))
+			options.m_threshold = std::stod(value("--threshold="));
+		else if (arg.starts_with("--baseline="))
+			options.m_baseline = value("--baseline=");
+		else if (arg.starts_with("--"))
+			return Usage();
+		else
+			paths.push_back(arg);
+	}
+	if (paths.empty())
+		return Usage();
+	options.m_scripts = CollectScripts(paths);
+
+	std::vector<Result> results;
+	for (const auto& script : options.m_scripts)
+		results.push_back(Measure(script, options));
+
+	std::map<std::string, double> baseline;
+	if (!options.m_baseline.empty())
+		baseline = ReadBaseline(options.m_baseline);
+	std::ostringstream regressions;
+	std::cout << std::fixed << std::setprecision(3);
+	std::cout << "{\n";
+	std::cout << "  \"backend\": \"" << (options.m_use_vm ? "vm" : options.m_use_closures ? "closures" : "interpreter") << "\",\n";
+	std::cout << "  \"runs\": " << options.m_runs << ",\n";
+	std::cout << "  \"jobs\": " << options.m_jobs << ",\n";
+	std::cout << "  \"benchmarks\": {\n";
+	for (std::size_t i = 0; i < results.size(); ++i)
+	{
+		const auto& result = results[i];
+		std::cout << "    \"" << result.m_name << "\": {\"median_ms\": " << result.m_median_ms
+			<< ", \"p95_ms\": " << result.m_p95_ms;
+		const auto it = baseline.find(result.m_name);
+		if (it != std::end(baseline) && it->second > 0)
+		{
+			const auto change = result.m_median_ms / it->second - 1;
+			const bool regressed = change > options.m_threshold;
+			std::cout << ", \"baseline_ms\": " << it->second << ", \"change\": " << change
+				<< ", \"regression\": " << std::boolalpha << regressed;
+			if (regressed)
+			{
+				regressions << std::fixed << std::setprecision(3) << "regression: " << result.m_name << ": " << it->second << " ms -> " << result.m_median_ms
+					<< " ms (+" << change * 100 << "%)\n";
+			}
+		}
+		std::cout << '}' << (i + 1 < results.size() ? "," : "") << '\n';
+	}
+	std::cout << "  }\n";
+	std::cout << "}" << std::endl;
+	std::cerr << regressions.str();
+	return regressions.str().empty() ? 0 : 1;
+}
+catch (const std::exception& error)
+{
+	std::cerr << error.what() << std::endl;
+	return -1;
+}
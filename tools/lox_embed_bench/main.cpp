@@ -0,0 +1,129 @@
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+import embed;
+import log;
+import value;
+
+//Invocations per second of a request handler through the embedding API: looked up by name on every call,
+//through a handle looked up once, and, for comparison, loading the whole script again for every request
+//like running it with lox would.
+
+constexpr std::string_view handler = R"(
+class Request {
+  init(path, amount) {
+    this.path = path;
+    this.amount = amount;
+  }
+}
+
+fun handle(path, amount) {
+  var request = Request(path, amount);
+  var total = 0;
+  for (var i = 1; i <= 10; i = i + 1) total = total + request.amount * i;
+  return request.path + ": " + fee(total);
+}
+)";
+
+struct Options
+{
+	int m_calls = 1000000;
+	int m_loads = 2000;
+	bool m_use_closures = true;
+};
+
+//Calls per second of call(i), run count times.
+template<class Call>
+double Rate(int count, Call call)
+{
+	const auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < count; ++i)
+		call(i);
+	const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	return count / elapsed.count();
+}
+
+int Usage()
+{
+	std::cerr << "Usage: ./lox_embed_bench [--calls=N] [--loads=N] [--no-closures]\n";
+	return 64;
+}
+
+int main(int argc, char** argv) try
+{
+	Options options;
+	for (std::string_view arg : std::vector<std::string_view>(argv + 1, argv + argc))
+	{
+		const auto value = [&](std::string_view flag)
+		{
+			return std::string(arg.substr(flag.size()));
+		};
+		if (arg.starts_with("--calls="))
+			options.m_calls = std::max(1, std::stoi(value("--calls=")));
+		else if (arg.starts_with("--loads="))
+			options.m_loads = std::max(1, std::stoi(value("--loads=")));
+		else if (arg == "--no-closures")
+			options.m_use_closures = false;
+		else
+			return Usage();
+	}
+
+	std::ostringstream out;
+	Engine engine{ out, options.m_use_closures };
+	//Host function: the fee is computed by the service, not the script.
+	engine.Define("fee", 1, [](const std::vector<Value>& arguments)
+	{
+		if (!arguments[0].IsNumber())
+			throw NativeError("Argument 1 must be a number.");
+		return MakeString(std::to_string(arguments[0].AsNumber() * 1.02));
+	});
+	auto& script = engine.Load(std::string(handler));
+	const std::vector<Value> arguments{ MakeString("/orders"), 3.0 };
+	const auto expected = engine.Invoke(script, "handle", arguments);
+
+	const auto by_name = Rate(options.m_calls, [&](int)
+	{
+		engine.Invoke(script, "handle", arguments);
+	});
+	const auto function = engine.Global(script, "handle");
+	const auto by_handle = Rate(options.m_calls, [&](int)
+	{
+		if (!IsEqual(engine.Call(script, function, arguments), expected))
+			throw std::runtime_error("unexpected result");
+	});
+	//Every request loads its own copy of the script in a new engine.
+	const auto reloading = Rate(options.m_loads, [&](int)
+	{
+		Engine request{ out, options.m_use_closures };
+		request.Define("fee", 1, [](const std::vector<Value>& arguments)
+		{
+			return MakeString(std::to_string(arguments[0].AsNumber() * 1.02));
+		});
+		auto& copy = request.Load(std::string(handler));
+		request.Invoke(copy, "handle", { MakeString("/orders"), 3.0 });
+	});
+
+	std::cout << "handle(\"/orders\", 3) = " << Stringify(expected) << '\n';
+	std::cout << std::fixed << std::setprecision(0);
+	std::cout << "invoke by name:   " << by_name << " calls/s\n";
+	std::cout << "call by handle:   " << by_handle << " calls/s\n";
+	std::cout << "load per request: " << reloading << " calls/s\n";
+	return 0;
+}
+catch (const InvokeError& error)
+{
+	std::cerr << error.what() << "\n[line " << error.m_line << " ]" << std::endl;
+	return 70;
+}
+catch (const std::exception& error)
+{
+	std::cerr << error.what() << std::endl;
+	return -1;
+}
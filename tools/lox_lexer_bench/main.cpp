@@ -0,0 +1,135 @@
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+import core;
+import lexer;
+import log;
+import source;
+
+//Lexer throughput in MB/s: every source is lexed several times and the best and median runs are reported.
+//Without files it lexes a generated source of --size=MB megabytes, made of copies of a class with
+//comments, indentation, strings and numbers, every copy with identifiers of its own.
+
+constexpr std::string_view unit = R"(
+// Account number #: a plain comment line, long enough to be skipped a block at a time.
+class Account# < Base {
+    init(owner, balance) {
+        this.owner = owner;
+        this.balance = balance; // opening balance
+        this.history = "created for a customer of branch #";
+    }
+
+    deposit(amount) {
+        if (amount <= 0) return false;
+        this.balance = this.balance + amount * 1.0125;
+        return true;
+    }
+}
+
+fun audit#(accounts, limit) {
+    var total = 0;
+    for (var i = 0; i < limit; i = i + 1) {
+        total = total + accounts.balance / 100.5;
+    }
+    while (total > 1000000 and !false) total = total - 12345.678;
+    return total >= 0 or nil == this_is_a_longer_identifier_name_#;
+}
+)";
+
+struct Options
+{
+	int m_runs = 10;
+	std::size_t m_size = 8; //Megabytes of generated source
+	std::vector<std::filesystem::path> m_sources;
+};
+
+std::string Generate(std::size_t bytes)
+{
+	std::string res;
+	res.reserve(bytes + unit.size());
+	for (int copy = 0; res.size() < bytes; ++copy)
+	{
+		const auto id = std::to_string(copy);
+		for (const auto c : unit)
+		{
+			if (c == '#')
+				res += id;
+			else
+				res += c;
+		}
+	}
+	return res;
+}
+
+//Lexes text options.m_runs times and prints its throughput.
+void Measure(std::string_view name, std::string_view text, const Options& options)
+{
+	std::vector<double> seconds;
+	std::size_t tokens = 0;
+	for (int run = 0; run < options.m_runs; ++run)
+	{
+		const auto start = std::chrono::steady_clock::now();
+		Lexer lexer{ text };
+		tokens = lexer.GetTokens().size();
+		const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		seconds.push_back(elapsed.count());
+		if (HasError())
+			throw std::runtime_error("can`t lex " + std::string(name));
+	}
+	std::sort(std::begin(seconds), std::end(seconds));
+	const auto megabytes = static_cast<double>(text.size()) / (1024 * 1024);
+	std::cout << name << ": " << std::fixed << std::setprecision(2) << megabytes << " MB, " << tokens << " tokens\n"
+		<< "  best:   " << std::setprecision(1) << megabytes / seconds.front() << " MB/s, "
+		<< std::setprecision(0) << tokens / seconds.front() << " tokens/s\n"
+		<< "  median: " << std::setprecision(1) << megabytes / seconds[seconds.size() / 2] << " MB/s\n";
+}
+
+int Usage()
+{
+	std::cerr << "Usage: ./lox_lexer_bench [--runs=N] [--size=MB] [script.lox...]\n";
+	return 64;
+}
+
+int main(int argc, char** argv) try
+{
+	Options options;
+	for (std::string_view arg : std::vector<std::string_view>(argv + 1, argv + argc))
+	{
+		const auto value = [&](std::string_view flag)
+		{
+			return std::string(arg.substr(flag.size()));
+		};
+		if (arg.starts_with("--runs="))
+			options.m_runs = std::max(1, std::stoi(value("--runs=")));
+		else if (arg.starts_with("--size="))
+			options.m_size = std::max(1, std::stoi(value("--size=")));
+		else if (arg.starts_with("--"))
+			return Usage();
+		else
+			options.m_sources.emplace_back(arg);
+	}
+
+	if (options.m_sources.empty())
+	{
+		const auto text = Generate(options.m_size * 1024 * 1024);
+		Measure("generated", text, options);
+	}
+	for (const auto& path : options.m_sources)
+	{
+		const SourceFile file{ path };
+		Measure(path.string(), file.Text(), options);
+	}
+	return 0;
+}
+catch (const std::exception& error)
+{
+	std::cerr << error.what() << std::endl;
+	return -1;
+}
@@ -0,0 +1,1021 @@
+export module value;
+
+import <algorithm>;
+import <bit>;
+import <charconv>;
+import <chrono>;
+import <cmath>;
+import <cstdint>;
+import <cstddef>;
+import <functional>;
+import <iostream>;
+import <memory>;
+import <string>;
+import <string_view>;
+import <type_traits>;
+import <unordered_map>;
+import <unordered_set>;
+import <utility>;
+import <vector>;
+
+export enum class ObjType : std::uint8_t
+{
+	STRING,
+	FUNCTION,
+	NATIVE,
+	CLASS,
+	INSTANCE,
+	//Bytecode VM objects
+	PROTO,
+	CLOSURE,
+	UPVALUE,
+	BOUND_METHOD,
+	VM_NATIVE,
+	VM_CLASS,
+	VM_INSTANCE,
+	//Tree-walker scope
+	ENVIRONMENT,
+	//Native array of numbers, shared by both backends
+	ARRAY,
+	//Program run by the tree-walker and the code compiled from it
+	CODE_UNIT,
+	//String built by concatenation, not interned yet
+	CONCAT,
+};
+
+//Base of every heap allocated runtime object.
+//Lifetime is controlled by an intrusive (non-atomic) reference counter,
+//so copying a Value costs a single increment instead of a shared_ptr control block.
+//Objects that can form reference cycles derive from Container and are also traced by the Heap.
+export class Object
+{
+	const ObjType m_type;
+	const bool m_is_container;
+	std::uint32_t m_ref_count = 0;
+protected:
+	Object(ObjType type, bool is_container)
+		: m_type(type)
+		, m_is_container(is_container)
+	{}
+public:
+	explicit Object(ObjType type)
+		: Object(type, false)
+	{}
+	Object(const Object&) = delete;
+	Object& operator=(const Object&) = delete;
+	virtual ~Object() = default;
+
+	ObjType GetType() const
+	{
+		return m_type;
+	}
+	void Retain()
+	{
+		++m_ref_count;
+	}
+	void Release()
+	{
+		if (--m_ref_count == 0)
+			delete this;
+	}
+	std::uint32_t RefCount() const
+	{
+		return m_ref_count;
+	}
+	bool IsContainer() const
+	{
+		return m_is_container;
+	}
+	virtual std::string ToString() const = 0;
+};
+
+class Tracer;
+class Heap;
+
+//Object that holds references to other containers (environments, closures, classes, instances...).
+//Reference counting alone never frees a cycle of them, so they are linked into the Heap,
+//which periodically finds the unreachable ones with mark-sweep.
+//Strings and other leaves must never reference a Container, or the Heap would miss that reference.
+export class Container : public Object
+{
+	friend class Heap;
+	//GC header
+	Container* m_prev = nullptr;
+	Container* m_next = nullptr;
+	std::int64_t m_gc_refs = 0;
+	std::uint32_t m_size = 0;
+	bool m_marked = false;
+public:
+	explicit Container(ObjType type)
+		: Object(type, true)
+	{}
+	~Container() override;
+	//Visit every reference this object owns, exactly once per owned reference.
+	virtual void Trace(Tracer& tracer) const = 0;
+	//Drop every owned reference. Only called on unreachable objects to break their cycles.
+	virtual void Clear() = 0;
+};
+
+class StringPool;
+
+//Every ObjString is interned: there is exactly one object per distinct content,
+//so strings are compared (and hashed in StringMap) by pointer.
+//Only StringPool creates them, see Intern().
+export class ObjString : public Object
+{
+	friend class StringPool;
+	const std::string m_str;
+	const std::size_t m_hash;
+
+	ObjString(std::string str, std::size_t hash)
+		: Object(ObjType::STRING)
+		, m_str(std::move(str))
+		, m_hash(hash)
+	{}
+public:
+	~ObjString() override;
+	const std::string& Str() const
+	{
+		return m_str;
+	}
+	std::size_t Hash() const
+	{
+		return m_hash;
+	}
+	std::string ToString() const override
+	{
+		return m_str;
+	}
+};
+
+//Strong reference to an Object subclass.
+export template<class T>
+class Ref
+{
+	T* m_ptr = nullptr;
+public:
+	Ref() = default;
+	Ref(std::nullptr_t)
+	{}
+	explicit Ref(T* ptr)
+		: m_ptr(ptr)
+	{
+		if (m_ptr)
+			m_ptr->Retain();
+	}
+	Ref(const Ref& other)
+		: Ref(other.m_ptr)
+	{}
+	template<class U>
+	Ref(const Ref<U>& other)
+		: Ref(static_cast<T*>(other.get()))
+	{}
+	Ref(Ref&& other) noexcept
+		: m_ptr(std::exchange(other.m_ptr, nullptr))
+	{}
+	Ref& operator=(Ref other) noexcept
+	{
+		std::swap(m_ptr, other.m_ptr);
+		return *this;
+	}
+	~Ref()
+	{
+		if (m_ptr)
+			m_ptr->Release();
+	}
+	T* get() const
+	{
+		return m_ptr;
+	}
+	T* operator->() const
+	{
+		return m_ptr;
+	}
+	T& operator*() const
+	{
+		return *m_ptr;
+	}
+	explicit operator bool() const
+	{
+		return m_ptr != nullptr;
+	}
+};
+
+export void TrackContainer(Container* container, std::size_t size);
+
+export template<class T, class ...Args>
+Ref<T> MakeRef(Args&&... args)
+{
+	auto res = Ref<T>(new T(std::forward<Args>(args)...));
+	//Tracked only once it is referenced, so a collection triggered here keeps it alive.
+	if constexpr (std::is_base_of_v<Container, T>)
+		TrackContainer(res.get(), sizeof(T));
+	return res;
+}
+
+//Result of a string concatenation, interned only when its content is compared.
+//The characters live in a buffer shared with the strings it was appended to, every result is a prefix of it.
+//s + x appends x in place when s is the longest prefix (nothing was appended to s yet),
+//so a loop of s = s + x is amortized O(1) per step instead of copying s every time.
+//Anything else (x + s, a second append to the same s) copies into a new buffer.
+export class ObjConcat : public Object
+{
+	const std::shared_ptr<std::string> m_buffer;
+	const std::size_t m_length;
+	mutable Ref<ObjString> m_interned;
+public:
+	ObjConcat(std::shared_ptr<std::string> buffer)
+		: Object(ObjType::CONCAT)
+		, m_buffer(std::move(buffer))
+		, m_length(m_buffer->size())
+	{}
+	std::string_view View() const
+	{
+		return { m_buffer->data(), m_length };
+	}
+	//Appending to the buffer does not change this string.
+	bool IsLongest() const
+	{
+		return m_buffer->size() == m_length;
+	}
+	const std::shared_ptr<std::string>& Buffer() const
+	{
+		return m_buffer;
+	}
+	//Made on first use and kept.
+	ObjString* Interned() const;
+	std::string ToString() const override
+	{
+		return std::string(View());
+	}
+};
+
+//8-byte NaN-boxed value: every double that is not a quiet NaN is stored as is,
+//nil/false/true and object pointers live in the unused quiet NaN payload space.
+export class Value
+{
+	static constexpr std::uint64_t SIGN_BIT = 0x8000000000000000;
+	static constexpr std::uint64_t QNAN = 0x7ffc000000000000;
+	static constexpr std::uint64_t TAG_NIL = 1;
+	static constexpr std::uint64_t TAG_FALSE = 2;
+	static constexpr std::uint64_t TAG_TRUE = 3;
+	static constexpr std::uint64_t NIL_VAL = QNAN | TAG_NIL;
+	static constexpr std::uint64_t FALSE_VAL = QNAN | TAG_FALSE;
+	static constexpr std::uint64_t TRUE_VAL = QNAN | TAG_TRUE;
+	static constexpr std::uint64_t OBJ_MASK = SIGN_BIT | QNAN;
+
+	std::uint64_t m_bits = NIL_VAL;
+
+	void Retain() const
+	{
+		if (IsObject())
+			AsObject()->Retain();
+	}
+	void Release() const
+	{
+		if (IsObject())
+			AsObject()->Release();
+	}
+public:
+	Value() = default;
+	Value(double number)
+		: m_bits(std::bit_cast<std::uint64_t>(number))
+	{}
+	Value(bool boolean)
+		: m_bits(boolean ? TRUE_VAL : FALSE_VAL)
+	{}
+	Value(Object* object)
+		: m_bits(OBJ_MASK | reinterpret_cast<std::uintptr_t>(object))
+	{
+		object->Retain();
+	}
+	template<class T>
+	Value(const Ref<T>& object)
+		: Value(static_cast<Object*>(object.get()))
+	{}
+	//Would silently turn into bool otherwise.
+	Value(const char*) = delete;
+
+	Value(const Value& other)
+		: m_bits(other.m_bits)
+	{
+		Retain();
+	}
+	Value(Value&& other) noexcept
+		: m_bits(std::exchange(other.m_bits, NIL_VAL))
+	{}
+	//other is read before this value is released: releasing it can free the object
+	//that holds other (e.g. a field assigned over its instance).
+	Value& operator=(const Value& other)
+	{
+		const auto bits = other.m_bits;
+		other.Retain();
+		Release();
+		m_bits = bits;
+		return *this;
+	}
+	Value& operator=(Value&& other) noexcept
+	{
+		if (this != &other)
+		{
+			const auto bits = std::exchange(other.m_bits, NIL_VAL);
+			Release();
+			m_bits = bits;
+		}
+		return *this;
+	}
+	~Value()
+	{
+		Release();
+	}
+
+	bool IsNil() const
+	{
+		return m_bits == NIL_VAL;
+	}
+	bool IsBool() const
+	{
+		return (m_bits | 1) == TRUE_VAL;
+	}
+	bool IsNumber() const
+	{
+		return (m_bits & QNAN) != QNAN;
+	}
+	bool IsObject() const
+	{
+		return (m_bits & OBJ_MASK) == OBJ_MASK;
+	}
+	bool IsObjType(ObjType type) const
+	{
+		return IsObject() && AsObject()->GetType() == type;
+	}
+	//An interned ObjString or an ObjConcat.
+	bool IsString() const
+	{
+		if (!IsObject())
+			return false;
+		const auto type = AsObject()->GetType();
+		return type == ObjType::STRING || type == ObjType::CONCAT;
+	}
+
+	bool AsBool() const
+	{
+		return m_bits == TRUE_VAL;
+	}
+	double AsNumber() const
+	{
+		return std::bit_cast<double>(m_bits);
+	}
+	Object* AsObject() const
+	{
+		return reinterpret_cast<Object*>(static_cast<std::uintptr_t>(m_bits & ~OBJ_MASK));
+	}
+	template<class T>
+	T* As() const
+	{
+		return static_cast<T*>(AsObject());
+	}
+	template<class T>
+	Ref<T> AsRef() const
+	{
+		return Ref<T>(As<T>());
+	}
+	//Interns a concatenation result.
+	ObjString* AsInterned() const
+	{
+		if (IsObjType(ObjType::CONCAT))
+			return As<ObjConcat>()->Interned();
+		return As<ObjString>();
+	}
+	const std::string& AsString() const
+	{
+		return AsInterned()->Str();
+	}
+	//The characters of a string, without interning it.
+	std::string_view AsStringView() const
+	{
+		if (IsObjType(ObjType::CONCAT))
+			return As<ObjConcat>()->View();
+		return As<ObjString>()->Str();
+	}
+
+	//Bitwise identity: same number bits, same singleton or same object.
+	bool IsSame(const Value& other) const
+	{
+		return m_bits == other.m_bits;
+	}
+};
+
+//Walks the references a Container owns, see Container::Trace.
+export class Tracer
+{
+public:
+	virtual void Visit(Object* object) = 0;
+	void Visit(const Value& value)
+	{
+		if (value.IsObject())
+			Visit(value.AsObject());
+	}
+	template<class T>
+	void Visit(const Ref<T>& object)
+	{
+		if (object)
+			Visit(static_cast<Object*>(object.get()));
+	}
+	template<class K, class V, class H, class E>
+	void Visit(const std::unordered_map<K, V, H, E>& map)
+	{
+		for (const auto& [key, value] : map)
+		{
+			Visit(key);
+			Visit(value);
+		}
+	}
+	template<class T>
+	void Visit(const std::vector<T>& values)
+	{
+		for (const auto& value : values)
+			Visit(value);
+	}
+protected:
+	~Tracer() = default;
+};
+
+export struct GcStats
+{
+	std::size_t m_collections = 0;
+	std::size_t m_objects_reclaimed = 0; //Containers freed by the collector (cycles)
+	std::size_t m_bytes_reclaimed = 0;
+	std::size_t m_live_objects = 0; //Tracked containers right now
+	std::size_t m_live_bytes = 0;
+	double m_total_pause_ms = 0;
+	double m_max_pause_ms = 0;
+};
+
+//Cycle collector over every live Container.
+//Reference counting still frees most objects as soon as they are unused,
+//the Heap only has to find garbage cycles. It is a stop-the-world mark-sweep:
+//the roots are all containers referenced from outside the heap (the interpreter's environment chain,
+//the VM value stack and globals, C++ temporaries), found without registering them by subtracting
+//the references containers hold to each other from their reference counts.
+//A collection runs when the tracked bytes exceed the threshold, which is then set
+//to the surviving bytes times the growth factor.
+class Heap
+{
+	static constexpr std::size_t MIN_THRESHOLD = 1024 * 1024;
+	Container* m_head = nullptr;
+	std::size_t m_threshold = MIN_THRESHOLD;
+	double m_growth_factor = 2.0;
+	bool m_collecting = false;
+	GcStats m_stats;
+public:
+	//The current isolate's heap.
+	static Heap& Get();
+	void Track(Container* container, std::size_t size)
+	{
+		container->m_size = static_cast<std::uint32_t>(size);
+		container->m_next = m_head;
+		if (m_head)
+			m_head->m_prev = container;
+		m_head = container;
+		++m_stats.m_live_objects;
+		m_stats.m_live_bytes += size;
+		if (m_stats.m_live_bytes > m_threshold && !m_collecting)
+			Collect();
+	}
+	void Untrack(Container* container)
+	{
+		//Created directly with new and never tracked
+		if (container->m_size == 0)
+			return;
+		if (container->m_prev)
+			container->m_prev->m_next = container->m_next;
+		else
+			m_head = container->m_next;
+		if (container->m_next)
+			container->m_next->m_prev = container->m_prev;
+		--m_stats.m_live_objects;
+		m_stats.m_live_bytes -= container->m_size;
+	}
+	void AddExternal(std::size_t bytes)
+	{
+		m_stats.m_live_bytes += bytes;
+		if (m_stats.m_live_bytes > m_threshold && !m_collecting)
+			Collect();
+	}
+	void RemoveExternal(std::size_t bytes)
+	{
+		m_stats.m_live_bytes -= bytes;
+	}
+	void Collect();
+	void SetGrowthFactor(double factor)
+	{
+		m_growth_factor = std::max(factor, 1.0);
+	}
+	const GcStats& Stats() const
+	{
+		return m_stats;
+	}
+};
+
+Container::~Container()
+{
+	Heap::Get().Untrack(this);
+}
+
+void Heap::Collect()
+{
+	const auto start = std::chrono::steady_clock::now();
+	m_collecting = true;
+
+	//References held by other containers are subtracted,
+	//whatever is left comes from outside the heap and makes the container a root.
+	struct Subtract final : Tracer
+	{
+		void Visit(Object* object) override
+		{
+			if (object->IsContainer())
+				--static_cast<Container*>(object)->m_gc_refs;
+		}
+	} subtract;
+	for (auto* it = m_head; it; it = it->m_next)
+	{
+		it->m_gc_refs = it->RefCount();
+		it->m_marked = false;
+	}
+	for (auto* it = m_head; it; it = it->m_next)
+		it->Trace(subtract);
+
+	struct Mark final : Tracer
+	{
+		std::vector<Container*> m_gray;
+		void Visit(Object* object) override
+		{
+			if (!object->IsContainer())
+				return;
+			auto* container = static_cast<Container*>(object);
+			if (!container->m_marked)
+			{
+				container->m_marked = true;
+				m_gray.push_back(container);
+			}
+		}
+	} mark;
+	for (auto* it = m_head; it; it = it->m_next)
+	{
+		if (it->m_gc_refs > 0)
+			mark.Visit(it);
+	}
+	while (!mark.m_gray.empty())
+	{
+		auto* container = mark.m_gray.back();
+		mark.m_gray.pop_back();
+		container->Trace(mark);
+	}
+
+	//Sweep: unmarked containers are only referenced by each other.
+	//They are kept alive while their references are cleared, then the last release frees them.
+	std::vector<Container*> garbage;
+	for (auto* it = m_head; it; it = it->m_next)
+	{
+		if (!it->m_marked)
+			garbage.push_back(it);
+	}
+	const auto live_bytes = m_stats.m_live_bytes;
+	const auto live_objects = m_stats.m_live_objects;
+	for (auto* container : garbage)
+		container->Retain();
+	for (auto* container : garbage)
+		container->Clear();
+	for (auto* container : garbage)
+		container->Release();
+
+	m_stats.m_objects_reclaimed += live_objects - m_stats.m_live_objects;
+	m_stats.m_bytes_reclaimed += live_bytes - m_stats.m_live_bytes;
+	m_threshold = std::max(MIN_THRESHOLD,
+		static_cast<std::size_t>(static_cast<double>(m_stats.m_live_bytes) * m_growth_factor));
+	m_collecting = false;
+
+	const std::chrono::duration<double, std::milli> pause = std::chrono::steady_clock::now() - start;
+	++m_stats.m_collections;
+	m_stats.m_total_pause_ms += pause.count();
+	m_stats.m_max_pause_ms = std::max(m_stats.m_max_pause_ms, pause.count());
+}
+
+export void TrackContainer(Container* container, std::size_t size)
+{
+	Heap::Get().Track(container, size);
+}
+
+//Memory outside the heap that containers keep alive (e.g. the tree of a REPL line its functions point into).
+//It is counted with the tracked bytes, so the cycles holding it are collected as often as their own size requires.
+export void AddExternalMemory(std::size_t bytes)
+{
+	Heap::Get().AddExternal(bytes);
+}
+
+export void RemoveExternalMemory(std::size_t bytes)
+{
+	Heap::Get().RemoveExternal(bytes);
+}
+
+//Forces a full collection of the current isolate, e.g. before reporting GC stats.
+export void CollectGarbage()
+{
+	Heap::Get().Collect();
+}
+
+export void SetGcGrowthFactor(double factor)
+{
+	Heap::Get().SetGrowthFactor(factor);
+}
+
+export const GcStats& GetGcStats()
+{
+	return Heap::Get().Stats();
+}
+
+export struct StringPoolStats
+{
+	std::size_t m_count = 0; //Live interned strings
+	std::size_t m_bytes = 0; //Their characters
+	std::size_t m_lookups = 0; //Calls to Intern
+	std::size_t m_hits = 0; //Calls that found an existing string
+};
+
+//Weak set of all live strings: an ObjString removes itself when its last reference is gone,
+//so interning runtime strings (e.g. concatenation results) does not keep them alive.
+class StringPool
+{
+	struct Hash
+	{
+		using is_transparent = void;
+		std::size_t operator()(const ObjString* str) const
+		{
+			return str->Hash();
+		}
+		std::size_t operator()(std::string_view str) const
+		{
+			return std::hash<std::string_view>{}(str);
+		}
+	};
+	struct Equal
+	{
+		using is_transparent = void;
+		bool operator()(const ObjString* lhs, const ObjString* rhs) const
+		{
+			return lhs == rhs;
+		}
+		bool operator()(std::string_view lhs, const ObjString* rhs) const
+		{
+			return lhs == rhs->Str();
+		}
+		bool operator()(const ObjString* lhs, std::string_view rhs) const
+		{
+			return lhs->Str() == rhs;
+		}
+	};
+	std::unordered_set<ObjString*, Hash, Equal> m_strings;
+	StringPoolStats m_stats;
+public:
+	//The current isolate's pool.
+	static StringPool& Get();
+	template<class Str>
+	Ref<ObjString> Intern(Str&& str)
+	{
+		++m_stats.m_lookups;
+		const std::string_view view{ str };
+		const auto hash = Hash{}(view);
+		const auto it = m_strings.find(view);
+		if (it != std::end(m_strings))
+		{
+			++m_stats.m_hits;
+			return Ref<ObjString>(*it);
+		}
+		auto* res = new ObjString(std::string(std::forward<Str>(str)), hash);
+		m_strings.insert(res);
+		++m_stats.m_count;
+		m_stats.m_bytes += res->Str().size();
+		return Ref<ObjString>(res);
+	}
+	void Remove(const ObjString* str)
+	{
+		m_strings.erase(const_cast<ObjString*>(str));
+		--m_stats.m_count;
+		m_stats.m_bytes -= str->Str().size();
+	}
+	const StringPoolStats& Stats() const
+	{
+		return m_stats;
+	}
+};
+
+//When what print writes reaches the stream.
+export enum class FlushPolicy : std::uint8_t
+{
+	//Written and flushed by every print, for output that is read as it is produced.
+	LINE,
+	//Written 64 KB at a time and on Flush.
+	FULL,
+	//Written by every print, the stream decides when to flush
+	//(std::cout: every line on a terminal, when its buffer is full otherwise).
+	NONE,
+};
+
+//Buffered sink print writes to. Values are formatted straight into the buffer.
+export class Output
+{
+	static constexpr std::size_t BUFFER_SIZE = 64 * 1024;
+	std::ostream& m_stream;
+	std::string m_buffer;
+	FlushPolicy m_policy;
+public:
+	explicit Output(std::ostream& stream, FlushPolicy policy = FlushPolicy::NONE)
+		: m_stream(stream)
+		, m_policy(policy)
+	{}
+	~Output()
+	{
+		Flush();
+	}
+	Output(const Output&) = delete;
+	Output& operator=(const Output&) = delete;
+
+	//val and a newline.
+	void Print(const Value& val);
+	//Writes what is buffered and flushes the stream, e.g. before an error is reported
+	//so it does not overtake the output that preceded it.
+	void Flush()
+	{
+		Write();
+		m_stream.flush();
+	}
+	void SetPolicy(FlushPolicy policy)
+	{
+		Flush();
+		m_policy = policy;
+	}
+	std::ostream& Stream() const
+	{
+		return m_stream;
+	}
+private:
+	void Write()
+	{
+		if (m_buffer.empty())
+			return;
+		m_stream.write(m_buffer.data(), static_cast<std::streamsize>(m_buffer.size()));
+		m_buffer.clear();
+	}
+};
+
+//Everything the objects of one interpreter instance share that is not owned by the Interpreter or VM:
+//the Heap that collects their cycles, the StringPool their strings are interned in,
+//where print writes and the errors reported while compiling or running.
+//Objects never leave the isolate they were created in, so isolates need no locks and
+//run in parallel on different threads. A thread works in the isolate it entered with a Scope,
+//or in a default one of its own (the whole process used to be that single isolate).
+//An isolate must outlive the objects created in it.
+export class Isolate
+{
+	friend class Heap;
+	friend class StringPool;
+	Heap m_heap;
+	StringPool m_strings;
+	Output m_out;
+	std::ostream& m_errors;
+public:
+	//Set by log when an error is reported in this isolate.
+	bool m_has_error = false;
+	bool m_has_runtime_error = false;
+
+	explicit Isolate(std::ostream& out = std::cout, std::ostream& errors = std::cerr, FlushPolicy policy = FlushPolicy::NONE)
+		: m_out(out, policy)
+		, m_errors(errors)
+	{}
+	~Isolate();
+	Isolate(const Isolate&) = delete;
+	Isolate& operator=(const Isolate&) = delete;
+
+	static Isolate& Current();
+	Output& Out()
+	{
+		return m_out;
+	}
+	std::ostream& Errors() const
+	{
+		return m_errors;
+	}
+
+	//Makes an isolate current on this thread until the end of the scope.
+	//An isolate is entered by one thread at a time.
+	class Scope
+	{
+		Isolate* const m_previous;
+	public:
+		explicit Scope(Isolate& isolate);
+		~Scope();
+		Scope(const Scope&) = delete;
+		Scope& operator=(const Scope&) = delete;
+	};
+};
+
+static thread_local Isolate* current_isolate = nullptr;
+
+Isolate& Isolate::Current()
+{
+	//Never destroyed: strings and containers owned by statics are released after main returns.
+	if (!current_isolate)
+		current_isolate = new Isolate();
+	return *current_isolate;
+}
+
+Isolate::~Isolate()
+{
+	//Whatever is left of the scripts run here is only referenced by cycles now.
+	const Scope scope{ *this };
+	m_heap.Collect();
+}
+
+Isolate::Scope::Scope(Isolate& isolate)
+	: m_previous(std::exchange(current_isolate, &isolate))
+{}
+
+Isolate::Scope::~Scope()
+{
+	current_isolate = m_previous;
+}
+
+Heap& Heap::Get()
+{
+	return Isolate::Current().m_heap;
+}
+
+StringPool& StringPool::Get()
+{
+	return Isolate::Current().m_strings;
+}
+
+ObjString::~ObjString()
+{
+	StringPool::Get().Remove(this);
+}
+
+export Ref<ObjString> Intern(std::string_view str)
+{
+	return StringPool::Get().Intern(str);
+}
+
+export const StringPoolStats& GetStringPoolStats()
+{
+	return StringPool::Get().Stats();
+}
+
+export Value MakeString(std::string str)
+{
+	return StringPool::Get().Intern(std::move(str));
+}
+
+ObjString* ObjConcat::Interned() const
+{
+	if (!m_interned)
+		m_interned = StringPool::Get().Intern(View());
+	return m_interned.get();
+}
+
+//The shortest text that reads back as the same double: 6, 0.1, 1e+21.
+//Integers that are exact in a double are written in full (1000000, not 1e+06).
+static void AppendNumber(std::string& str, double number)
+{
+	constexpr double max_exact = 9007199254740992.0; //2^53
+	char buffer[32];
+	const auto res = std::abs(number) < max_exact && std::trunc(number) == number
+		? std::to_chars(std::begin(buffer), std::end(buffer), number, std::chars_format::fixed)
+		: std::to_chars(std::begin(buffer), std::end(buffer), number);
+	str.append(buffer, res.ptr);
+}
+
+//Appends what print writes for val, without a temporary string unless val is an object other than a string.
+export void AppendValue(std::string& str, const Value& val)
+{
+	if (val.IsNumber())
+		AppendNumber(str, val.AsNumber());
+	else if (val.IsNil())
+		str += "nil";
+	else if (val.IsBool())
+		str += val.AsBool() ? "true" : "false";
+	else if (val.IsString())
+		str += val.AsStringView();
+	else
+		str += val.AsObject()->ToString();
+}
+
+export std::string Stringify(const Value& val)
+{
+	std::string res;
+	AppendValue(res, val);
+	return res;
+}
+
+static std::size_t StringLength(const Value& val)
+{
+	return val.IsNumber() ? 0 : val.AsStringView().size();
+}
+
+//left + right, where both are strings or one is a string and the other a number.
+export Value Concatenate(const Value& left, const Value& right)
+{
+	if (left.IsObjType(ObjType::CONCAT))
+	{
+		const auto& buffer = left.As<ObjConcat>()->Buffer();
+		//Appending could move the characters right views if it is in the same buffer (s + s).
+		const auto same_buffer = right.IsObjType(ObjType::CONCAT) && right.As<ObjConcat>()->Buffer() == buffer;
+		if (left.As<ObjConcat>()->IsLongest() && !same_buffer)
+		{
+			AppendValue(*buffer, right);
+			return MakeRef<ObjConcat>(buffer);
+		}
+	}
+	auto buffer = std::make_shared<std::string>();
+	buffer->reserve(StringLength(left) + StringLength(right));
+	AppendValue(*buffer, left);
+	AppendValue(*buffer, right);
+	return MakeRef<ObjConcat>(std::move(buffer));
+}
+
+//Tables keyed by interned strings only hash and compare the pointer.
+//Lookups can be done with a raw ObjString* without touching its reference count.
+export struct InternedHash
+{
+	using is_transparent = void;
+	std::size_t operator()(const ObjString* str) const
+	{
+		return std::hash<const ObjString*>{}(str);
+	}
+	std::size_t operator()(const Ref<ObjString>& str) const
+	{
+		return std::hash<const ObjString*>{}(str.get());
+	}
+};
+
+export struct InternedEqual
+{
+	using is_transparent = void;
+	static const ObjString* Ptr(const ObjString* str)
+	{
+		return str;
+	}
+	static const ObjString* Ptr(const Ref<ObjString>& str)
+	{
+		return str.get();
+	}
+	template<class L, class R>
+	bool operator()(const L& lhs, const R& rhs) const
+	{
+		return Ptr(lhs) == Ptr(rhs);
+	}
+};
+
+export template<class T>
+using StringMap = std::unordered_map<Ref<ObjString>, T, InternedHash, InternedEqual>;
+
+static_assert(sizeof(Value) == sizeof(std::uint64_t));
+
+export bool IsTruthy(const Value& val)
+{
+	if (val.IsNil())
+		return false;
+	if (val.IsBool())
+		return val.AsBool();
+	return true;
+}
+
+export bool IsEqual(const Value& left, const Value& right)
+{
+	if (left.IsNumber() && right.IsNumber())
+		return left.AsNumber() == right.AsNumber();
+	//Strings are interned, so equal strings are the same object.
+	//Concatenation results are interned here, the first time they are compared.
+	if (left.IsObjType(ObjType::CONCAT) || right.IsObjType(ObjType::CONCAT))
+		return left.IsString() && right.IsString() && left.AsInterned() == right.AsInterned();
+	return left.IsSame(right);
+}
+
+void Output::Print(const Value& val)
+{
+	AppendValue(m_buffer, val);
+	m_buffer += '\n';
+	switch (m_policy)
+	{
+	case FlushPolicy::LINE:
+		Flush();
+		break;
+	case FlushPolicy::FULL:
+		if (m_buffer.size() >= BUFFER_SIZE)
+			Write();
+		break;
+	case FlushPolicy::NONE:
+		Write();
+		break;
+	}
+}
@@ -0,0 +1,752 @@
+export module vm;
+
+import array;
+import compiler;
+import core;
+import log;
+import value;
+
+import <array>;
+import <cstdint>;
+import <functional>;
+import <iostream>;
+import <memory>;
+import <string>;
+import <string_view>;
+import <unordered_map>;
+import <vector>;
+
+//Names are interned, so globals, fields and methods are found by pointer.
+using Table = StringMap<Value>;
+
+using NativeFn = Value(*)(int arg_count, const Value* args);
+
+export class ObjNative : public Object
+{
+public:
+	const NativeFn m_function;
+	const int m_arity;
+	ObjNative(NativeFn function, int arity)
+		: Object(ObjType::VM_NATIVE)
+		, m_function(function)
+		, m_arity(arity)
+	{}
+	std::string ToString() const override
+	{
+		return "<native fn>";
+	}
+};
+
+//Closures, classes, instances, bound methods and upvalues can reference each other in cycles,
+//so they are Containers collected by the Heap. Functions and natives only reference strings.
+export class ObjUpvalue : public Container
+{
+public:
+	//Points into the VM stack while the variable is alive, then to m_closed.
+	Value* m_location;
+	Value m_closed;
+	Ref<ObjUpvalue> m_next;
+	explicit ObjUpvalue(Value* slot)
+		: Container(ObjType::UPVALUE)
+		, m_location(slot)
+	{}
+	std::string ToString() const override
+	{
+		return "upvalue";
+	}
+	//An open upvalue does not own the stack slot it points to.
+	void Trace(Tracer& tracer) const override
+	{
+		tracer.Visit(m_closed);
+		tracer.Visit(m_next);
+	}
+	void Clear() override
+	{
+		m_closed = {};
+		m_next = nullptr;
+	}
+};
+
+export class ObjClosure : public Container
+{
+public:
+	const Ref<ObjFunction> m_function;
+	std::vector<Ref<ObjUpvalue>> m_upvalues;
+	explicit ObjClosure(Ref<ObjFunction> function)
+		: Container(ObjType::CLOSURE)
+		, m_function(std::move(function))
+	{
+		m_upvalues.resize(m_function->m_upvalue_count);
+	}
+	std::string ToString() const override
+	{
+		return m_function->ToString();
+	}
+	void Trace(Tracer& tracer) const override
+	{
+		tracer.Visit(m_upvalues);
+	}
+	void Clear() override
+	{
+		m_upvalues.clear();
+	}
+};
+
+export class ObjClass : public Container
+{
+public:
+	const std::string m_name;
+	Table m_methods;
+	explicit ObjClass(std::string name)
+		: Container(ObjType::VM_CLASS)
+		, m_name(std::move(name))
+	{}
+	std::string ToString() const override
+	{
+		return m_name;
+	}
+	void Trace(Tracer& tracer) const override
+	{
+		tracer.Visit(m_methods);
+	}
+	void Clear() override
+	{
+		m_methods.clear();
+	}
+};
+
+export class ObjInstance : public Container
+{
+public:
+	Ref<ObjClass> m_class;
+	Table m_fields;
+	explicit ObjInstance(Ref<ObjClass> klass)
+		: Container(ObjType::VM_INSTANCE)
+		, m_class(std::move(klass))
+	{}
+	std::string ToString() const override
+	{
+		return m_class->m_name + " instance";
+	}
+	void Trace(Tracer& tracer) const override
+	{
+		tracer.Visit(m_class);
+		tracer.Visit(m_fields);
+	}
+	void Clear() override
+	{
+		m_fields.clear();
+		m_class = nullptr;
+	}
+};
+
+export class ObjBoundMethod : public Container
+{
+public:
+	Value m_receiver;
+	Ref<ObjClosure> m_method;
+	ObjBoundMethod(Value receiver, Ref<ObjClosure> method)
+		: Container(ObjType::BOUND_METHOD)
+		, m_receiver(std::move(receiver))
+		, m_method(std::move(method))
+	{}
+	std::string ToString() const override
+	{
+		return m_method->ToString();
+	}
+	void Trace(Tracer& tracer) const override
+	{
+		tracer.Visit(m_receiver);
+		tracer.Visit(m_method);
+	}
+	void Clear() override
+	{
+		m_receiver = {};
+		m_method = nullptr;
+	}
+};
+
+export class VM
+{
+	static constexpr int FRAMES_MAX = 1024;
+	static constexpr int STACK_MAX = FRAMES_MAX * (UINT8_MAX + 1);
+
+	struct CallFrame
+	{
+		Ref<ObjClosure> m_closure;
+		const std::uint8_t* m_ip = nullptr;
+		Value* m_slots = nullptr;
+	};
+
+	std::unique_ptr<CallFrame[]> m_frames;
+	int m_frame_count = 0;
+	std::unique_ptr<Value[]> m_stack;
+	Value* m_stack_top = nullptr;
+	Table m_globals;
+	Ref<ObjUpvalue> m_open_upvalues;
+	const Ref<ObjString> m_init_string = Intern("init");
+public:
+	VM();
+	void Interpret(Ref<ObjFunction> script);
+private:
+	void Run();
+	void ResetStack();
+	void Push(const Value& value)
+	{
+		*m_stack_top++ = value;
+	}
+	void Push(Value&& value)
+	{
+		*m_stack_top++ = std::move(value);
+	}
+	Value Pop()
+	{
+		return std::move(*--m_stack_top);
+	}
+	Value& Peek(int distance)
+	{
+		return m_stack_top[-1 - distance];
+	}
+	void CallValue(Value& callee, int arg_count);
+	void Call(ObjClosure* closure, int arg_count);
+	void Invoke(const ObjString* name, int arg_count);
+	void InvokeFromClass(ObjClass* klass, const ObjString* name, int arg_count);
+	void BindMethod(ObjClass* klass, const ObjString* name);
+	Ref<ObjUpvalue> CaptureUpvalue(Value* local);
+	void CloseUpvalues(const Value* last);
+	void DefineNative(std::string_view name, NativeFn function, int arity);
+	RuntimeError Error(const std::string& message) const;
+};
+
+module :private;
+
+static Value ClockNative(int arg_count, const Value* args)
+{
+	return ClockSeconds();
+}
+
+VM::VM()
+	: m_frames(std::make_unique<CallFrame[]>(FRAMES_MAX))
+	, m_stack(std::make_unique<Value[]>(STACK_MAX))
+{
+	ResetStack();
+	DefineNative("clock", ClockNative, 0);
+	for (const auto& native : ArrayNatives())
+		DefineNative(native.m_name, native.m_function, native.m_arity);
+}
+
+void VM::Interpret(Ref<ObjFunction> script) try
+{
+	auto closure = MakeRef<ObjClosure>(std::move(script));
+	Push(closure);
+	Call(closure.get(), 0);
+	Run();
+}
+catch (const RuntimeError& err)
+{
+	HandleRuntimeError(err);
+	ResetStack();
+}
+
+void VM::Run()
+{
+	auto* frame = &m_frames[m_frame_count - 1];
+	const auto* ip = frame->m_ip;
+	const auto* constants = frame->m_closure->m_function->m_chunk.m_constants.data();
+
+	const auto read_byte = [&]() { return *ip++; };
+	const auto read_short = [&]()
+	{
+		ip += 2;
+		return static_cast<std::uint16_t>((ip[-2] << 8) | ip[-1]);
+	};
+	const auto read_constant = [&]() -> const Value&
+	{
+		return constants[read_short()];
+	};
+	const auto read_string = [&]() -> ObjString*
+	{
+		return read_constant().As<ObjString>();
+	};
+	//Keeps the frame's ip in sync, so errors report the right line and calls can return.
+	const auto sync = [&]() { frame->m_ip = ip; };
+	const auto reload = [&]()
+	{
+		frame = &m_frames[m_frame_count - 1];
+		ip = frame->m_ip;
+		constants = frame->m_closure->m_function->m_chunk.m_constants.data();
+	};
+	const auto check_numbers = [&]()
+	{
+		if (!Peek(0).IsNumber() || !Peek(1).IsNumber())
+		{
+			sync();
+			throw Error("Operands must be numbers.");
+		}
+	};
+
+	while (true)
+	{
+		switch (static_cast<OpCode>(read_byte()))
+		{
+		case OpCode::CONSTANT:
+			Push(read_constant());
+			break;
+		case OpCode::NIL: Push(Value{}); break;
+		case OpCode::TRUE: Push(true); break;
+		case OpCode::FALSE: Push(false); break;
+		case OpCode::POP: Pop(); break;
+		case OpCode::GET_LOCAL:
+			Push(frame->m_slots[read_byte()]);
+			break;
+		case OpCode::SET_LOCAL:
+			frame->m_slots[read_byte()] = Peek(0);
+			break;
+		case OpCode::GET_GLOBAL:
+		{
+			auto* name = read_string();
+			const auto it = m_globals.find(name);
+			if (it == std::end(m_globals))
+			{
+				sync();
+				throw Error("Undefined variable '" + name->Str() + "'.");
+			}
+			Push(it->second);
+			break;
+		}
+		case OpCode::DEFINE_GLOBAL:
+			m_globals.insert_or_assign(Ref<ObjString>(read_string()), Pop());
+			break;
+		case OpCode::SET_GLOBAL:
+		{
+			auto* name = read_string();
+			const auto it = m_globals.find(name);
+			if (it == std::end(m_globals))
+			{
+				sync();
+				throw Error("Undefined variable'" + name->Str() + "'.");
+			}
+			it->second = Peek(0);
+			break;
+		}
+		case OpCode::GET_UPVALUE:
+			Push(*frame->m_closure->m_upvalues[read_byte()]->m_location);
+			break;
+		case OpCode::SET_UPVALUE:
+			*frame->m_closure->m_upvalues[read_byte()]->m_location = Peek(0);
+			break;
+		case OpCode::GET_PROPERTY:
+		{
+			auto* name = read_string();
+			if (!Peek(0).IsObjType(ObjType::VM_INSTANCE))
+			{
+				sync();
+				throw Error("Only instances have properties.");
+			}
+			auto* instance = Peek(0).As<ObjInstance>();
+			const auto it = instance->m_fields.find(name);
+			if (it != std::end(instance->m_fields))
+			{
+				auto value = it->second;
+				Pop();
+				Push(std::move(value));
+				break;
+			}
+			sync();
+			BindMethod(instance->m_class.get(), name);
+			break;
+		}
+		case OpCode::SET_PROPERTY:
+		{
+			auto* name = read_string();
+			if (!Peek(1).IsObjType(ObjType::VM_INSTANCE))
+			{
+				sync();
+				throw Error("Only instances have fields.");
+			}
+			auto value = Pop();
+			auto object = Pop();
+			object.As<ObjInstance>()->m_fields.insert_or_assign(Ref<ObjString>(name), value);
+			Push(std::move(value));
+			break;
+		}
+		case OpCode::GET_SUPER:
+		{
+			auto* name = read_string();
+			auto superclass = Pop();
+			sync();
+			BindMethod(superclass.As<ObjClass>(), name);
+			break;
+		}
+		case OpCode::EQUAL:
+		{
+			auto b = Pop();
+			auto a = Pop();
+			Push(IsEqual(a, b));
+			break;
+		}
+		case OpCode::NOT_EQUAL:
+		{
+			auto b = Pop();
+			auto a = Pop();
+			Push(!IsEqual(a, b));
+			break;
+		}
+		case OpCode::GREATER:
+		{
+			check_numbers();
+			const auto b = Pop().AsNumber();
+			const auto a = Pop().AsNumber();
+			Push(a > b);
+			break;
+		}
+		case OpCode::GREATER_EQUAL:
+		{
+			check_numbers();
+			const auto b = Pop().AsNumber();
+			const auto a = Pop().AsNumber();
+			Push(a >= b);
+			break;
+		}
+		case OpCode::LESS:
+		{
+			check_numbers();
+			const auto b = Pop().AsNumber();
+			const auto a = Pop().AsNumber();
+			Push(a < b);
+			break;
+		}
+		case OpCode::LESS_EQUAL:
+		{
+			check_numbers();
+			const auto b = Pop().AsNumber();
+			const auto a = Pop().AsNumber();
+			Push(a <= b);
+			break;
+		}
+		case OpCode::ADD:
+		{
+			auto b = Pop();
+			auto a = Pop();
+			if (a.IsNumber() && b.IsNumber())
+				Push(a.AsNumber() + b.AsNumber());
+			else if ((a.IsString() || a.IsNumber()) && (b.IsString() || b.IsNumber()))
+				Push(Concatenate(a, b));
+			else
+			{
+				sync();
+				throw Error("Operands must be two numbers or two strings.");
+			}
+			break;
+		}
+		case OpCode::SUBTRACT:
+		{
+			check_numbers();
+			const auto b = Pop().AsNumber();
+			const auto a = Pop().AsNumber();
+			Push(a - b);
+			break;
+		}
+		case OpCode::MULTIPLY:
+		{
+			check_numbers();
+			const auto b = Pop().AsNumber();
+			const auto a = Pop().AsNumber();
+			Push(a * b);
+			break;
+		}
+		case OpCode::DIVIDE:
+		{
+			check_numbers();
+			const auto b = Pop().AsNumber();
+			const auto a = Pop().AsNumber();
+			Push(a / b);
+			break;
+		}
+		case OpCode::NOT:
+			Push(!IsTruthy(Pop()));
+			break;
+		case OpCode::NEGATE:
+			if (!Peek(0).IsNumber())
+			{
+				sync();
+				throw Error("Operand must be a number.");
+			}
+			Push(-Pop().AsNumber());
+			break;
+		case OpCode::PRINT:
+			Isolate::Current().Out().Print(Pop());
+			break;
+		case OpCode::JUMP:
+		{
+			const auto offset = read_short();
+			ip += offset;
+			break;
+		}
+		case OpCode::JUMP_IF_FALSE:
+		{
+			const auto offset = read_short();
+			if (!IsTruthy(Peek(0)))
+				ip += offset;
+			break;
+		}
+		case OpCode::LOOP:
+		{
+			const auto offset = read_short();
+			ip -= offset;
+			break;
+		}
+		case OpCode::CALL:
+		{
+			const auto arg_count = read_byte();
+			sync();
+			CallValue(Peek(arg_count), arg_count);
+			reload();
+			break;
+		}
+		case OpCode::INVOKE:
+		{
+			auto* method = read_string();
+			const auto arg_count = read_byte();
+			sync();
+			Invoke(method, arg_count);
+			reload();
+			break;
+		}
+		case OpCode::SUPER_INVOKE:
+		{
+			auto* method = read_string();
+			const auto arg_count = read_byte();
+			auto superclass = Pop();
+			sync();
+			InvokeFromClass(superclass.As<ObjClass>(), method, arg_count);
+			reload();
+			break;
+		}
+		case OpCode::CLOSURE:
+		{
+			auto closure = MakeRef<ObjClosure>(read_constant().AsRef<ObjFunction>());
+			for (auto& upvalue : closure->m_upvalues)
+			{
+				const auto is_local = read_byte();
+				const auto index = read_byte();
+				if (is_local)
+					upvalue = CaptureUpvalue(frame->m_slots + index);
+				else
+					upvalue = frame->m_closure->m_upvalues[index];
+			}
+			Push(std::move(closure));
+			break;
+		}
+		case OpCode::CLOSE_UPVALUE:
+			CloseUpvalues(m_stack_top - 1);
+			Pop();
+			break;
+		case OpCode::RETURN:
+		{
+			auto result = Pop();
+			CloseUpvalues(frame->m_slots);
+			--m_frame_count;
+			while (m_stack_top > frame->m_slots)
+				Pop();
+			frame->m_closure = nullptr;
+			if (m_frame_count == 0)
+				return;
+			Push(std::move(result));
+			reload();
+			break;
+		}
+		case OpCode::CLASS:
+			Push(MakeRef<ObjClass>(read_string()->Str()));
+			break;
+		case OpCode::INHERIT:
+		{
+			if (!Peek(1).IsObjType(ObjType::VM_CLASS))
+			{
+				sync();
+				throw Error("Superclass must be a class.");
+			}
+			//Classes are immutable once defined, so inheriting is a one time copy-down of methods.
+			const auto& methods = Peek(1).As<ObjClass>()->m_methods;
+			Peek(0).As<ObjClass>()->m_methods.insert(std::begin(methods), std::end(methods));
+			Pop();
+			break;
+		}
+		case OpCode::METHOD:
+		{
+			auto* name = read_string();
+			auto method = Pop();
+			Peek(0).As<ObjClass>()->m_methods.insert_or_assign(Ref<ObjString>(name), std::move(method));
+			break;
+		}
+		}
+	}
+}
+
+void VM::ResetStack()
+{
+	while (m_frame_count > 0)
+		m_frames[--m_frame_count].m_closure = nullptr;
+	m_open_upvalues = nullptr;
+	if (m_stack_top)
+	{
+		while (m_stack_top > m_stack.get())
+			Pop();
+	}
+	m_stack_top = m_stack.get();
+}
+
+void VM::CallValue(Value& callee, int arg_count)
+{
+	if (callee.IsObject())
+	{
+		switch (callee.AsObject()->GetType())
+		{
+		case ObjType::CLOSURE:
+			Call(callee.As<ObjClosure>(), arg_count);
+			return;
+		case ObjType::BOUND_METHOD:
+		{
+			auto bound = callee.AsRef<ObjBoundMethod>();
+			callee = bound->m_receiver;
+			Call(bound->m_method.get(), arg_count);
+			return;
+		}
+		case ObjType::VM_CLASS:
+		{
+			auto klass = callee.AsRef<ObjClass>();
+			callee = MakeRef<ObjInstance>(klass);
+			const auto it = klass->m_methods.find(m_init_string);
+			if (it != std::end(klass->m_methods))
+				Call(it->second.As<ObjClosure>(), arg_count);
+			else if (arg_count != 0)
+				throw Error("Expected 0 arguments but got " + std::to_string(arg_count) + ".");
+			return;
+		}
+		case ObjType::VM_NATIVE:
+		{
+			auto* native = callee.As<ObjNative>();
+			if (arg_count != native->m_arity)
+			{
+				throw Error("Expected " + std::to_string(native->m_arity) +
+					" arguments but got " + std::to_string(arg_count) + ".");
+			}
+			Value result;
+			try
+			{
+				result = native->m_function(arg_count, m_stack_top - arg_count);
+			}
+			catch (const NativeError& error)
+			{
+				throw Error(error.what());
+			}
+			for (int i = 0; i <= arg_count; ++i)
+				Pop();
+			Push(std::move(result));
+			return;
+		}
+		default:
+			break;
+		}
+	}
+	throw Error("Can only call functions and classes.");
+}
+
+void VM::Call(ObjClosure* closure, int arg_count)
+{
+	if (arg_count != closure->m_function->m_arity)
+	{
+		throw Error("Expected " + std::to_string(closure->m_function->m_arity) +
+			" arguments but got " + std::to_string(arg_count) + ".");
+	}
+	if (m_frame_count == FRAMES_MAX)
+		throw Error("Stack overflow.");
+	auto& frame = m_frames[m_frame_count++];
+	frame.m_closure = Ref<ObjClosure>(closure);
+	frame.m_ip = closure->m_function->m_chunk.m_code.data();
+	frame.m_slots = m_stack_top - arg_count - 1;
+}
+
+void VM::Invoke(const ObjString* name, int arg_count)
+{
+	auto& receiver = Peek(arg_count);
+	if (!receiver.IsObjType(ObjType::VM_INSTANCE))
+		throw Error("Only instances have properties.");
+	auto* instance = receiver.As<ObjInstance>();
+	const auto it = instance->m_fields.find(name);
+	if (it != std::end(instance->m_fields))
+	{
+		receiver = it->second;
+		CallValue(receiver, arg_count);
+		return;
+	}
+	InvokeFromClass(instance->m_class.get(), name, arg_count);
+}
+
+void VM::InvokeFromClass(ObjClass* klass, const ObjString* name, int arg_count)
+{
+	const auto it = klass->m_methods.find(name);
+	if (it == std::end(klass->m_methods))
+		throw Error("Undefined property'" + name->Str() + "'.");
+	Call(it->second.As<ObjClosure>(), arg_count);
+}
+
+void VM::BindMethod(ObjClass* klass, const ObjString* name)
+{
+	const auto it = klass->m_methods.find(name);
+	if (it == std::end(klass->m_methods))
+		throw Error("Undefined property'" + name->Str() + "'.");
+	auto bound = MakeRef<ObjBoundMethod>(Peek(0), it->second.AsRef<ObjClosure>());
+	Pop();
+	Push(std::move(bound));
+}
+
+Ref<ObjUpvalue> VM::CaptureUpvalue(Value* local)
+{
+	ObjUpvalue* prev = nullptr;
+	auto* upvalue = m_open_upvalues.get();
+	while (upvalue && upvalue->m_location > local)
+	{
+		prev = upvalue;
+		upvalue = upvalue->m_next.get();
+	}
+	if (upvalue && upvalue->m_location == local)
+		return Ref<ObjUpvalue>(upvalue);
+
+	auto created = MakeRef<ObjUpvalue>(local);
+	created->m_next = Ref<ObjUpvalue>(upvalue);
+	if (prev)
+		prev->m_next = created;
+	else
+		m_open_upvalues = created;
+	return created;
+}
+
+void VM::CloseUpvalues(const Value* last)
+{
+	while (m_open_upvalues && m_open_upvalues->m_location >= last)
+	{
+		auto upvalue = std::move(m_open_upvalues);
+		upvalue->m_closed = std::move(*upvalue->m_location);
+		upvalue->m_location = &upvalue->m_closed;
+		m_open_upvalues = std::move(upvalue->m_next);
+	}
+}
+
+void VM::DefineNative(std::string_view name, NativeFn function, int arity)
+{
+	m_globals.insert_or_assign(Intern(name), MakeRef<ObjNative>(function, arity));
+}
+
+RuntimeError VM::Error(const std::string& message) const
+{
+	int line = -1;
+	if (m_frame_count > 0)
+	{
+		const auto& frame = m_frames[m_frame_count - 1];
+		const auto& chunk = frame.m_closure->m_function->m_chunk;
+		const auto offset = frame.m_ip - chunk.m_code.data() - 1;
+		line = chunk.m_lines[offset];
+	}
+	return RuntimeError(Token(TokenType::UNDEF, "", {}, line), message);
+}